@@ -0,0 +1,135 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "conversion_cache.h"
+#include "particle_hash.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+
+static bool
+FileExists(
+  const std::string& filename)
+{
+  struct stat st;
+  return (stat(filename.c_str(), &st) == 0);
+}
+
+bool
+ConversionManifest::Load(
+  const std::string& filename)
+{
+  std::ifstream ifs(filename.c_str());
+  if (!ifs) {
+    return false;
+  }
+
+  bodies_.clear();
+  bool hasInput = false;
+
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream ss(line);
+    std::string tag;
+    ss >> tag;
+
+    if (tag == "input") {
+      std::string inputHash, settingsHash;
+      ss >> inputHash >> settingsHash >> numOutputs_;
+      if (!ss ||
+          !StringToHash(inputHash_, inputHash) ||
+          !StringToHash(settingsHash_, settingsHash)) {
+        return false;
+      }
+      hasInput = true;
+    } else if (tag == "body") {
+      Body body;
+      std::string dataHash;
+      ss >> body.index >> dataHash;
+      std::getline(ss >> std::ws, body.output);  // May contain spaces.
+      if (!ss || !StringToHash(body.dataHash, dataHash)) {
+        return false;
+      }
+      bodies_.push_back(body);
+    }
+  }
+
+  return hasInput;
+}
+
+bool
+ConversionManifest::Save(
+  const std::string& filename) const
+{
+  std::string tmpFilename = filename + ".tmp";
+  {
+    std::ofstream ofs(tmpFilename.c_str());
+    if (!ofs) {
+      return false;
+    }
+
+    ofs << "input " << HashToString(inputHash_) << " " << HashToString(settingsHash_)
+        << " " << numOutputs_ << "\n";
+    for (size_t i = 0; i < bodies_.size(); i++) {
+      ofs << "body " << bodies_[i].index << " " << HashToString(bodies_[i].dataHash)
+          << " " << bodies_[i].output << "\n";
+    }
+
+    if (!ofs) {
+      return false;
+    }
+  }
+
+  return (rename(tmpFilename.c_str(), filename.c_str()) == 0);
+}
+
+bool
+ConversionManifest::IsUpToDate(
+  uint64_t inputHash,
+  uint64_t settingsHash) const
+{
+  if ((inputHash != inputHash_) || (settingsHash != settingsHash_)) {
+    return false;
+  }
+
+  // An output which failed to be written is not recorded.
+  if (bodies_.size() != numOutputs_) {
+    return false;
+  }
+
+  for (size_t i = 0; i < bodies_.size(); i++) {
+    if (!FileExists(bodies_[i].output)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+const ConversionManifest::Body*
+ConversionManifest::FindBody(
+  int index) const
+{
+  for (size_t i = 0; i < bodies_.size(); i++) {
+    if (bodies_[i].index == index) {
+      return &bodies_[i];
+    }
+  }
+  return NULL;
+}
+
+bool
+ConversionManifest::IsBodyUpToDate(
+  int index,
+  uint64_t dataHash,
+  const std::string& output) const
+{
+  const Body* body = FindBody(index);
+  return body &&
+         (body->dataHash == dataHash) &&
+         (body->output == output) &&
+         FileExists(output);
+}
@@ -0,0 +1,60 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Sidecar manifest recording what an output was converted from.
+//
+// A frame is skipped entirely when the hash of the input EMP and of the
+// conversion settings are unchanged. Otherwise each body is still
+// extracted, but its output is kept as is when the hash of the extracted
+// data matches.
+//
+// Manifest is a text file:
+//
+//   input <input hash> <settings hash> <number of outputs>
+//   body <index> <data hash> <output filename>
+//   ...
+//
+#ifndef CONVERSION_CACHE_H_
+#define CONVERSION_CACHE_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class ConversionManifest
+{
+ public:
+  struct Body {
+    int         index;
+    uint64_t    dataHash;
+    std::string output;
+  };
+
+  ConversionManifest() : inputHash_(0), settingsHash_(0), numOutputs_(0) {}
+  ~ConversionManifest() {}
+
+  // Returns false when the manifest does not exist or is broken.
+  bool Load(const std::string& filename);
+
+  // Written atomically(temp file + rename).
+  bool Save(const std::string& filename) const;
+
+  // True when inputs and settings are unchanged and every output of the
+  // frame is recorded and exists.
+  bool IsUpToDate(uint64_t inputHash, uint64_t settingsHash) const;
+
+  // NULL when `index` is not recorded.
+  const Body* FindBody(int index) const;
+
+  // True when the body was converted from the same data and its output exists.
+  bool IsBodyUpToDate(int index, uint64_t dataHash, const std::string& output) const;
+
+  uint64_t          inputHash_;
+  uint64_t          settingsHash_;
+  size_t            numOutputs_;    // Outputs the frame has, written or not.
+  std::vector<Body> bodies_;
+};
+
+#endif  // CONVERSION_CACHE_H_
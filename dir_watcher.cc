@@ -0,0 +1,151 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "dir_watcher.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+static volatile sig_atomic_t gStopRequested = 0;
+
+static void
+OnStopSignal(
+  int sig)
+{
+  (void)sig;
+  gStopRequested = 1;
+}
+
+static bool
+HasSuffix(
+  const std::string& name,
+  const std::string& suffix)
+{
+  return (name.size() >= suffix.size()) &&
+         (name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+#ifdef __linux__
+
+bool
+WatchDirectory(
+  const std::string& dir,
+  const std::string& suffix,
+  DirWatcherCallback callback,
+  void* userData)
+{
+  // Start watching before listing the directory, so that a file closed in
+  // between is not lost. It may be reported twice instead, which is harmless.
+  int fd = inotify_init();
+  if (fd < 0) {
+    perror("inotify_init");
+    return false;
+  }
+
+  int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd < 0) {
+    perror(dir.c_str());
+    close(fd);
+    return false;
+  }
+
+  signal(SIGINT,  OnStopSignal);
+  signal(SIGTERM, OnStopSignal);
+
+  bool running = true;
+
+  //
+  // Existing files.
+  //
+  {
+    std::vector<std::string> names;
+    DIR* d = opendir(dir.c_str());
+    if (d) {
+      struct dirent* ent;
+      while ((ent = readdir(d)) != NULL) {
+        if (HasSuffix(ent->d_name, suffix)) {
+          names.push_back(ent->d_name);
+        }
+      }
+      closedir(d);
+    }
+    std::sort(names.begin(), names.end());
+
+    for (size_t i = 0; running && (i < names.size()) && !gStopRequested; i++) {
+      running = callback(dir + "/" + names[i], userData);
+    }
+  }
+
+  //
+  // New files.
+  //
+  std::vector<char> buf(64 * (sizeof(struct inotify_event) + 256));
+  while (running && !gStopRequested) {
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    // Wake up periodically to check the stop flag.
+    int ret = poll(&pfd, 1, 500);
+    if (ret <= 0) {
+      continue;
+    }
+
+    ssize_t len = read(fd, &buf[0], buf.size());
+    if (len <= 0) {
+      continue;
+    }
+
+    for (ssize_t i = 0; running && (i < len); ) {
+      const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>(&buf[i]);
+      i += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "inotify queue overflow. Some files may be skipped.\n");
+        continue;
+      }
+      if ((ev->len == 0) || (ev->mask & IN_ISDIR)) {
+        continue;
+      }
+      if (!HasSuffix(ev->name, suffix)) {
+        continue;
+      }
+
+      running = callback(dir + "/" + ev->name, userData);
+    }
+  }
+
+  inotify_rm_watch(fd, wd);
+  close(fd);
+
+  return true;
+}
+
+#else   // !__linux__
+
+bool
+WatchDirectory(
+  const std::string& dir,
+  const std::string& suffix,
+  DirWatcherCallback callback,
+  void* userData)
+{
+  (void)suffix; (void)callback; (void)userData;
+  fprintf(stderr, "Watch mode is not supported on this platform: %s\n", dir.c_str());
+  return false;
+}
+
+#endif  // __linux__
@@ -0,0 +1,29 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Watch a directory and call back for each file once it is closed after
+// writing(or renamed into the directory). Linux(inotify) only.
+//
+#ifndef DIR_WATCHER_H_
+#define DIR_WATCHER_H_
+
+#include <string>
+
+// Return false to stop watching.
+typedef bool (*DirWatcherCallback)(const std::string& path, void* userData);
+
+//
+// Blocks until the callback returns false, or SIGINT/SIGTERM is received.
+// Files already in `dir` are passed to the callback first, in name order.
+// Returns false when the directory cannot be watched.
+//
+extern bool
+WatchDirectory(
+  const std::string& dir,       // in
+  const std::string& suffix,    // in  e.g. ".emp"
+  DirWatcherCallback callback,  // in
+  void* userData);              // in
+
+#endif  // DIR_WATCHER_H_
@@ -4,11 +4,12 @@
 
 //
 // Load emp particle and convert it into custom particle data.
-// Particle data is compressed by lz4 to save storage.
+// Particle data is split into chunks and each chunk is stored raw or
+// compressed by lz4(optionally with shuffle/delta filter), whichever the
+// trial compression of a sample says is worth it.
 //
 // @todo { 
 //  * Out-of-core particle processing. 
-//  * Support custom particle attributes.
 //  * Support multi-frame emp.
 // }
 // 
@@ -29,76 +30,279 @@
 
 #include <vector>
 #include <map>
+#include <list>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
-//#define ENABLE_LZ4_COMPRESS (1)
+#include "particle_format.h"
+#include "particle_writer.h"
+#include "dir_watcher.h"
+#include "conversion_cache.h"
+#include "particle_hash.h"
+#include "particle_index.h"
+#include "particle_filter.h"
+#include "particle_density.h"
+#include "particle_arena.h"
+#include "particle_pack.h"
+#include "emp_channel.h"
+#include "work_queue.h"
 
-extern "C" {
-#include "lz4.h"
-}
+#include <sstream>
 
-static int
-EstimateCompressedBufferSize(
-  int inputSize)
+struct ExportOption
 {
-  // From LZ4:
-  // To avoid any problem, size it to handle worst cases situations (input data not compressible)
-  // Worst case size is : "inputsize + 0.4%", with "0.4%" being at least 8 bytes.
+  ParticleCodecOption codec;
+  std::string         outputPrefix;   // Prepended to "particle_%03d.dat" or "particles.dat".
+  bool                useCache;       // Skip outputs whose inputs are unchanged.
+  bool                sortById;       // Reorder particles by id instead of writing an id hash table.
+  bool                planar;         // Write vector channels as separate x, y, z planes(SoA).
+  bool                singleFile;     // Write all bodies of a frame into one "particles.dat".
+  bool                allChannels;    // Export every EMP channel, not only `channels`.
+  std::vector<std::string> channels;  // Extra channels to export besides position and id.
+  ParticleFilter      filter;         // Applied while extracting.
+  float               densityVoxelSize; // > 0: also write a density grid("*.density").
+  int                 densityKernel;  // ParticleDensityKernel
+  ParticleArena*      arena;          // Channel and compression buffers. Not a setting.
+  std::string         packName;       // Non empty: share chunks across frames in this pack file.
+  ParticlePack*       pack;           // Opened `packName` in the output directory.
+  std::map<std::string, int> channelCodecs;  // Per channel override of `codec.codec`.
+
+  ExportOption() : useCache(true), sortById(false), planar(false), singleFile(false), allChannels(false),
+                   densityVoxelSize(0.0f), densityKernel(PARTICLE_DENSITY_KERNEL_TENT), arena(NULL),
+                   pack(NULL) {}
+
+  bool IsExported(const std::string& name) const {
+    return allChannels || (std::find(channels.begin(), channels.end(), name) != channels.end());
+  }
 
-  int k = (int)(inputSize * 0.05);  // for safety, +0.1% ;-)
-  if (k < 8) k = 8;
-  return inputSize + k;
+  // PARTICLE_CODEC_AUTO when `name` uses the default codec.
+  int GetChannelCodec(const std::string& name) const {
+    std::map<std::string, int>::const_iterator it = channelCodecs.find(name);
+    return (it == channelCodecs.end()) ? (int)PARTICLE_CODEC_AUTO : it->second;
+  }
+};
+
+//
+// Hash of every setting which affects the output, so that changing any of
+// them invalidates the conversion cache.
+// Add new settings here.
+//
+static uint64_t
+GetSettingsHash(
+  const ExportOption& option)
+{
+  std::ostringstream ss;
+  ss << "version=" << PARTICLE_FILE_VERSION
+     << " codec=" << option.codec.codec
+     << " minGain=" << option.codec.minGain
+     << " sampleSize=" << option.codec.sampleSize
+     << " chunkSize=" << option.codec.chunkSize
+     << " sortById=" << option.sortById
+     << " planar=" << option.planar
+     << " singleFile=" << option.singleFile
+     << " allChannels=" << option.allChannels
+     << " channels=";
+  for (size_t i = 0; i < option.channels.size(); i++) {
+    ss << option.channels[i] << ",";
+  }
+  const ParticleFilter& f = option.filter;
+  ss << " filter=" << f.useBounds;
+  for (int c = 0; c < 3; c++) {
+    ss << "," << f.bmin[c] << "," << f.bmax[c];
+  }
+  ss << "," << f.minRadius << "," << f.minAge << "," << f.keepFraction << "," << f.seed;
+  ss << " density=" << option.densityVoxelSize << "," << option.densityKernel;
+  ss << " pack=" << option.packName;
+  ss << " channelCodecs=";
+  for (std::map<std::string, int>::const_iterator it = option.channelCodecs.begin();
+       it != option.channelCodecs.end(); ++it) {
+    ss << it->first << ":" << it->second << ",";
+  }
+  std::string s = ss.str();
+  return HashBytes64(s.data(), s.size(), 0);
 }
 
 class Particle
 {
  public:
-  Particle() {}
+  // Channel data lives in `arena` until it is reset.
+  explicit Particle(ParticleArena* arena)
+    : arena_(arena), positions_(arena), ids_(arena) {}
   ~Particle() {}
 
-  bool Write(const char* filename) {
-    FILE* fp = fopen(filename, "wb");
-    assert(fp);
-    unsigned int n = positions_.size();
-    size_t sz = 0;
-    sz = fwrite(&n, sizeof(unsigned int), 1, fp);
-    assert(sz == 1);
+  //
+  // Add this body and its channels to `writer`. Buffers passed to the
+  // writer are owned by this object, so it must outlive writer.Write().
+  //
+  void AddTo(ParticleWriter& writer, const ExportOption& option) {
+    size_t n = positions_.size() / 3;
 
-#ifdef ENABLE_LZ4_COMPRESS
-    {
-      int bufsize = EstimateCompressedBufferSize(n * sizeof(float));
-      std::vector<char> buffer(bufsize);
-      int len = LZ4_compress(reinterpret_cast<char*>(&positions_[0]), &buffer[0], sizeof(float) * n);
-      printf("LZ4 compress: %d bytes -> %d bytes\n", sizeof(float) * n, len);
+    uint32_t bodyFlags = 0;
+    if (!ids_.empty() && option.sortById) {
+      bodyFlags |= PARTICLE_BODY_FLAG_SORTED_BY_ID;
+    }
+    writer.BeginBody(name_.substr(0, PARTICLE_BODY_NAME_LEN - 1), n, bodyFlags);
 
-      sz = fwrite(&len, sizeof(int), 1, fp);
-      assert(sz == 1);
+    const uint32_t vectorFlags = option.planar ? PARTICLE_CHANNEL_FLAG_PLANAR : 0;
+    writer.AddChannel("position", PARTICLE_TYPE_FLOAT3, n ? &positions_[0] : NULL, n, vectorFlags,
+                      option.GetChannelCodec("position"));
 
-      sz = fwrite(&buffer[0], sizeof(char), len, fp);
-      assert(sz == len);
+    if (!ids_.empty()) {
+      assert(ids_.size() == n);
+      writer.AddChannel(PARTICLE_CHANNEL_ID, PARTICLE_TYPE_INT64, &ids_[0], n, 0,
+                        option.GetChannelCodec(PARTICLE_CHANNEL_ID));
+      if (!option.sortById) {
+        BuildIdHashTable(idTable_, &ids_[0], n);
+        writer.AddChannel(PARTICLE_CHANNEL_ID_INDEX, PARTICLE_TYPE_INT32, &idTable_[0], idTable_.size(), 0,
+                          option.GetChannelCodec(PARTICLE_CHANNEL_ID_INDEX));
+      }
+    }
+
+    for (size_t i = 0; i < attributes_.size(); i++) {
+      const Attribute& attr = attributes_[i];
+      const int elementSize = GetParticleTypeSize(attr.type);
+      const bool isVector   = (elementSize != GetParticleTypeWordSize(attr.type));
+      writer.AddChannel(attr.name, attr.type, attr.data.empty() ? NULL : &attr.data[0],
+                        attr.data.size() / elementSize, isVector ? vectorFlags : 0,
+                        option.GetChannelCodec(attr.name));
+    }
+  }
+
+  bool Write(const char* filename, const ExportOption& option) {
+    ParticleWriter writer(option.codec);
+    writer.SetArena(option.arena);
+    if (option.pack) {
+      writer.SetPack(option.pack, option.packName);
+    }
+    AddTo(writer, option);
+    if (!writer.Write(filename)) {
+      return false;
+    }
+
+    PrintWritten(positions_.size() / 3, filename);
+
+    if (option.densityVoxelSize > 0.0f) {
+      ParticleDensityGrid grid(option.densityVoxelSize, option.densityKernel);
+      Splat(grid);
+      return WriteDensity(grid, filename);
     }
-#else
-    {
-      sz = fwrite(&positions_[0], sizeof(float), n, fp);
-      assert(sz == n);
+
+    return true;
+  }
+
+  // Splat positions into `grid` while they are still in memory.
+  void Splat(ParticleDensityGrid& grid) const {
+    if (!positions_.empty()) {
+      grid.Splat(&positions_[0], positions_.size() / 3);
     }
-#endif
+  }
 
-    fclose(fp);
+  // Written next to `filename`, with ".dat" replaced by ".density".
+  static bool WriteDensity(const ParticleDensityGrid& grid, const char* filename) {
+    std::string output(filename);
+    if ((output.size() > 4) && (output.compare(output.size() - 4, 4, ".dat") == 0)) {
+      output.erase(output.size() - 4);
+    }
+    output += ".density";
 
-    int Mparticles = (int)((double)positions_.size() / 3 / (1000.0 * 1000.0));
+    if (!grid.Write(output)) {
+      return false;
+    }
+
+    std::cout << "Wrote " << grid.GetNumTiles() << " density tiles to " << output << "\n";
+    return true;
+  }
+
+  static void PrintWritten(size_t numParticles, const char* filename) {
+    int Mparticles = (int)((double)numParticles / (1000.0 * 1000.0));
     if (Mparticles < 1) {
-      std::cout << "Wrote " << positions_.size() / 3 << " particles data to " << filename << "\n";
+      std::cout << "Wrote " << numParticles << " particles data to " << filename << "\n";
     } else {
       std::cout << "Wrote " << Mparticles << " Mparticles data to " << filename << "\n";
     }
+  }
 
-    return true;
+  // Keep only particles `selected`(ascending) in all channels.
+  void Select(const std::vector<uint32_t>& selected) {
+    const size_t n = selected.size();
+
+    CompactElements(reinterpret_cast<char*>(&positions_[0]), selected, 3 * sizeof(float));
+    positions_.resize(n * 3);
+
+    if (!ids_.empty()) {
+      CompactElements(reinterpret_cast<char*>(&ids_[0]), selected, sizeof(int64_t));
+      ids_.resize(n);
+    }
+
+    for (size_t i = 0; i < attributes_.size(); i++) {
+      Attribute& attr = attributes_[i];
+      const int elementSize = GetParticleTypeSize(attr.type);
+      CompactElements(&attr.data[0], selected, elementSize);
+      attr.data.resize(n * elementSize);
+    }
+  }
+
+  // Reorder all channels by ascending id.
+  void SortById() {
+    if (ids_.empty()) {
+      return;
+    }
+
+    std::vector<uint32_t> perm;
+    RadixSortIds(perm, &ids_[0], ids_.size());
+
+    ArenaArray<float> positions(arena_);
+    positions.resize(positions_.size());
+    PermuteElements(reinterpret_cast<char*>(&positions[0]),
+                    reinterpret_cast<const char*>(&positions_[0]), perm, 3 * sizeof(float));
+    positions_.swap(positions);
+
+    ArenaArray<int64_t> ids(arena_);
+    ids.resize(ids_.size());
+    PermuteElements(reinterpret_cast<char*>(&ids[0]),
+                    reinterpret_cast<const char*>(&ids_[0]), perm, sizeof(int64_t));
+    ids_.swap(ids);
+
+    for (size_t i = 0; i < attributes_.size(); i++) {
+      Attribute& attr = attributes_[i];
+      ArenaArray<char> data(arena_);
+      data.resize(attr.data.size());
+      PermuteElements(&data[0], &attr.data[0], perm, GetParticleTypeSize(attr.type));
+      attr.data.swap(data);
+    }
   }
 
-  std::vector<float> positions_;
-  //std::vector<float> radiuses_;   // @todo
-  //std::vector<float> colors_;     // @todo
-  //std::vector<int>   ids_;        // @todo
+  // Hash of the extracted data. Used as a conversion cache key.
+  uint64_t Hash(uint64_t seed) const {
+    uint64_t h = seed;
+    h = HashBytes64(positions_.empty() ? NULL : &positions_[0], positions_.size() * sizeof(float), h);
+    h = HashBytes64(ids_.empty() ? NULL : &ids_[0], ids_.size() * sizeof(int64_t), h);
+    for (size_t i = 0; i < attributes_.size(); i++) {
+      const Attribute& attr = attributes_[i];
+      h = HashBytes64(attr.name.data(), attr.name.size(), h);
+      h = HashBytes64(attr.data.empty() ? NULL : &attr.data[0], attr.data.size(), h);
+    }
+    return h;
+  }
+
+  // Other exported channels(velocity, radius, ...), in EMP representation.
+  struct Attribute {
+    std::string       name;
+    int               type;   // ParticleValueType
+    ArenaArray<char>  data;   // Interleaved. Empty when all particles are filtered out.
+  };
+
+  ParticleArena*         arena_;
+  std::string            name_;       // Body name.
+  ArenaArray<float>      positions_;
+  ArenaArray<int64_t>    ids_;        // Empty when the body has no "id" channel.
+  std::vector<Attribute> attributes_;
+  std::vector<int32_t>   idTable_;    // Filled by AddTo().
 };
 
 static std::string
@@ -121,10 +325,44 @@ GetStringOfType(
   }
 }
 
+//
+// Float channel `name` for filtering. Taken from the exported attributes
+// when present, otherwise extracted into `storage`. Returns NULL(with a
+// warning) when the body has no such float channel.
+//
+static const float*
+GetFilterChannel(
+  std::vector<float>& storage,          // out
+  const Particle& particle,             // in
+  const Nb::ParticleShape& shape,       // in
+  const char* name,                     // in
+  const std::vector<size_t>& offsets)   // in
+{
+  for (size_t i = 0; i < particle.attributes_.size(); i++) {
+    const Particle::Attribute& attr = particle.attributes_[i];
+    if ((attr.name == name) && (attr.type == PARTICLE_TYPE_FLOAT)) {
+      return reinterpret_cast<const float*>(&attr.data[0]);
+    }
+  }
+
+  for (int channel = 0; channel < shape.channelCount(); channel++) {
+    const Nb::ParticleChannelBase& empChannel(shape.constChannelBase(channel));
+    if ((empChannel.name() == name) && (empChannel.type() == Nb::ValueBase::FloatType)) {
+      storage.resize(offsets.back());
+      ExtractBlocks<EmpFloatTraits>(&storage[0], shape, name, offsets);
+      return &storage[0];
+    }
+  }
+
+  NB_WARNING("  No float \"" << name << "\" channel. Not filtered by " << name << ".");
+  return NULL;
+}
+
 static bool
 Emp2Particle(
-  Particle& particle,     // out
-  const Nb::Body* body)   // in
+  Particle& particle,           // out
+  const Nb::Body* body,         // in
+  const ExportOption& option)   // in
 {
   NB_INFO("EMP Process particle body(" << body->name() << ")...");
   const Nb::ParticleShape& particleShape(body->constParticleShape());
@@ -133,54 +371,179 @@ Emp2Particle(
   NB_INFO("  Block count: " << layout.fineTileCount());
   NB_INFO("  Channel count: " << particleShape.channelCount());
 
+  const unsigned int blockCount = layout.fineTileCount();
+  const ParticleFilter& filter(option.filter);
+
   //
-  // List up channels
+  // Reject whole tiles outside the filter bounds before touching any
+  // particle data.
   //
-  for (int channel = 0; channel < particleShape.channelCount(); channel++) {
-    const Nb::ParticleChannelBase& empChannel(particleShape.constChannelBase(channel));
+  std::vector<char> keepBlock;
+  if (filter.useBounds && (blockCount > 0)) {
+    keepBlock.resize(blockCount);
+    unsigned int numRejected = 0;
+    for (unsigned int b = 0; b < blockCount; b++) {
+      em::vec3f tileMin, tileMax;
+      layout.fineTile(b).bounds(tileMin, tileMax);
+      const float tmin[3] = { tileMin[0], tileMin[1], tileMin[2] };
+      const float tmax[3] = { tileMax[0], tileMax[1], tileMax[2] };
+      keepBlock[b] = TileIntersectsFilter(filter, tmin, tmax) ? 1 : 0;
+      numRejected += keepBlock[b] ? 0 : 1;
+    }
+    NB_INFO("  # of rejected tiles = " << numRejected);
+  }
 
-    NB_INFO("  Channel(" << channel << ") name = " << empChannel.name() << ", type = " << GetStringOfType(empChannel.type()));
+  //
+  // Particle offset of each block, so that every channel is extracted
+  // directly into its place with no reallocation.
+  //
+  std::vector<size_t> offsets;
+  ComputeBlockOffsets<EmpVec3fTraits>(offsets, particleShape, "position", blockCount,
+                                      keepBlock.empty() ? NULL : &keepBlock[0]);
+  const size_t particleCount = offsets.back();
 
-  }
+  NB_INFO("  # of position blocks = " << blockCount);
+  NB_INFO("  # of particles = " << particleCount);
 
   //
   // Process position
-  // 
-  {
-    const unsigned int blockCount = layout.fineTileCount();
-    size_t particleCount = 0; // 64bit int in 64bit env.
-    const em::block3_array3f& positionBlocks(particleShape.constBlocks3f("position"));
-
-    for (unsigned int blockIndex = 0; blockIndex < blockCount; blockIndex++) {
-      const em::block3vec3f& positionBlock(positionBlocks(blockIndex));
-      size_t blockParticleCount = positionBlock.size();
-      for (unsigned int p = 0; p < blockParticleCount; p++) {
-        const em::vec3f& v = positionBlock(p);
-        particle.positions_.push_back(v[0]);
-        particle.positions_.push_back(v[1]);
-        particle.positions_.push_back(v[2]);
+  //
+  particle.positions_.resize(particleCount * 3);
+  if (particleCount > 0) {
+    ExtractBlocks<EmpVec3fTraits>(&particle.positions_[0], particleShape, "position", offsets);
+  }
+
+  //
+  // Process other channels. Types are switched once per channel here;
+  // the per particle loops are specialized(see emp_channel.h).
+  //
+  for (int channel = 0; channel < particleShape.channelCount(); channel++) {
+    const Nb::ParticleChannelBase& empChannel(particleShape.constChannelBase(channel));
+    const Nb::String name(empChannel.name());
+    const Nb::ValueBase::Type type(empChannel.type());
+
+    NB_INFO("  Channel(" << channel << ") name = " << name << ", type = " << GetStringOfType(type));
+
+    if ((name == "position") || (particleCount == 0)) {
+      continue;
+    }
+
+    if (name == "id") {
+      // Widened to int64 regardless of the EMP type.
+      particle.ids_.resize(particleCount);
+      if (type == Nb::ValueBase::Int64Type) {
+        ExtractBlocks<EmpInt64Traits>(&particle.ids_[0], particleShape, name, offsets);
+      } else if (type == Nb::ValueBase::IntType) {
+        ExtractBlocks<EmpInt32Traits>(&particle.ids_[0], particleShape, name, offsets);
+      } else {
+        NB_WARNING("  Unsupported id channel type: " << GetStringOfType(type));
+        particle.ids_.clear();
       }
-      
-      particleCount += blockParticleCount;
+      continue;
     }
 
-    NB_INFO("  # of position blocks = " << blockCount);
-    NB_INFO("  # of particles = " << particleCount);
+    if (!option.IsExported(name)) {
+      continue;
+    }
 
-    particle.positions_.reserve(particleCount * 3);
+    if (name.size() >= PARTICLE_CHANNEL_NAME_LEN) {
+      NB_WARNING("  Channel name too long. Skipping: " << name);
+      continue;
+    }
 
+    particle.attributes_.push_back(Particle::Attribute());
+    Particle::Attribute& attr = particle.attributes_.back();
+    attr.name = name;
+    attr.data.SetArena(particle.arena_);
+    if (!ExtractEmpChannel(attr.type, attr.data, particleShape, name, type, offsets)) {
+      NB_WARNING("  Unsupported channel type. Skipping: " << name);
+      particle.attributes_.pop_back();
+    }
   }
+
+  //
+  // Per particle predicates.
   //
-  // @todo { Handle other fields. }
-  // 
+  if (filter.IsEnabled() && (particleCount > 0)) {
+    std::vector<float> radiusStorage, ageStorage;
+    const float* radius = NULL;
+    const float* age    = NULL;
+    if (filter.UsesRadius()) {
+      radius = GetFilterChannel(radiusStorage, particle, particleShape, "radius", offsets);
+    }
+    if (filter.UsesAge()) {
+      age = GetFilterChannel(ageStorage, particle, particleShape, "age", offsets);
+    }
+
+    std::vector<uint32_t> selected;
+    FilterParticles(selected, filter, &particle.positions_[0], radius, age,
+                    particle.ids_.empty() ? NULL : &particle.ids_[0], particleCount);
+    particle.Select(selected);
+
+    NB_INFO("  # of particles after filtering = " << selected.size());
+  }
+
   return true;
 }
 
 
+// Count an output written by ProcEmp() into `stats`(if any).
+static void
+AddWritten(
+  WorkStats* stats,             // inout
+  size_t numParticles,          // in
+  const std::string& output)    // in
+{
+  if (!stats) {
+    return;
+  }
+  stats->numParticles += numParticles;
+  stats->numFiles     += 1;
+  struct stat st;
+  if (stat(output.c_str(), &st) == 0) {
+    stats->numBytes += st.st_size;
+  }
+}
+
+//
+// Convert the frame `filename`. With `onlyBody` >= 0 only that body is
+// converted(a work item of sharded conversion). Returns false when the
+// frame could not be read or an output could not be written.
+//
 static bool
 ProcEmp(
-  const std::string& filename)
+  const std::string& filename,
+  const ExportOption& option,
+  int onlyBody = -1,
+  WorkStats* stats = NULL)
 {
+  const std::string manifestFilename = option.outputPrefix + "particle.manifest";
+  const uint64_t    settingsHash     = GetSettingsHash(option);
+  uint64_t          inputHash        = 0;
+
+  ConversionManifest oldManifest;
+  ConversionManifest newManifest;
+  bool hasManifest = false;
+
+  if (option.useCache) {
+    if (!HashFile64(inputHash, filename)) {
+      NB_ERROR("Failed to read " << filename);
+      return false;
+    }
+
+    hasManifest = oldManifest.Load(manifestFilename);
+    if (hasManifest && oldManifest.IsUpToDate(inputHash, settingsHash)) {
+      std::cout << "Skipping " << filename << " (unchanged)" << std::endl;
+      return true;
+    }
+
+    newManifest.inputHash_    = inputHash;
+    newManifest.settingsHash_ = settingsHash;
+  }
+
+  bool   failed     = false;   // Some output was not written.
+  size_t numOutputs = 0;
+
   try {
     std::cout << "Reading " << filename << std::endl;
     Nb::EmpReader empReader(filename, "*", "Body"); // May throw.
@@ -196,21 +559,132 @@ ProcEmp(
     const Nb::String sequenceName = Nb::hashifyFilename(filename);
     NB_INFO("Sequence name: '" << sequenceName);
 
+    if (onlyBody >= empReader.bodyCount()) {
+      NB_ERROR(filename << " has no body " << onlyBody);
+      return false;
+    }
+
+    // Single file mode keeps every body until the frame is written.
+    std::list<Particle> bodies;
+    uint64_t            bodiesHash = settingsHash;
+
+    // Buffers of the previous frame are no longer used.
+    option.arena->Reset();
+
     for (int i = 0; i < empReader.bodyCount(); i++) {
+      if ((onlyBody >= 0) && (i != onlyBody)) {
+        continue;
+      }
+
       const Nb::Body* body(empReader.ejectBody(i));
       NB_INFO("EMP body(" << i << ") name = " << body->name());
 
+      if (!option.singleFile) {
+        // Nor those of the previous body, which is written already.
+        option.arena->Reset();
+      }
+
       // Process particle body only.
-      if (body->hasShape("Particle")) {
-        Particle particle;
-        Emp2Particle(particle, body);
+      if (body->hasShape("Particle") && option.singleFile) {
+        bodies.push_back(Particle(option.arena));
+        Particle& particle = bodies.back();
+        particle.name_ = body->name();
+        Emp2Particle(particle, body, option);
+        if (option.sortById) {
+          particle.SortById();
+        }
+        bodiesHash = particle.Hash(bodiesHash);
+      } else if (body->hasShape("Particle")) {
+        Particle particle(option.arena);
+        particle.name_ = body->name();
+        Emp2Particle(particle, body, option);
+        if (option.sortById) {
+          particle.SortById();
+        }
         char buf[4096];
-        sprintf(buf, "particle_%03d.dat", i);
-        particle.Write(buf);
+        snprintf(buf, sizeof(buf), "%sparticle_%03d.dat", option.outputPrefix.c_str(), i);
+        numOutputs++;
+
+        ConversionManifest::Body entry;
+        bool kept = false;
+        if (option.useCache) {
+          // Body data hash includes settings, since they change the output too.
+          entry.index    = i;
+          entry.dataHash = particle.Hash(settingsHash);
+          entry.output   = buf;
+          kept = hasManifest && oldManifest.IsBodyUpToDate(i, entry.dataHash, entry.output);
+        }
+
+        if (kept) {
+          std::cout << "Keeping " << buf << " (unchanged)" << std::endl;
+        } else if (!particle.Write(buf, option)) {
+          failed = true;
+          continue;   // Not recorded, thus rewritten next time.
+        } else if (stats) {
+          // Kept outputs are not counted, as with --single-file.
+          stats->numBodies++;
+          AddWritten(stats, particle.positions_.size() / 3, buf);
+        }
+
+        if (option.useCache) {
+          newManifest.bodies_.push_back(entry);
+        }
       } else {
         NB_WARNING("EMP body(" << body->name() << ") is not a particle shape. Skipping.");
       }
     }
+
+    if (!bodies.empty()) {
+      std::string output = option.outputPrefix + "particles.dat";
+      numOutputs++;
+
+      // Recorded as a single entry(index -1) covering all bodies.
+      ConversionManifest::Body entry;
+      entry.index    = -1;
+      entry.dataHash = bodiesHash;
+      entry.output   = output;
+
+      if (option.useCache && hasManifest &&
+          oldManifest.IsBodyUpToDate(entry.index, entry.dataHash, entry.output)) {
+        std::cout << "Keeping " << output << " (unchanged)" << std::endl;
+        newManifest.bodies_.push_back(entry);
+      } else {
+        ParticleWriter writer(option.codec);
+        writer.SetArena(option.arena);
+        if (option.pack) {
+          writer.SetPack(option.pack, option.packName);
+        }
+        size_t numParticles = 0;
+        for (std::list<Particle>::iterator it = bodies.begin(); it != bodies.end(); ++it) {
+          it->AddTo(writer, option);
+          numParticles += it->positions_.size() / 3;
+        }
+
+        bool ok = writer.Write(output.c_str());
+        if (ok) {
+          Particle::PrintWritten(numParticles, output.c_str());
+          AddWritten(stats, numParticles, output);
+          if (stats) stats->numBodies += bodies.size();
+        }
+
+        if (ok && (option.densityVoxelSize > 0.0f)) {
+          // One grid for all bodies of the frame.
+          ParticleDensityGrid grid(option.densityVoxelSize, option.densityKernel);
+          for (std::list<Particle>::iterator it = bodies.begin(); it != bodies.end(); ++it) {
+            it->Splat(grid);
+          }
+          ok = Particle::WriteDensity(grid, output.c_str());
+        }
+
+        if (ok) {
+          if (option.useCache) {
+            newManifest.bodies_.push_back(entry);
+          }
+        } else {
+          failed = true;
+        }
+      }
+    }
   } 
   catch (std::exception &ex) {
     NB_ERROR("exception: " << ex.what());
@@ -221,27 +695,469 @@ ProcEmp(
     return false;   // Failure.
   }
 
+  if (option.useCache) {
+    newManifest.numOutputs_ = numOutputs;
+    if (failed) {
+      // Never skip this frame as a whole. Written outputs are still kept.
+      newManifest.inputHash_    = 0;
+      newManifest.settingsHash_ = 0;
+    }
+  }
+
+  if (option.useCache && !newManifest.Save(manifestFilename)) {
+    NB_WARNING("Failed to write " << manifestFilename);
+  }
+
+  return !failed;
+}
+
+//
+// Outputs of frame `filename` are prefixed with its name so that frames do
+// not overwrite each other, e.g. out/fluid.0001.particle_000.dat
+//
+static std::string
+GetOutputPrefix(
+  const std::string& outputDir,
+  const std::string& filename)
+{
+  std::string basename = filename.substr(filename.find_last_of('/') + 1);
+  std::string stem     = basename;
+  if ((stem.size() > 4) && (stem.compare(stem.size() - 4, 4, ".emp") == 0)) {
+    stem.erase(stem.size() - 4);
+  }
+  return outputDir + "/" + stem + ".";
+}
+
+struct WatchContext
+{
+  ExportOption option;
+  std::string  outputDir;
+};
+
+static bool
+ProcWatchedEmp(
+  const std::string& filename,
+  void* userData)
+{
+  const WatchContext* ctx = reinterpret_cast<const WatchContext*>(userData);
+
+  ExportOption option = ctx->option;
+  option.outputPrefix = GetOutputPrefix(ctx->outputDir, filename);
+
+  if (!ProcEmp(filename, option)) {
+    NB_WARNING("Failed to convert " << filename << ". Continue watching.");
+  }
+
+  return true;  // Keep watching.
+}
+
+//
+// Parse the conversion option at args[i], advancing `i` over its values.
+// These are recorded in the work manifest, so every worker of a sharded
+// conversion uses the same settings.
+// Returns 1 when parsed, 0 when args[i] is not a conversion option and
+// -1 on an invalid value.
+//
+static int
+ParseExportOption(
+  ExportOption& option,                   // inout
+  std::string& outputDir,                 // inout
+  const std::vector<std::string>& args,   // in
+  size_t& i)                              // inout
+{
+  const std::string& arg = args[i];
+  const size_t numValues = args.size() - i - 1;
+
+  if ((arg == "--codec") && (numValues >= 1)) {
+    option.codec.codec = GetCodecByName(args[++i].c_str());
+    if (option.codec.codec == PARTICLE_CODEC_COUNT) {
+      std::cerr << "Unknown codec: " << args[i] << "\n";
+      return -1;
+    }
+  } else if ((arg == "--channel-codec") && (numValues >= 1)) {
+    // NAME=CODEC, e.g. id=bitpack
+    const std::string& value = args[++i];
+    const size_t eq = value.find('=');
+    const int codec = (eq == std::string::npos) ? (int)PARTICLE_CODEC_COUNT
+                                                : GetCodecByName(value.substr(eq + 1).c_str());
+    if ((codec == PARTICLE_CODEC_COUNT) || (eq == 0)) {
+      std::cerr << "Invalid channel codec(NAME=CODEC expected): " << value << "\n";
+      return -1;
+    }
+    option.channelCodecs[value.substr(0, eq)] = codec;
+  } else if ((arg == "--min-gain") && (numValues >= 1)) {
+    option.codec.minGain = atof(args[++i].c_str());
+  } else if ((arg == "--output-dir") && (numValues >= 1)) {
+    outputDir = args[++i];
+  } else if (arg == "--no-cache") {
+    option.useCache = false;
+  } else if (arg == "--sort-by-id") {
+    option.sortById = true;
+  } else if ((arg == "--channel") && (numValues >= 1)) {
+    option.channels.push_back(args[++i]);
+  } else if (arg == "--all-channels") {
+    option.allChannels = true;
+  } else if ((arg == "--bbox") && (numValues >= 6)) {
+    option.filter.useBounds = true;
+    for (int c = 0; c < 3; c++) option.filter.bmin[c] = atof(args[++i].c_str());
+    for (int c = 0; c < 3; c++) option.filter.bmax[c] = atof(args[++i].c_str());
+  } else if ((arg == "--min-radius") && (numValues >= 1)) {
+    option.filter.minRadius = atof(args[++i].c_str());
+  } else if ((arg == "--min-age") && (numValues >= 1)) {
+    option.filter.minAge = atof(args[++i].c_str());
+  } else if ((arg == "--keep-fraction") && (numValues >= 1)) {
+    option.filter.keepFraction = atof(args[++i].c_str());
+  } else if ((arg == "--seed") && (numValues >= 1)) {
+    option.filter.seed = strtoul(args[++i].c_str(), NULL, 10);
+  } else if ((arg == "--density") && (numValues >= 1)) {
+    option.densityVoxelSize = atof(args[++i].c_str());
+  } else if ((arg == "--density-kernel") && (numValues >= 1)) {
+    option.densityKernel = GetDensityKernelByName(args[++i].c_str());
+    if (option.densityKernel == PARTICLE_DENSITY_KERNEL_COUNT) {
+      std::cerr << "Unknown density kernel: " << args[i] << "\n";
+      return -1;
+    }
+  } else if ((arg == "--pack") && (numValues >= 1)) {
+    option.packName = args[++i];
+    if ((option.packName.find('/') != std::string::npos) ||
+        (option.packName.size() >= PARTICLE_PACK_NAME_LEN)) {
+      std::cerr << "Pack name must be a short filename: " << option.packName << "\n";
+      return -1;
+    }
+  } else if (arg == "--single-file") {
+    option.singleFile = true;
+  } else if ((arg == "--layout") && (numValues >= 1)) {
+    i++;
+    if (args[i] == "soa") {
+      option.planar = true;
+    } else if (args[i] == "aos") {
+      option.planar = false;
+    } else {
+      std::cerr << "Unknown layout: " << args[i] << "\n";
+      return -1;
+    }
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+static double
+GetSeconds()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1.0e-6;
+}
+
+static void
+PrintWorkStats(
+  const WorkStats& total,
+  int numFailed)
+{
+  std::cout << "Converted " << total.numBodies << " bodies, " << total.numParticles
+            << " particles into " << total.numFiles << " files(" << total.numBytes
+            << " bytes) in " << total.seconds << " worker seconds";
+  if (numFailed > 0) {
+    std::cout << ", " << numFailed << " items failed";
+  }
+  std::cout << "\n";
+}
+
+//
+// Coordinator of a sharded conversion. Write one work item per body of
+// each input(per frame with --single-file) into `workDir`.
+// Nb::begin() must have been called.
+//
+static bool
+PlanWork(
+  const std::string& workDir,
+  const std::vector<std::string>& optionArgs,
+  const std::vector<std::string>& inputs,
+  const ExportOption& option)
+{
+  std::vector<WorkItem> items;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    WorkItem item;
+    item.input = inputs[i];
+    item.body  = -1;
+    if (option.singleFile) {
+      items.push_back(item);
+      continue;
+    }
+
+    try {
+      Nb::EmpReader empReader(inputs[i], "*", "Body"); // May throw.
+      for (int b = 0; b < empReader.bodyCount(); b++) {
+        item.body = b;
+        items.push_back(item);
+      }
+    }
+    catch (std::exception &ex) {
+      NB_ERROR("exception: " << ex.what());
+      return false;
+    }
+    catch (...) {
+      NB_ERROR("unknown exception");
+      return false;
+    }
+  }
+
+  WorkQueue queue(workDir);
+  if (!queue.Create(optionArgs, items)) {
+    return false;
+  }
+
+  std::cout << "Planned " << items.size() << " work items in " << workDir << std::endl;
   return true;
 }
 
+//
+// Worker of a sharded conversion. Claim and convert items of `workDir`
+// until every item is done or failed. Nb::begin() must have been called.
+// Returns false when some item(of any worker) failed for good.
+//
+static bool
+RunWorker(
+  WorkQueue& queue,
+  const ExportOption& option,
+  const std::string& outputDir)
+{
+  const std::vector<WorkItem>& items = queue.GetItems();
+  const int numItems = (int)items.size();
+  if (numItems == 0) {
+    return true;
+  }
+
+  // Workers start at different items so that they rarely race for a lease.
+  const int start = (int)(getpid() % numItems);
+
+  for (;;) {
+    bool pending = false;
+    bool claimed = false;
+
+    for (int k = 0; k < numItems; k++) {
+      const int item = (start + k) % numItems;
+      const WorkQueue::State state = queue.GetState(item);
+      if ((state == WorkQueue::STATE_DONE) || (state == WorkQueue::STATE_FAILED)) {
+        continue;
+      }
+      pending = true;
+
+      if (!queue.Claim(item)) {
+        continue;
+      }
+      claimed = true;
+
+      ExportOption itemOption = option;
+      itemOption.outputPrefix = GetOutputPrefix(outputDir, items[item].input);
+      if (items[item].body >= 0) {
+        // Workers of the other bodies of the frame would overwrite its manifest.
+        itemOption.useCache = false;
+      }
+
+      std::cout << "[" << queue.GetWorkerId() << "] item " << item << ": "
+                << items[item].input << " body " << items[item].body << std::endl;
+
+      WorkStats stats;
+      double t0 = GetSeconds();
+      bool ok = ProcEmp(items[item].input, itemOption, items[item].body, &stats);
+      stats.seconds = GetSeconds() - t0;
+
+      if (ok) {
+        queue.Complete(item, stats);
+      } else {
+        NB_WARNING("Failed to convert item " << item << ". Will be retried.");
+        queue.Fail(item);
+      }
+    }
+
+    if (!pending) {
+      break;
+    }
+    if (!claimed) {
+      sleep(1);   // Remaining items are leased by other workers.
+    }
+  }
+
+  WorkStats total;
+  int numFailed = 0;
+  if (!queue.Merge(total, numFailed)) {
+    return false;
+  }
+  PrintWorkStats(total, numFailed);
+
+  return (numFailed == 0);
+}
+
+//
+// Run `numJobs` worker processes of `workDir` on this host and wait for
+// them.
+//
+static bool
+SpawnWorkers(
+  const char* program,
+  const std::string& workDir,
+  const std::vector<std::string>& workerArgs,
+  int numJobs)
+{
+  std::vector<pid_t> pids;
+  for (int j = 0; j < numJobs; j++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      std::vector<char*> argv;
+      argv.push_back(const_cast<char*>(program));
+      argv.push_back(const_cast<char*>("--work"));
+      argv.push_back(const_cast<char*>(workDir.c_str()));
+      for (size_t i = 0; i < workerArgs.size(); i++) {
+        argv.push_back(const_cast<char*>(workerArgs[i].c_str()));
+      }
+      argv.push_back(NULL);
+      execvp(program, &argv[0]);
+      perror("execvp");
+      _exit(127);
+    } else if (pid < 0) {
+      perror("fork");
+      break;
+    }
+    pids.push_back(pid);
+  }
+
+  bool ok = !pids.empty();
+  for (size_t j = 0; j < pids.size(); j++) {
+    int status = 0;
+    if ((waitpid(pids[j], &status, 0) < 0) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
 int
 main(
   int argc,
   char **argv)
 {
-  std::string input = "input.emp";
+  std::vector<std::string> inputs;
+  std::string watchDir;
+  std::string outputDir = ".";
+  std::string planDir;
+  std::string workDir;
+  int numJobs = 0;
+  std::vector<std::string> optionArgs;  // Conversion options, for the work manifest.
+  std::vector<std::string> workerArgs;  // Lease settings, for spawned workers.
+  int leaseTimeout = 300;
+  int maxAttempts  = 3;
+  ExportOption option;
+  ParticleArena arena;    // Reused by all frames.
+  option.arena = &arena;
+
+  std::vector<std::string> args(argv + 1, argv + argc);
+  for (size_t i = 0; i < args.size(); i++) {
+    const size_t first = i;
+    int parsed = ParseExportOption(option, outputDir, args, i);
+    if (parsed < 0) {
+      return EXIT_FAILURE;
+    } else if (parsed > 0) {
+      optionArgs.insert(optionArgs.end(), args.begin() + first, args.begin() + i + 1);
+    } else if ((args[i] == "--watch") && (i + 1 < args.size())) {
+      watchDir = args[++i];
+    } else if ((args[i] == "--plan") && (i + 1 < args.size())) {
+      planDir = args[++i];
+    } else if ((args[i] == "--work") && (i + 1 < args.size())) {
+      workDir = args[++i];
+    } else if ((args[i] == "--jobs") && (i + 1 < args.size())) {
+      numJobs = atoi(args[++i].c_str());
+    } else if ((args[i] == "--lease-timeout") && (i + 1 < args.size())) {
+      leaseTimeout = atoi(args[++i].c_str());
+      workerArgs.insert(workerArgs.end(), args.begin() + i - 1, args.begin() + i + 1);
+    } else if ((args[i] == "--max-attempts") && (i + 1 < args.size())) {
+      maxAttempts = atoi(args[++i].c_str());
+      workerArgs.insert(workerArgs.end(), args.begin() + i - 1, args.begin() + i + 1);
+    } else {
+      inputs.push_back(args[i]);
+    }
+  }
+
+  if (!workDir.empty()) {
+    // Settings come from the manifest, not from the command line.
+    WorkQueue queue(workDir, leaseTimeout, maxAttempts);
+    if (!queue.Load()) {
+      std::cerr << "Failed to load the work manifest in " << workDir << "\n";
+      return EXIT_FAILURE;
+    }
+
+    option = ExportOption();
+    option.arena = &arena;
+    outputDir = ".";
+    const std::vector<std::string>& manifestArgs = queue.GetArguments();
+    for (size_t i = 0; i < manifestArgs.size(); i++) {
+      if (ParseExportOption(option, outputDir, manifestArgs, i) <= 0) {
+        std::cerr << "Invalid option in the work manifest: " << manifestArgs[i] << "\n";
+        return EXIT_FAILURE;
+      }
+    }
+  }
 
-  if (argc > 1) {
-    input = std::string(argv[1]);
+  // Shared by all frames written to `outputDir`.
+  ParticlePack pack;
+  if (!option.packName.empty() && planDir.empty()) {
+    std::string packFilename = outputDir + "/" + option.packName;
+    if (!pack.Open(packFilename, true)) {
+      std::cerr << "Failed to open pack file " << packFilename << "\n";
+      return EXIT_FAILURE;
+    }
+    option.pack = &pack;
   }
 
   // Must call Nb::begin() before all Nb API call.
   Nb::begin();
 
-  bool ret = ProcEmp(input);
+  bool ret;
+  if (!planDir.empty()) {
+    ret = PlanWork(planDir, optionArgs, inputs, option);
+  } else if (!workDir.empty()) {
+    WorkQueue queue(workDir, leaseTimeout, maxAttempts);
+    ret = queue.Load() && RunWorker(queue, option, outputDir);
+  } else if (!watchDir.empty()) {
+    // Long-lived mode. Nb state is kept across frames.
+    std::cout << "Watching " << watchDir << " for *.emp" << std::endl;
+    WatchContext ctx;
+    ctx.option    = option;
+    ctx.outputDir = outputDir;
+    ret = WatchDirectory(watchDir, ".emp", ProcWatchedEmp, &ctx);
+  } else if (inputs.size() <= 1) {
+    option.outputPrefix = outputDir + "/";
+    ret = ProcEmp(inputs.empty() ? std::string("input.emp") : inputs[0], option);
+  } else {
+    // Prefixed with the frame name, so that frames do not overwrite each other.
+    ret = true;
+    for (size_t i = 0; i < inputs.size(); i++) {
+      option.outputPrefix = GetOutputPrefix(outputDir, inputs[i]);
+      ret = ProcEmp(inputs[i], option) && ret;
+    }
+  }
 
   // Also must call Nb::end() when process exits.
   Nb::end();
 
-  return (int)ret;
+  if (ret && !planDir.empty() && (numJobs > 0)) {
+    // Local run of the planned work. Workers are separate processes, as
+    // on other hosts.
+    ret = SpawnWorkers(argv[0], planDir, workerArgs, numJobs);
+
+    WorkQueue queue(planDir);
+    WorkStats total;
+    int numFailed = 0;
+    if (queue.Load() && queue.Merge(total, numFailed)) {
+      PrintWorkStats(total, numFailed);
+      ret = ret && (numFailed == 0);
+    } else {
+      ret = false;
+    }
+  }
+
+  return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
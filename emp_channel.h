@@ -0,0 +1,209 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Compile time specialized extraction of EMP particle channels.
+//
+// A channel is dispatched on its Nb::ValueBase::Type once(see
+// ExtractEmpChannel), then copied by a kernel instantiated for the EMP
+// value type and the output scalar type, so the per particle loop has no
+// type switch and compiles to straight copies/conversions.
+//
+#ifndef EMP_CHANNEL_H_
+#define EMP_CHANNEL_H_
+
+#include <NbBody.h>
+#include <NbString.h>
+
+#include <vector>
+#include <stdint.h>
+
+#include "particle_format.h"
+#include "particle_arena.h"
+
+//
+// Traits per EMP value type: block types, block accessor and how an
+// element is stored as `N` scalars.
+//
+struct EmpFloatTraits
+{
+  typedef em::block3_array1f Array;
+  typedef em::block3f        Block;
+  typedef float              Scalar;
+  enum { N = 1, Type = PARTICLE_TYPE_FLOAT };
+
+  static const Array& Blocks(const Nb::ParticleShape& shape, const Nb::String& name) {
+    return shape.constBlocks1f(name);
+  }
+  template<typename OutT>
+  static void Store(OutT* dst, const float& v) { dst[0] = (OutT)v; }
+};
+
+struct EmpInt32Traits
+{
+  typedef em::block3_array1i Array;
+  typedef em::block3i        Block;
+  typedef int32_t            Scalar;
+  enum { N = 1, Type = PARTICLE_TYPE_INT32 };
+
+  static const Array& Blocks(const Nb::ParticleShape& shape, const Nb::String& name) {
+    return shape.constBlocks1i(name);
+  }
+  template<typename OutT>
+  static void Store(OutT* dst, const int& v) { dst[0] = (OutT)v; }
+};
+
+struct EmpInt64Traits
+{
+  typedef em::block3_array1i64 Array;
+  typedef em::block3i64        Block;
+  typedef int64_t              Scalar;
+  enum { N = 1, Type = PARTICLE_TYPE_INT64 };
+
+  static const Array& Blocks(const Nb::ParticleShape& shape, const Nb::String& name) {
+    return shape.constBlocks1i64(name);
+  }
+  template<typename OutT>
+  static void Store(OutT* dst, const int64_t& v) { dst[0] = (OutT)v; }
+};
+
+struct EmpVec3fTraits
+{
+  typedef em::block3_array3f Array;
+  typedef em::block3vec3f    Block;
+  typedef float              Scalar;
+  enum { N = 3, Type = PARTICLE_TYPE_FLOAT3 };
+
+  static const Array& Blocks(const Nb::ParticleShape& shape, const Nb::String& name) {
+    return shape.constBlocks3f(name);
+  }
+  template<typename OutT>
+  static void Store(OutT* dst, const em::vec3f& v) {
+    dst[0] = (OutT)v[0];
+    dst[1] = (OutT)v[1];
+    dst[2] = (OutT)v[2];
+  }
+};
+
+struct EmpVec3iTraits
+{
+  typedef em::block3_array3i Array;
+  typedef em::block3vec3i    Block;
+  typedef int32_t            Scalar;
+  enum { N = 3, Type = PARTICLE_TYPE_INT3 };
+
+  static const Array& Blocks(const Nb::ParticleShape& shape, const Nb::String& name) {
+    return shape.constBlocks3i(name);
+  }
+  template<typename OutT>
+  static void Store(OutT* dst, const em::vec3i& v) {
+    dst[0] = (OutT)v[0];
+    dst[1] = (OutT)v[1];
+    dst[2] = (OutT)v[2];
+  }
+};
+
+//
+// Particle offset of each block in the output, computed from the sizes of
+// the blocks of `channel`. offsets[blockCount] is the particle count.
+// Blocks with keepBlock[b] == 0 get no particles, so they are never read.
+//
+template<typename Traits>
+static void
+ComputeBlockOffsets(
+  std::vector<size_t>& offsets,       // out
+  const Nb::ParticleShape& shape,     // in
+  const Nb::String& channel,          // in
+  unsigned int blockCount,            // in
+  const char* keepBlock = NULL)       // in  NULL: keep all blocks.
+{
+  const typename Traits::Array& blocks(Traits::Blocks(shape, channel));
+  offsets.resize(blockCount + 1);
+  offsets[0] = 0;
+  for (unsigned int b = 0; b < blockCount; b++) {
+    size_t size = (keepBlock && !keepBlock[b]) ? 0 : blocks(b).size();
+    offsets[b + 1] = offsets[b] + size;
+  }
+}
+
+//
+// Copy all blocks of channel `name` into `dst`, which must have room for
+// offsets.back() * Traits::N scalars. Blocks are copied in parallel, each
+// to its own range of `dst`.
+//
+template<typename Traits, typename OutT>
+static void
+ExtractBlocks(
+  OutT* dst,                            // out
+  const Nb::ParticleShape& shape,       // in
+  const Nb::String& name,               // in
+  const std::vector<size_t>& offsets)   // in
+{
+  const typename Traits::Array& blocks(Traits::Blocks(shape, name));
+  const int blockCount = (int)offsets.size() - 1;
+
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (int b = 0; b < blockCount; b++) {
+    const typename Traits::Block& block(blocks(b));
+    OutT* out = dst + offsets[b] * Traits::N;
+    const size_t count = offsets[b + 1] - offsets[b];
+    for (size_t p = 0; p < count; p++) {
+      Traits::Store(out + p * Traits::N, block(p));
+    }
+  }
+}
+
+//
+// Extract channel `name` of EMP type `empType` in its own representation.
+// `type` receives the ParticleValueType and `data` the interleaved values.
+// Returns false for unsupported types or an empty body.
+//
+static bool
+ExtractEmpChannel(
+  int& type,                            // out
+  ArenaArray<char>& data,               // out
+  const Nb::ParticleShape& shape,       // in
+  const Nb::String& name,               // in
+  Nb::ValueBase::Type empType,          // in
+  const std::vector<size_t>& offsets)   // in
+{
+  const size_t n = offsets.back();
+  if (n == 0) {
+    type = -1;
+    data.clear();
+    return false;
+  }
+
+  switch (empType) {
+  case Nb::ValueBase::FloatType:
+    type = EmpFloatTraits::Type;
+    data.resize(n * GetParticleTypeSize(type));
+    ExtractBlocks<EmpFloatTraits>(reinterpret_cast<float*>(&data[0]), shape, name, offsets);
+    return true;
+  case Nb::ValueBase::IntType:
+    type = EmpInt32Traits::Type;
+    data.resize(n * GetParticleTypeSize(type));
+    ExtractBlocks<EmpInt32Traits>(reinterpret_cast<int32_t*>(&data[0]), shape, name, offsets);
+    return true;
+  case Nb::ValueBase::Int64Type:
+    type = EmpInt64Traits::Type;
+    data.resize(n * GetParticleTypeSize(type));
+    ExtractBlocks<EmpInt64Traits>(reinterpret_cast<int64_t*>(&data[0]), shape, name, offsets);
+    return true;
+  case Nb::ValueBase::Vec3fType:
+    type = EmpVec3fTraits::Type;
+    data.resize(n * GetParticleTypeSize(type));
+    ExtractBlocks<EmpVec3fTraits>(reinterpret_cast<float*>(&data[0]), shape, name, offsets);
+    return true;
+  case Nb::ValueBase::Vec3iType:
+    type = EmpVec3iTraits::Type;
+    data.resize(n * GetParticleTypeSize(type));
+    ExtractBlocks<EmpVec3iTraits>(reinterpret_cast<int32_t*>(&data[0]), shape, name, offsets);
+    return true;
+  default:
+    return false;
+  }
+}
+
+#endif  // EMP_CHANNEL_H_
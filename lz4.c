@@ -694,13 +694,14 @@ int LZ4_uncompress_unknownOutputSize(
 	{
 		// get runlength
 		token = *ip++;
-		if ((length=(token>>ML_BITS)) == RUN_MASK)  { for (;(len=*ip++)==255;length+=255){} length += len; } 
+		if ((length=(token>>ML_BITS)) == RUN_MASK)  { len=255; while ((ip<iend) && (len==255)) { len=*ip++; length += len; } }
 
 		// copy literals
+		// (input bounds are checked too: the last literals must end the input exactly)
 		cpy = op+length;
-		if (cpy>oend-COPYLENGTH) 
+		if ((cpy>oend-COPYLENGTH) || (length>iend-ip-COPYLENGTH))
 		{ 
-			if (cpy > oend) goto _output_error;
+			if ((cpy > oend) || (length != iend-ip)) goto _output_error;
 			memcpy(op, ip, length);
 			op += length;
 			break;    // Necessarily EOF
@@ -713,7 +714,7 @@ int LZ4_uncompress_unknownOutputSize(
 		if (ref < (BYTE* const)dest) goto _output_error;
 
 		// get matchlength
-		if ((length=(token&ML_MASK)) == ML_MASK) { for (;(len=*ip++)==255;length+=255){} length += len; }
+		if ((length=(token&ML_MASK)) == ML_MASK) { len=255; while ((ip<iend-LASTLITERALS) && (len==255)) { len=*ip++; length += len; } }
 
 		// copy repeated sequence
 		if (op-ref<STEPSIZE)
@@ -69,7 +69,7 @@ LZ4_uncompress_unknownOutputSize() :
 	maxOutputSize : is the size of the destination buffer (which must be already allocated)
 	return : the number of bytes decoded in the destination buffer (necessarily <= maxOutputSize)
 			 If the source stream is malformed, the function will stop decoding and return a negative result, indicating the byte position of the faulty instruction
-			 This version never writes beyond dest + maxOutputSize, and is therefore protected against malicious data packets
+			 This version never writes beyond dest + maxOutputSize, nor reads beyond source + isize, and is therefore protected against malicious data packets
 	note   : This version is a bit slower than LZ4_uncompress
 */
 
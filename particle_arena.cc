@@ -0,0 +1,141 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "particle_arena.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Transparent huge page size on x86-64. Blocks are aligned to it.
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+static const size_t kAlignment    = 64;
+
+static size_t
+RoundUp(
+  size_t size,
+  size_t alignment)
+{
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+ParticleArena::ParticleArena(
+  size_t blockSize)
+  : blockSize_(RoundUp(blockSize, kHugePageSize))
+  , current_(0)
+{
+}
+
+ParticleArena::~ParticleArena()
+{
+  for (size_t i = 0; i < blocks_.size(); i++) {
+    munmap(blocks_[i].base, blocks_[i].size);
+  }
+}
+
+bool
+ParticleArena::MapBlock(
+  Block& block,
+  size_t size)
+{
+  // Over-map and trim, so that the block starts at a huge page boundary.
+  const size_t mapSize = size + kHugePageSize;
+  void* p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %lld bytes.\n", (long long)size);
+    return false;
+  }
+
+  char*  base = reinterpret_cast<char*>(RoundUp(reinterpret_cast<uintptr_t>(p), kHugePageSize));
+  size_t head = base - reinterpret_cast<char*>(p);
+  if (head > 0) {
+    munmap(p, head);
+  }
+  if (mapSize - head - size > 0) {
+    munmap(base + size, mapSize - head - size);
+  }
+
+#ifdef MADV_HUGEPAGE
+  madvise(base, size, MADV_HUGEPAGE);   // Only a hint. Fails without THP.
+#endif
+
+  //
+  // First touch from all threads, so that the block is spread over the
+  // NUMA nodes of the worker threads instead of landing on the node of the
+  // allocating thread, and the page faults are taken here in parallel.
+  // Consumers(dynamic schedules, blocks reused across bodies and frames)
+  // do not follow this partition, so it balances memory bandwidth across
+  // nodes rather than making accesses node local.
+  //
+  const long pageSize = sysconf(_SC_PAGESIZE);
+  const long long numPages = (long long)(size / pageSize);
+
+  #pragma omp parallel for schedule(static)
+  for (long long i = 0; i < numPages; i++) {
+    base[i * pageSize] = 0;
+  }
+
+  block.base = base;
+  block.size = size;
+  block.used = 0;
+  return true;
+}
+
+void*
+ParticleArena::Allocate(
+  size_t size)
+{
+  size = RoundUp(size, kAlignment);
+
+  for (; current_ < blocks_.size(); current_++) {
+    Block& block = blocks_[current_];
+    if (block.used + size <= block.size) {
+      void* p = block.base + block.used;
+      block.used += size;
+      return p;
+    }
+  }
+
+  // An allocation larger than a block gets a block of its own size.
+  Block block;
+  if (!MapBlock(block, RoundUp(size > blockSize_ ? size : blockSize_, kHugePageSize))) {
+    abort();
+  }
+  block.used = size;
+  blocks_.push_back(block);
+  current_ = blocks_.size() - 1;
+
+  return block.base;
+}
+
+void
+ParticleArena::Reset()
+{
+  for (size_t i = 0; i < blocks_.size(); i++) {
+    blocks_[i].used = 0;
+  }
+  current_ = 0;
+}
+
+size_t
+ParticleArena::GetMappedSize() const
+{
+  size_t size = 0;
+  for (size_t i = 0; i < blocks_.size(); i++) {
+    size += blocks_[i].size;
+  }
+  return size;
+}
+
+size_t
+ParticleArena::GetUsedSize() const
+{
+  size_t size = 0;
+  for (size_t i = 0; i < blocks_.size(); i++) {
+    size += blocks_[i].used;
+  }
+  return size;
+}
@@ -0,0 +1,113 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Arena for large channel and compression buffers.
+//
+// Memory is mapped in big blocks which are advised for transparent huge
+// pages and first touched page by page from all OpenMP threads, so with
+// the kernel's first touch policy the pages are spread over the NUMA
+// nodes of the worker threads(not placed for the thread which later uses
+// a page). Allocations are uninitialized and are all released at once by
+// Reset(); the mapped blocks are kept and reused by the next body or
+// frame. Not thread safe.
+//
+#ifndef PARTICLE_ARENA_H_
+#define PARTICLE_ARENA_H_
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+
+class ParticleArena
+{
+ public:
+  explicit ParticleArena(size_t blockSize = 256 * 1024 * 1024);
+  ~ParticleArena();
+
+  // Uninitialized, 64 byte aligned. Valid until Reset().
+  void* Allocate(size_t size);
+
+  // Invalidate all allocations. Mapped blocks are kept for reuse.
+  void Reset();
+
+  size_t GetMappedSize() const;
+  size_t GetUsedSize() const;
+
+ private:
+  ParticleArena(const ParticleArena&);
+  ParticleArena& operator=(const ParticleArena&);
+
+  struct Block {
+    char*  base;
+    size_t size;
+    size_t used;
+  };
+
+  bool MapBlock(Block& block, size_t size);
+
+  size_t             blockSize_;
+  std::vector<Block> blocks_;
+  size_t             current_;    // Blocks before this one are full.
+};
+
+//
+// Growable array of trivially copyable `T` in a ParticleArena, a drop-in
+// for the std::vector subset used on channel data. Unlike std::vector,
+// resize() leaves new elements uninitialized. Growing leaves the old
+// storage in the arena until Reset(). Copies share the storage(the arena
+// owns it), so containers of ArenaArray can reallocate cheaply.
+//
+template<typename T>
+class ArenaArray
+{
+ public:
+  explicit ArenaArray(ParticleArena* arena = NULL)
+    : arena_(arena), data_(NULL), size_(0), capacity_(0) {}
+
+  // Must be set before the first allocation.
+  void SetArena(ParticleArena* arena) {
+    assert(!data_);
+    arena_ = arena;
+  }
+
+  void resize(size_t n) {
+    if (n > capacity_) {
+      assert(arena_);
+      size_t capacity = (n > 2 * capacity_) ? n : 2 * capacity_;
+      T* data = reinterpret_cast<T*>(arena_->Allocate(capacity * sizeof(T)));
+      if (size_) memcpy(data, data_, size_ * sizeof(T));
+      data_     = data;
+      capacity_ = capacity;
+    }
+    size_ = n;
+  }
+
+  void clear() { size_ = 0; }
+
+  void swap(ArenaArray& rhs) {
+    std::swap(arena_, rhs.arena_);
+    std::swap(data_, rhs.data_);
+    std::swap(size_, rhs.size_);
+    std::swap(capacity_, rhs.capacity_);
+  }
+
+  size_t   size() const  { return size_; }
+  bool     empty() const { return size_ == 0; }
+  T*       data()        { return data_; }
+  const T* data() const  { return data_; }
+
+  T&       operator[](size_t i)       { return data_[i]; }
+  const T& operator[](size_t i) const { return data_[i]; }
+
+ private:
+  ParticleArena* arena_;
+  T*             data_;
+  size_t         size_;
+  size_t         capacity_;
+};
+
+#endif  // PARTICLE_ARENA_H_
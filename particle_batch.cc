@@ -0,0 +1,1067 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+// To handle 2GB+ file.
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "particle_batch.h"
+#include "particle_codec.h"
+#include "particle_pack.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <deque>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+// IORING_OP_OPENAT and IORING_OP_READ came with 5.6, as did this flag.
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(IORING_FEAT_RW_CUR_POS)
+#define PARTICLE_BATCH_IO_URING
+#endif
+#endif
+
+// First read of a file. Usually holds all headers.
+static const size_t kHeadReadSize = 64 * 1024;
+
+struct BatchFile
+{
+  const ParticleBatchRequest* request;
+  ParticleFrame*              frame;
+  int                         fd;
+  std::vector<char>           head;       // Beginning of the file.
+  size_t                      headSize;   // Bytes of `head` read so far.
+  int                         pending;    // Chunks not decoded yet.
+  bool                        failed;
+};
+
+struct BatchChunk
+{
+  BatchFile*          file;
+  char*               dst;          // Into the frame channel.
+  ParticleChunkHeader header;
+  int                 elementSize;
+  int                 wordSize;
+  int                 fd;           // Of the file, or of the pack.
+  uint64_t            offset;       // Of the payload in `fd`.
+  std::vector<char>   stored;       // Allocated when the read starts.
+  uint32_t            filled;       // Bytes of `stored` read so far.
+};
+
+struct BatchPack
+{
+  ParticlePack pack;
+  int          fd;                  // For payload reads.
+};
+
+enum HeadState
+{
+  HEAD_FAILED,
+  HEAD_MORE,                        // Read `head` further.
+  HEAD_DONE
+};
+
+//
+// Size of all headers of the file beginning with `head`, or 0 when it is
+// not a particle file. Returns a size larger than `size` when more bytes
+// are needed to tell.
+//
+static uint64_t
+GetHeadersSize(
+  const char* head,
+  size_t size)
+{
+  ParticleFileHeader header;
+  if (size < sizeof(ParticleFileHeader)) {
+    return sizeof(ParticleFileHeader);
+  }
+  memcpy(&header, head, sizeof(ParticleFileHeader));
+  if ((memcmp(header.magic, PARTICLE_FILE_MAGIC, 4) != 0) ||
+      (header.version != PARTICLE_FILE_VERSION) || (header.numBodies == 0)) {
+    return 0;
+  }
+
+  const uint64_t channelsBegin = sizeof(ParticleFileHeader) +
+                                 (uint64_t)header.numBodies * sizeof(ParticleBodyHeader);
+  const uint64_t chunksBegin   = channelsBegin +
+                                 (uint64_t)header.numChannels * sizeof(ParticleChannelHeader);
+  if (size < chunksBegin) {
+    return chunksBegin;
+  }
+
+  uint64_t numChunks = 0;
+  for (uint32_t c = 0; c < header.numChannels; c++) {
+    ParticleChannelHeader channel;
+    memcpy(&channel, head + channelsBegin + c * sizeof(ParticleChannelHeader),
+           sizeof(ParticleChannelHeader));
+    numChunks += channel.numChunks;
+  }
+
+  return chunksBegin + numChunks * sizeof(ParticleChunkHeader);
+}
+
+// After `n` more bytes of `head` were read(0 at EOF).
+static HeadState
+AdvanceHead(
+  BatchFile& file,
+  size_t n)
+{
+  file.headSize += n;
+
+  const uint64_t needed = GetHeadersSize(&file.head[0], file.headSize);
+  if ((needed == 0) || ((needed > file.headSize) && (n == 0))) {
+    fprintf(stderr, "%s is not a particle file(or unsupported version).\n",
+            file.request->filename.c_str());
+    return HEAD_FAILED;
+  }
+
+  if (needed > file.headSize) {
+    if (needed > file.head.size()) {
+      file.head.resize(needed);
+    }
+    return HEAD_MORE;
+  }
+
+  return HEAD_DONE;
+}
+
+#if defined(PARTICLE_BATCH_IO_URING)
+
+//
+// Minimal io_uring(no liburing dependency): one submission and one
+// completion queue, used by a single thread.
+//
+class IoRing
+{
+ public:
+  IoRing();
+  ~IoRing();
+
+  bool Init(unsigned entries);
+  void Close();
+
+  // Returns NULL when the submission queue is full.
+  struct io_uring_sqe* GetSqe();
+
+  // Submits the prepared entries. `numSubmitted` is the number the kernel
+  // took, also on failure.
+  bool Submit(
+    unsigned& numSubmitted);    // out
+
+  // Blocks until a completion arrives.
+  bool Wait(
+    uint64_t& userData,         // out
+    int& res);                  // out
+
+ private:
+  IoRing(const IoRing&);
+  IoRing& operator=(const IoRing&);
+
+  int                   fd_;
+  char*                 sqRing_;
+  size_t                sqRingSize_;
+  char*                 cqRing_;
+  size_t                cqRingSize_;
+  struct io_uring_sqe*  sqes_;
+  size_t                sqesSize_;
+
+  unsigned*             sqHead_;
+  unsigned*             sqTail_;
+  unsigned*             sqMask_;
+  unsigned*             sqArray_;
+  unsigned              sqEntries_;
+  unsigned              sqeTail_;     // Prepared, not yet published.
+
+  unsigned*             cqHead_;
+  unsigned*             cqTail_;
+  unsigned*             cqMask_;
+  struct io_uring_cqe*  cqes_;
+};
+
+IoRing::IoRing()
+  : fd_(-1)
+  , sqRing_(NULL)
+  , sqRingSize_(0)
+  , cqRing_(NULL)
+  , cqRingSize_(0)
+  , sqes_(NULL)
+  , sqesSize_(0)
+  , sqeTail_(0)
+{
+}
+
+IoRing::~IoRing()
+{
+  Close();
+}
+
+bool
+IoRing::Init(
+  unsigned entries)
+{
+  Close();
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd_ = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+  }
+
+  void* p = mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 fd_, IORING_OFF_SQ_RING);
+  if (p == MAP_FAILED) {
+    Close();
+    return false;
+  }
+  sqRing_ = reinterpret_cast<char*>(p);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cqRing_ = sqRing_;
+  } else {
+    p = mmap(NULL, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             fd_, IORING_OFF_CQ_RING);
+    if (p == MAP_FAILED) {
+      Close();
+      return false;
+    }
+    cqRing_ = reinterpret_cast<char*>(p);
+  }
+
+  sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  p = mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+           fd_, IORING_OFF_SQES);
+  if (p == MAP_FAILED) {
+    Close();
+    return false;
+  }
+  sqes_ = reinterpret_cast<struct io_uring_sqe*>(p);
+
+  sqHead_    = reinterpret_cast<unsigned*>(sqRing_ + params.sq_off.head);
+  sqTail_    = reinterpret_cast<unsigned*>(sqRing_ + params.sq_off.tail);
+  sqMask_    = reinterpret_cast<unsigned*>(sqRing_ + params.sq_off.ring_mask);
+  sqArray_   = reinterpret_cast<unsigned*>(sqRing_ + params.sq_off.array);
+  sqEntries_ = params.sq_entries;
+  sqeTail_   = *sqTail_;
+
+  cqHead_    = reinterpret_cast<unsigned*>(cqRing_ + params.cq_off.head);
+  cqTail_    = reinterpret_cast<unsigned*>(cqRing_ + params.cq_off.tail);
+  cqMask_    = reinterpret_cast<unsigned*>(cqRing_ + params.cq_off.ring_mask);
+  cqes_      = reinterpret_cast<struct io_uring_cqe*>(cqRing_ + params.cq_off.cqes);
+
+  return true;
+}
+
+void
+IoRing::Close()
+{
+  if (sqes_) {
+    munmap(sqes_, sqesSize_);
+  }
+  if (cqRing_ && (cqRing_ != sqRing_)) {
+    munmap(cqRing_, cqRingSize_);
+  }
+  if (sqRing_) {
+    munmap(sqRing_, sqRingSize_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+
+  fd_     = -1;
+  sqRing_ = NULL;
+  cqRing_ = NULL;
+  sqes_   = NULL;
+}
+
+struct io_uring_sqe*
+IoRing::GetSqe()
+{
+  const unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+  if (sqeTail_ - head >= sqEntries_) {
+    return NULL;
+  }
+
+  const unsigned index = sqeTail_ & *sqMask_;
+  sqArray_[index] = index;
+  sqeTail_++;
+
+  memset(&sqes_[index], 0, sizeof(struct io_uring_sqe));
+  return &sqes_[index];
+}
+
+bool
+IoRing::Submit(
+  unsigned& numSubmitted)
+{
+  unsigned count = sqeTail_ - *sqTail_;
+  __atomic_store_n(sqTail_, sqeTail_, __ATOMIC_RELEASE);
+
+  numSubmitted = 0;
+  while (count > 0) {
+    int n = (int)syscall(__NR_io_uring_enter, fd_, count, 0, 0, NULL, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (n == 0) {
+      // Nothing taken. Retrying would spin, so fail and let the caller fall
+      // back. Left entries are never taken by Wait(), which submits none.
+      errno = EAGAIN;
+      return false;
+    }
+    count        -= n;
+    numSubmitted += n;
+  }
+
+  return true;
+}
+
+bool
+IoRing::Wait(
+  uint64_t& userData,
+  int& res)
+{
+  for (;;) {
+    const unsigned head = *cqHead_;
+    if (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+      const struct io_uring_cqe& cqe = cqes_[head & *cqMask_];
+      userData = cqe.user_data;
+      res      = cqe.res;
+      __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+
+    if ((syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) &&
+        (errno != EINTR)) {
+      return false;
+    }
+  }
+}
+
+#endif  // PARTICLE_BATCH_IO_URING
+
+class ParticleBatch
+{
+ public:
+  ParticleBatch(
+    std::vector<ParticleFrame>& frames,
+    const std::vector<ParticleBatchRequest>& requests,
+    const ParticleBatchOption& option);
+  ~ParticleBatch();
+
+  void Run();
+
+  bool IsLoaded(int i) const { return !files_[i].failed; }
+
+ private:
+  // Operations through io_uring. Tagged into the low bits of the pointer.
+  enum {
+    OP_OPEN  = 0,   // BatchFile
+    OP_HEAD  = 1,   // BatchFile
+    OP_CHUNK = 2,   // BatchChunk
+    OP_MASK  = 3
+  };
+
+  // A file to load with pread()(chunk is NULL), or a chunk to read the
+  // rest of and decode.
+  struct Task {
+    BatchFile*  file;
+    BatchChunk* chunk;
+  };
+
+  static void* WorkerEntry(void* arg);
+  void WorkerLoop();
+
+  void PushTask(BatchFile* file, BatchChunk* chunk);
+
+  bool ParseHeaders(
+    std::vector<BatchChunk*>& chunks,   // out
+    BatchFile& file);                   // in
+
+  // Chunks with a read still to be done go to `ops` when given.
+  void StartChunks(
+    BatchFile& file,                    // in
+    const std::vector<BatchChunk*>& chunks, // in
+    std::deque<uint64_t>* ops);         // out
+
+  void FailFile(BatchFile& file);
+  void FinishFileLocked(BatchFile& file);
+  void FinishChunk(BatchChunk* chunk, bool ok);
+
+  void LoadFile(BatchFile& file);
+  void LoadChunk(BatchChunk* chunk);
+
+#if defined(PARTICLE_BATCH_IO_URING)
+  bool RunIoRing();
+  void PrepareOp(struct io_uring_sqe* sqe, uint64_t op);
+  void CompleteOp(uint64_t op, int res, std::deque<uint64_t>& ops);
+  void FallBack(uint64_t op);
+  void Abandon(uint64_t op);
+#endif
+
+  std::vector<BatchFile>            files_;
+  ParticleBatchOption               option_;
+
+  pthread_mutex_t                   packMutex_;
+  std::map<std::string, BatchPack*> packs_;
+
+  pthread_mutex_t                   mutex_;
+  pthread_cond_t                    taskCond_;  // Signaled when a task is queued or on stop.
+  pthread_cond_t                    doneCond_;  // Signaled when a file finished.
+  std::vector<pthread_t>            threads_;
+  std::deque<Task>                  tasks_;
+  size_t                            numDone_;
+  bool                              stop_;
+};
+
+ParticleBatch::ParticleBatch(
+  std::vector<ParticleFrame>& frames,
+  const std::vector<ParticleBatchRequest>& requests,
+  const ParticleBatchOption& option)
+  : option_(option)
+  , numDone_(0)
+  , stop_(false)
+{
+  frames.clear();
+  frames.resize(requests.size());
+
+  files_.resize(requests.size());
+  for (size_t i = 0; i < requests.size(); i++) {
+    frames[i].frame = (int)i;
+
+    BatchFile& file = files_[i];
+    file.request  = &requests[i];
+    file.frame    = &frames[i];
+    file.fd       = -1;
+    file.headSize = 0;
+    file.pending  = 0;
+    file.failed   = false;
+  }
+
+  pthread_mutex_init(&packMutex_, NULL);
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&taskCond_, NULL);
+  pthread_cond_init(&doneCond_, NULL);
+}
+
+ParticleBatch::~ParticleBatch()
+{
+  for (std::map<std::string, BatchPack*>::iterator it = packs_.begin(); it != packs_.end(); ++it) {
+    if (it->second->fd >= 0) {
+      close(it->second->fd);
+    }
+    delete it->second;
+  }
+
+  pthread_cond_destroy(&doneCond_);
+  pthread_cond_destroy(&taskCond_);
+  pthread_mutex_destroy(&mutex_);
+  pthread_mutex_destroy(&packMutex_);
+}
+
+void
+ParticleBatch::Run()
+{
+  threads_.resize(std::max(option_.numThreads, 1));
+  for (size_t i = 0; i < threads_.size(); i++) {
+    pthread_create(&threads_[i], NULL, WorkerEntry, this);
+  }
+
+  bool submitted = false;
+#if defined(PARTICLE_BATCH_IO_URING)
+  if (option_.useIoUring) {
+    submitted = RunIoRing();
+  }
+#endif
+  if (!submitted) {
+    for (size_t i = 0; i < files_.size(); i++) {
+      PushTask(&files_[i], NULL);
+    }
+  }
+
+  pthread_mutex_lock(&mutex_);
+  while (numDone_ < files_.size()) {
+    pthread_cond_wait(&doneCond_, &mutex_);
+  }
+  stop_ = true;
+  pthread_cond_broadcast(&taskCond_);
+  pthread_mutex_unlock(&mutex_);
+
+  for (size_t i = 0; i < threads_.size(); i++) {
+    pthread_join(threads_[i], NULL);
+  }
+
+  for (size_t i = 0; i < files_.size(); i++) {
+    if (files_[i].failed) {
+      files_[i].frame->channels.clear();
+    }
+  }
+}
+
+void*
+ParticleBatch::WorkerEntry(
+  void* arg)
+{
+  reinterpret_cast<ParticleBatch*>(arg)->WorkerLoop();
+  return NULL;
+}
+
+void
+ParticleBatch::WorkerLoop()
+{
+  pthread_mutex_lock(&mutex_);
+
+  for (;;) {
+    if (tasks_.empty()) {
+      if (stop_) {
+        break;
+      }
+      pthread_cond_wait(&taskCond_, &mutex_);
+      continue;
+    }
+
+    Task task = tasks_.front();
+    tasks_.pop_front();
+
+    pthread_mutex_unlock(&mutex_);
+
+    if (task.chunk) {
+      LoadChunk(task.chunk);
+    } else {
+      LoadFile(*task.file);
+    }
+
+    pthread_mutex_lock(&mutex_);
+  }
+
+  pthread_mutex_unlock(&mutex_);
+}
+
+void
+ParticleBatch::PushTask(
+  BatchFile* file,
+  BatchChunk* chunk)
+{
+  Task task;
+  task.file  = file;
+  task.chunk = chunk;
+
+  pthread_mutex_lock(&mutex_);
+  tasks_.push_back(task);
+  pthread_cond_signal(&taskCond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+//
+// Same checks as ParticleReader::Open(). Fills the frame with the body
+// headers and the requested channels(sized), and `chunks` with their reads.
+//
+bool
+ParticleBatch::ParseHeaders(
+  std::vector<BatchChunk*>& chunks,
+  BatchFile& file)
+{
+  const char*    p       = &file.head[0];
+  ParticleFrame& frame   = *file.frame;
+  const std::vector<std::string>& names = file.request->channels;
+
+  ParticleFileHeader header;
+  memcpy(&header, p, sizeof(ParticleFileHeader));
+  p += sizeof(ParticleFileHeader);
+
+  frame.bodies.resize(header.numBodies);
+  memcpy(&frame.bodies[0], p, header.numBodies * sizeof(ParticleBodyHeader));
+  p += header.numBodies * sizeof(ParticleBodyHeader);
+
+  std::vector<ParticleChannelHeader> channels(header.numChannels);
+  std::vector<size_t>                firstChunk(header.numChannels);
+  size_t numChunks = 0;
+  for (uint32_t c = 0; c < header.numChannels; c++) {
+    memcpy(&channels[c], p, sizeof(ParticleChannelHeader));
+    p += sizeof(ParticleChannelHeader);
+    channels[c].name[PARTICLE_CHANNEL_NAME_LEN - 1] = '\0';
+    firstChunk[c] = numChunks;
+    numChunks += channels[c].numChunks;
+  }
+  const char* chunkHeaders = p;
+
+  header.packName[PARTICLE_PACK_NAME_LEN - 1] = '\0';
+  std::string packFilename;
+  if (header.packName[0] != '\0') {
+    // Relative to the directory of the file.
+    const std::string& filename = file.request->filename;
+    size_t slash = filename.find_last_of('/');
+    packFilename = (slash == std::string::npos) ? std::string() : filename.substr(0, slash + 1);
+    packFilename += header.packName;
+  }
+
+  std::vector<uint32_t> selected;   // File channel of each frame channel.
+  for (size_t b = 0; b < frame.bodies.size(); b++) {
+    const ParticleBodyHeader& body = frame.bodies[b];
+    frame.bodies[b].name[PARTICLE_BODY_NAME_LEN - 1] = '\0';
+    if ((uint64_t)body.firstChannel + body.numChannels > channels.size()) {
+      return false;
+    }
+
+    for (uint32_t c = body.firstChannel; c < body.firstChannel + body.numChannels; c++) {
+      if (!names.empty() &&
+          (std::find(names.begin(), names.end(), std::string(channels[c].name)) == names.end())) {
+        continue;
+      }
+      frame.channels.push_back(ParticleFrame::Channel());
+      frame.channels.back().body   = (int)b;
+      frame.channels.back().header = channels[c];
+      selected.push_back(c);
+    }
+  }
+
+  // Sized after all push_back()s, since chunks point into the data.
+  for (size_t i = 0; i < frame.channels.size(); i++) {
+    ParticleFrame::Channel& channel = frame.channels[i];
+    channel.data.resize(channel.header.numElements * GetParticleTypeSize(channel.header.type));
+  }
+
+  for (size_t i = 0; i < frame.channels.size(); i++) {
+    ParticleFrame::Channel&      channel = frame.channels[i];
+    const ParticleChannelHeader& ch      = channel.header;
+    const int wordSize    = GetParticleTypeWordSize(ch.type);
+    const int elementSize = (ch.flags & PARTICLE_CHANNEL_FLAG_PLANAR)
+                          ? wordSize : GetParticleTypeSize(ch.type);
+
+    size_t offset = 0;
+    for (uint32_t k = 0; k < ch.numChunks; k++) {
+      BatchChunk* chunk = new BatchChunk();
+      chunks.push_back(chunk);
+      memcpy(&chunk->header, chunkHeaders + (firstChunk[selected[i]] + k) * sizeof(ParticleChunkHeader),
+             sizeof(ParticleChunkHeader));
+      if (offset + chunk->header.rawSize > channel.data.size()) {
+        return false;
+      }
+
+      chunk->file        = &file;
+      chunk->dst         = channel.data.empty() ? NULL : (&channel.data[0] + offset);
+      chunk->elementSize = elementSize;
+      chunk->wordSize    = wordSize;
+      chunk->fd          = file.fd;
+      chunk->offset      = chunk->header.offset;
+      chunk->filled      = 0;
+      offset += chunk->header.rawSize;
+
+      if (chunk->header.flags & PARTICLE_CHUNK_FLAG_PACKED) {
+        pthread_mutex_lock(&packMutex_);
+        BatchPack*& pack = packs_[packFilename];
+        if (!pack) {
+          pack     = new BatchPack();
+          pack->fd = -1;
+          if (!packFilename.empty() && pack->pack.Open(packFilename, false)) {
+            pack->fd = open(packFilename.c_str(), O_RDONLY | O_CLOEXEC);
+          }
+          if (pack->fd < 0) {
+            fprintf(stderr, "Failed to open pack file %s.\n", packFilename.c_str());
+          }
+        }
+        const ParticlePack::Entry* entry = (pack->fd >= 0) ? pack->pack.Find(chunk->header.offset) : NULL;
+        if (entry && (entry->storedSize == chunk->header.storedSize)) {
+          chunk->fd     = pack->fd;
+          chunk->offset = entry->offset;
+        } else {
+          entry = NULL;
+        }
+        pthread_mutex_unlock(&packMutex_);
+
+        if (!entry) {
+          return false;
+        }
+      }
+    }
+
+    if (offset != channel.data.size()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void
+ParticleBatch::StartChunks(
+  BatchFile& file,
+  const std::vector<BatchChunk*>& chunks,
+  std::deque<uint64_t>* ops)
+{
+  pthread_mutex_lock(&mutex_);
+  file.pending = (int)chunks.size();
+  if (chunks.empty()) {
+    FinishFileLocked(file);
+  }
+  pthread_mutex_unlock(&mutex_);
+
+  for (size_t i = 0; i < chunks.size(); i++) {
+    if (ops && (chunks[i]->header.storedSize > 0)) {
+      ops->push_back(reinterpret_cast<uintptr_t>(chunks[i]) | OP_CHUNK);
+    } else {
+      PushTask(&file, chunks[i]);
+    }
+  }
+}
+
+void
+ParticleBatch::FailFile(
+  BatchFile& file)
+{
+  pthread_mutex_lock(&mutex_);
+  file.failed = true;
+  FinishFileLocked(file);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void
+ParticleBatch::FinishFileLocked(
+  BatchFile& file)
+{
+  if (file.fd >= 0) {
+    close(file.fd);
+    file.fd = -1;
+  }
+  std::vector<char>().swap(file.head);
+
+  numDone_++;
+  pthread_cond_signal(&doneCond_);
+}
+
+void
+ParticleBatch::FinishChunk(
+  BatchChunk* chunk,
+  bool ok)
+{
+  BatchFile& file = *chunk->file;
+  delete chunk;
+
+  pthread_mutex_lock(&mutex_);
+  if (!ok) {
+    file.failed = true;
+  }
+  if (--file.pending == 0) {
+    FinishFileLocked(file);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+// pread() path.
+void
+ParticleBatch::LoadFile(
+  BatchFile& file)
+{
+  file.fd = open(file.request->filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file.fd < 0) {
+    fprintf(stderr, "Failed to open %s.\n", file.request->filename.c_str());
+    FailFile(file);
+    return;
+  }
+
+  file.head.resize(kHeadReadSize);
+  file.headSize = 0;
+
+  HeadState state = HEAD_MORE;
+  while (state == HEAD_MORE) {
+    ssize_t n = pread(file.fd, &file.head[file.headSize], file.head.size() - file.headSize,
+                      (off_t)file.headSize);
+    if ((n < 0) && (errno == EINTR)) {
+      continue;
+    }
+    state = (n < 0) ? HEAD_FAILED : AdvanceHead(file, (size_t)n);
+  }
+
+  std::vector<BatchChunk*> chunks;
+  if ((state == HEAD_FAILED) || !ParseHeaders(chunks, file)) {
+    for (size_t i = 0; i < chunks.size(); i++) {
+      delete chunks[i];
+    }
+    FailFile(file);
+    return;
+  }
+
+  StartChunks(file, chunks, NULL);
+}
+
+// Reads what io_uring did not(all of it in the pread() path), then decodes.
+void
+ParticleBatch::LoadChunk(
+  BatchChunk* chunk)
+{
+  const ParticleChunkHeader& header = chunk->header;
+  chunk->stored.resize(header.storedSize);
+
+  while (chunk->filled < header.storedSize) {
+    ssize_t n = pread(chunk->fd, &chunk->stored[chunk->filled], header.storedSize - chunk->filled,
+                      (off_t)(chunk->offset + chunk->filled));
+    if ((n < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "Failed to read a chunk of %s.\n", chunk->file->request->filename.c_str());
+      FinishChunk(chunk, false);
+      return;
+    }
+    chunk->filled += (uint32_t)n;
+  }
+
+  bool ok = (header.rawSize == 0) ||
+            DecodeChunk(chunk->dst, header.rawSize, header.codec,
+                        chunk->stored.empty() ? NULL : &chunk->stored[0],
+                        header.storedSize, chunk->elementSize, chunk->wordSize);
+  if (!ok) {
+    fprintf(stderr, "Failed to decode a chunk of %s.\n", chunk->file->request->filename.c_str());
+  }
+  FinishChunk(chunk, ok);
+}
+
+#if defined(PARTICLE_BATCH_IO_URING)
+
+//
+// Opens, header reads and payload reads of all files are kept in flight
+// (up to queueDepth), each submitted as soon as the previous step of its
+// file completes. Read payloads are handed to the decode threads.
+// Returns false when io_uring is not available; nothing was done then.
+//
+bool
+ParticleBatch::RunIoRing()
+{
+  const unsigned depth = (unsigned)std::max(option_.queueDepth, 1);
+
+  IoRing ring;
+  if (!ring.Init(depth)) {
+    return false;
+  }
+
+  std::deque<uint64_t> ops;
+  for (size_t i = 0; i < files_.size(); i++) {
+    assert((reinterpret_cast<uintptr_t>(&files_[i]) & OP_MASK) == 0);
+    ops.push_back(reinterpret_cast<uintptr_t>(&files_[i]) | OP_OPEN);
+  }
+
+  std::deque<uint64_t> prepared;  // In the submission queue.
+  std::set<uint64_t>   inFlight;  // Taken by the kernel.
+  while (!ops.empty() || !inFlight.empty()) {
+    while (!ops.empty() && (inFlight.size() + prepared.size() < depth)) {
+      struct io_uring_sqe* sqe = ring.GetSqe();
+      if (!sqe) {
+        break;
+      }
+      PrepareOp(sqe, ops.front());
+      prepared.push_back(ops.front());
+      ops.pop_front();
+    }
+
+    unsigned numSubmitted = 0;
+    bool     ok           = ring.Submit(numSubmitted);
+    for (unsigned i = 0; i < numSubmitted; i++) {
+      inFlight.insert(prepared.front());
+      prepared.pop_front();
+    }
+
+    uint64_t op;
+    int      res;
+    if (!ok || !ring.Wait(op, res)) {
+      fprintf(stderr, "io_uring failed(errno %d). Falling back to pread().\n", errno);
+
+      // Submitted operations still complete into their buffers(or into a
+      // new fd), so wait for them before anything is retried with pread().
+      // Their follow-up operations go to `ops`.
+      ops.insert(ops.begin(), prepared.begin(), prepared.end());
+      while (!inFlight.empty() && ring.Wait(op, res)) {
+        inFlight.erase(op);
+        CompleteOp(op, res, ops);
+      }
+      for (std::set<uint64_t>::iterator it = inFlight.begin(); it != inFlight.end(); ++it) {
+        Abandon(*it);
+      }
+      ring.Close();
+
+      for (size_t i = 0; i < ops.size(); i++) {
+        FallBack(ops[i]);
+      }
+      return true;
+    }
+
+    inFlight.erase(op);
+    CompleteOp(op, res, ops);
+  }
+
+  return true;
+}
+
+void
+ParticleBatch::PrepareOp(
+  struct io_uring_sqe* sqe,
+  uint64_t op)
+{
+  sqe->user_data = op;
+
+  if ((op & OP_MASK) == OP_CHUNK) {
+    BatchChunk* chunk = reinterpret_cast<BatchChunk*>(op & ~(uint64_t)OP_MASK);
+    chunk->stored.resize(chunk->header.storedSize);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd     = chunk->fd;
+    sqe->addr   = reinterpret_cast<uintptr_t>(&chunk->stored[chunk->filled]);
+    sqe->len    = chunk->header.storedSize - chunk->filled;
+    sqe->off    = chunk->offset + chunk->filled;
+    return;
+  }
+
+  BatchFile* file = reinterpret_cast<BatchFile*>(op & ~(uint64_t)OP_MASK);
+  if ((op & OP_MASK) == OP_OPEN) {
+    sqe->opcode     = IORING_OP_OPENAT;
+    sqe->fd         = AT_FDCWD;
+    sqe->addr       = reinterpret_cast<uintptr_t>(file->request->filename.c_str());
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+  } else {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd     = file->fd;
+    sqe->addr   = reinterpret_cast<uintptr_t>(&file->head[file->headSize]);
+    sqe->len    = (unsigned)(file->head.size() - file->headSize);
+    sqe->off    = file->headSize;
+  }
+}
+
+void
+ParticleBatch::CompleteOp(
+  uint64_t op,
+  int res,
+  std::deque<uint64_t>& ops)
+{
+  // Errors(including opcodes an older kernel does not know) are retried
+  // by the pread() path, which reports them.
+  if (res < 0) {
+    FallBack(op);
+    return;
+  }
+
+  if ((op & OP_MASK) == OP_CHUNK) {
+    BatchChunk* chunk = reinterpret_cast<BatchChunk*>(op & ~(uint64_t)OP_MASK);
+    if (res == 0) {
+      fprintf(stderr, "Failed to read a chunk of %s.\n", chunk->file->request->filename.c_str());
+      FinishChunk(chunk, false);
+      return;
+    }
+    chunk->filled += (uint32_t)res;
+    if (chunk->filled < chunk->header.storedSize) {
+      ops.push_back(op);
+    } else {
+      PushTask(chunk->file, chunk);  // Decode.
+    }
+    return;
+  }
+
+  BatchFile& file = *reinterpret_cast<BatchFile*>(op & ~(uint64_t)OP_MASK);
+  if ((op & OP_MASK) == OP_OPEN) {
+    file.fd = res;
+    file.head.resize(kHeadReadSize);
+    file.headSize = 0;
+    ops.push_back(reinterpret_cast<uintptr_t>(&file) | OP_HEAD);
+    return;
+  }
+
+  HeadState state = AdvanceHead(file, (size_t)res);
+  if (state == HEAD_MORE) {
+    ops.push_back(op);
+    return;
+  }
+
+  std::vector<BatchChunk*> chunks;
+  if ((state == HEAD_FAILED) || !ParseHeaders(chunks, file)) {
+    for (size_t i = 0; i < chunks.size(); i++) {
+      delete chunks[i];
+    }
+    FailFile(file);
+    return;
+  }
+
+  StartChunks(file, chunks, &ops);
+}
+
+void
+ParticleBatch::FallBack(
+  uint64_t op)
+{
+  if ((op & OP_MASK) == OP_CHUNK) {
+    BatchChunk* chunk = reinterpret_cast<BatchChunk*>(op & ~(uint64_t)OP_MASK);
+    PushTask(chunk->file, chunk);
+    return;
+  }
+
+  BatchFile* file = reinterpret_cast<BatchFile*>(op & ~(uint64_t)OP_MASK);
+  if (file->fd >= 0) {
+    close(file->fd);
+    file->fd = -1;
+  }
+  file->frame->bodies.clear();
+  file->frame->channels.clear();
+  PushTask(file, NULL);
+}
+
+//
+// An operation whose completion can not be waited for(the ring itself
+// failed). The kernel may still write into its buffer, which is thus
+// leaked instead of freed, and its file fails.
+//
+void
+ParticleBatch::Abandon(
+  uint64_t op)
+{
+  if ((op & OP_MASK) == OP_CHUNK) {
+    BatchChunk* chunk = reinterpret_cast<BatchChunk*>(op & ~(uint64_t)OP_MASK);
+    (new std::vector<char>())->swap(chunk->stored);
+    fprintf(stderr, "Failed to read a chunk of %s.\n", chunk->file->request->filename.c_str());
+    FinishChunk(chunk, false);
+    return;
+  }
+
+  BatchFile* file = reinterpret_cast<BatchFile*>(op & ~(uint64_t)OP_MASK);
+  (new std::vector<char>())->swap(file->head);
+  fprintf(stderr, "Failed to read %s.\n", file->request->filename.c_str());
+  FailFile(*file);
+}
+
+#endif  // PARTICLE_BATCH_IO_URING
+
+int
+LoadParticleFrames(
+  std::vector<ParticleFrame>& frames,
+  std::vector<bool>& loaded,
+  const std::vector<ParticleBatchRequest>& requests,
+  const ParticleBatchOption& option)
+{
+  ParticleBatch batch(frames, requests, option);
+  batch.Run();
+
+  int numLoaded = 0;
+  loaded.resize(requests.size());
+  for (size_t i = 0; i < requests.size(); i++) {
+    loaded[i] = batch.IsLoaded((int)i);
+    numLoaded += loaded[i] ? 1 : 0;
+  }
+
+  return numLoaded;
+}
@@ -0,0 +1,58 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Batched loading of many particle files, e.g. every body and motion blur
+// neighbor frame a renderer procedural needs at startup.
+//
+// Instead of a serial open/read/decode per file, all opens, header reads
+// and payload reads of the batch are submitted together through io_uring
+// (Linux 5.6+), so their latencies on networked storage overlap. Chunks
+// are decoded by a pool of threads as their reads complete.
+//
+// When io_uring is not available(old kernel, seccomp, non Linux), or an
+// operation fails through it, the same work is done with pread() by the
+// thread pool. Errors are reported by that path.
+//
+#ifndef PARTICLE_BATCH_H_
+#define PARTICLE_BATCH_H_
+
+#include <string>
+#include <vector>
+
+#include "particle_prefetcher.h"  // ParticleFrame
+
+struct ParticleBatchRequest
+{
+  std::string               filename;
+  std::vector<std::string>  channels;   // Of every body. Empty reads all.
+};
+
+struct ParticleBatchOption
+{
+  int   numThreads;     // Decode threads(and pread threads of the fallback).
+  int   queueDepth;     // Reads in flight through io_uring.
+  bool  useIoUring;     // false always uses the pread fallback.
+
+  ParticleBatchOption()
+    : numThreads(4)
+    , queueDepth(256)
+    , useIoUring(true) {}
+};
+
+//
+// Loads `requests` into `frames`(one per request, in order, with
+// ParticleFrame::frame set to the request index). Every body header is
+// returned; only the requested channels are. A frame which could not be
+// loaded has loaded[i] false and no channels.
+// Returns the number of loaded frames.
+//
+extern int
+LoadParticleFrames(
+  std::vector<ParticleFrame>& frames,             // out
+  std::vector<bool>& loaded,                      // out
+  const std::vector<ParticleBatchRequest>& requests, // in
+  const ParticleBatchOption& option);             // in
+
+#endif  // PARTICLE_BATCH_H_
@@ -0,0 +1,465 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "particle_bitpack.h"
+
+#include <cstring>
+#include <cassert>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const int kBlockSize  = PARTICLE_BITPACK_BLOCK_SIZE;
+static const int kHeaderSize = 4;   // Without base.
+
+template<typename T> struct SignedOf;
+template<> struct SignedOf<uint32_t> { typedef int32_t Type; };
+template<> struct SignedOf<uint64_t> { typedef int64_t Type; };
+
+static inline int
+BitWidth(
+  uint64_t v)
+{
+  return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+template<typename T>
+static inline T
+LowMask(
+  int bits)
+{
+  return (bits >= (int)(8 * sizeof(T))) ? ~(T)0 : (((T)1 << bits) - 1);
+}
+
+template<typename T>
+static inline T
+ZigZag(
+  T d)
+{
+  typedef typename SignedOf<T>::Type S;
+  return (d << 1) ^ (T)((S)d >> (8 * sizeof(T) - 1));
+}
+
+template<typename T>
+static inline T
+UnZigZag(
+  T z)
+{
+  return (z >> 1) ^ (T)(-(z & 1));
+}
+
+//
+// Pack 128 offsets(already masked to `bits`) into 16 * bits bytes.
+// Offset i goes to lane i % L, each lane packs its own words in sequence.
+// There are as many offsets per lane as bits per word, so every lane ends
+// exactly at a word boundary.
+//
+#ifdef __SSE2__
+
+struct Lanes32
+{
+  enum { kBits = 32 };
+  static __m128i Sll(__m128i v, int n) { return _mm_sll_epi32(v, _mm_cvtsi32_si128(n)); }
+  static __m128i Srl(__m128i v, int n) { return _mm_srl_epi32(v, _mm_cvtsi32_si128(n)); }
+};
+
+struct Lanes64
+{
+  enum { kBits = 64 };
+  static __m128i Sll(__m128i v, int n) { return _mm_sll_epi64(v, _mm_cvtsi32_si128(n)); }
+  static __m128i Srl(__m128i v, int n) { return _mm_srl_epi64(v, _mm_cvtsi32_si128(n)); }
+};
+
+template<typename Lanes>
+static void
+PackLanes(
+  char* dst,
+  const void* src,
+  int bits)
+{
+  const __m128i* in  = reinterpret_cast<const __m128i*>(src);
+  __m128i*       out = reinterpret_cast<__m128i*>(dst);
+
+  __m128i acc   = _mm_setzero_si128();
+  int     shift = 0;
+  for (int k = 0; k < Lanes::kBits; k++) {
+    __m128i v = _mm_loadu_si128(in + k);
+    acc    = _mm_or_si128(acc, Lanes::Sll(v, shift));
+    shift += bits;
+    if (shift >= Lanes::kBits) {
+      _mm_storeu_si128(out++, acc);
+      shift -= Lanes::kBits;
+      acc    = shift ? Lanes::Srl(v, bits - shift) : _mm_setzero_si128();
+    }
+  }
+}
+
+template<typename Lanes>
+static void
+UnpackLanes(
+  void* dst,
+  const char* src,
+  int bits)
+{
+  const __m128i* in  = reinterpret_cast<const __m128i*>(src);
+  __m128i*       out = reinterpret_cast<__m128i*>(dst);
+
+  const __m128i ones = _mm_cmpeq_epi32(_mm_setzero_si128(), _mm_setzero_si128());
+  const __m128i mask = Lanes::Srl(ones, Lanes::kBits - bits);
+
+  __m128i cur   = _mm_loadu_si128(in++);
+  int     shift = 0;
+  for (int k = 0; k < Lanes::kBits; k++) {
+    __m128i v = Lanes::Srl(cur, shift);
+    shift += bits;
+    if (shift > Lanes::kBits) {
+      cur    = _mm_loadu_si128(in++);
+      shift -= Lanes::kBits;
+      v      = _mm_or_si128(v, Lanes::Sll(cur, bits - shift));
+    } else if ((shift == Lanes::kBits) && (k + 1 < Lanes::kBits)) {
+      cur   = _mm_loadu_si128(in++);
+      shift = 0;
+    }
+    _mm_storeu_si128(out + k, _mm_and_si128(v, mask));
+  }
+}
+
+static void PackBlock(char* dst, const uint32_t* src, int bits)   { PackLanes<Lanes32>(dst, src, bits); }
+static void PackBlock(char* dst, const uint64_t* src, int bits)   { PackLanes<Lanes64>(dst, src, bits); }
+static void UnpackBlock(uint32_t* dst, const char* src, int bits) { UnpackLanes<Lanes32>(dst, src, bits); }
+static void UnpackBlock(uint64_t* dst, const char* src, int bits) { UnpackLanes<Lanes64>(dst, src, bits); }
+
+#else
+
+// Same layout as the SSE2 version, one lane at a time.
+template<typename T>
+static void
+PackBlock(
+  char* dst,
+  const T* src,
+  int bits)
+{
+  const int W = 8 * sizeof(T);
+  const int L = 16 / sizeof(T);
+  T out[kBlockSize];
+  for (int l = 0; l < L; l++) {
+    T   acc   = 0;
+    int shift = 0;
+    int o     = 0;
+    for (int k = 0; k < W; k++) {
+      T v = src[k * L + l];
+      acc   |= v << shift;
+      shift += bits;
+      if (shift >= W) {
+        out[o++ * L + l] = acc;
+        shift -= W;
+        acc    = shift ? (v >> (bits - shift)) : 0;
+      }
+    }
+  }
+  memcpy(dst, out, 16 * bits);
+}
+
+template<typename T>
+static void
+UnpackBlock(
+  T* dst,
+  const char* src,
+  int bits)
+{
+  const int W = 8 * sizeof(T);
+  const int L = 16 / sizeof(T);
+  const T mask = LowMask<T>(bits);
+  T in[kBlockSize];
+  memcpy(in, src, 16 * bits);
+  for (int l = 0; l < L; l++) {
+    int o     = 0;
+    int shift = 0;
+    T   cur   = in[l];
+    for (int k = 0; k < W; k++) {
+      T v = cur >> shift;
+      shift += bits;
+      if (shift > W) {
+        cur    = in[++o * L + l];
+        shift -= W;
+        v     |= cur << (bits - shift);
+      } else if ((shift == W) && (k + 1 < W)) {
+        cur   = in[++o * L + l];
+        shift = 0;
+      }
+      dst[k * L + l] = v & mask;
+    }
+  }
+}
+
+#endif
+
+//
+// Bit width minimizing packed bytes plus exceptions for `offsets`.
+// Returns the size of the block payload(without header).
+//
+template<typename T>
+static int
+SelectBitWidth(
+  int& bits,                // out
+  int& numExceptions,       // out
+  const T* offsets,         // in
+  int n)                    // in
+{
+  const int W = 8 * sizeof(T);
+  int histogram[65] = {0};
+  for (int i = 0; i < n; i++) {
+    histogram[BitWidth(offsets[i])]++;
+  }
+
+  int maxBits = W;
+  while ((maxBits > 0) && (histogram[maxBits] == 0)) {
+    maxBits--;
+  }
+
+  int bestSize  = 16 * maxBits;
+  bits          = maxBits;
+  numExceptions = 0;
+  int wider     = 0;    // Offsets wider than b.
+  for (int b = maxBits - 1; b >= 0; b--) {
+    wider += histogram[b + 1];
+    int size = 16 * b + wider * (1 + (int)sizeof(T));
+    if (size < bestSize) {
+      bestSize      = size;
+      bits          = b;
+      numExceptions = wider;
+    }
+  }
+
+  return bestSize;
+}
+
+template<typename T>
+static void
+EncodeWords(
+  std::vector<char>& dst,
+  const T* words,
+  int numWords,
+  int stride)
+{
+  typedef typename SignedOf<T>::Type S;
+
+  T forOffsets[kBlockSize];
+  T deltaOffsets[kBlockSize];
+  T packed[kBlockSize];
+  char buf[16 * 64];
+
+  for (int begin = 0; begin < numWords; begin += kBlockSize) {
+    const int n = (numWords - begin < kBlockSize) ? (numWords - begin) : kBlockSize;
+    const T* w = words + begin;
+
+    // Frame of reference from the signed min, so small negative values
+    // (e.g. -1 flags) stay narrow.
+    S forBase = (S)w[0];
+    for (int i = 1; i < n; i++) {
+      if ((S)w[i] < forBase) forBase = (S)w[i];
+    }
+
+    T deltaBase = ~(T)0;
+    for (int i = 0; i < n; i++) {
+      const int g = begin + i;
+      T d = w[i] - ((g >= stride) ? words[g - stride] : 0);
+      deltaOffsets[i] = ZigZag(d);
+      if (deltaOffsets[i] < deltaBase) deltaBase = deltaOffsets[i];
+    }
+
+    for (int i = 0; i < n; i++) {
+      forOffsets[i]    = w[i] - (T)forBase;
+      deltaOffsets[i] -= deltaBase;
+    }
+
+    int forBits, forExceptions, deltaBits, deltaExceptions;
+    int forSize   = SelectBitWidth(forBits, forExceptions, forOffsets, n);
+    int deltaSize = SelectBitWidth(deltaBits, deltaExceptions, deltaOffsets, n);
+
+    const bool useDelta = (deltaSize < forSize);
+    const T*   offsets  = useDelta ? deltaOffsets : forOffsets;
+    const T    base     = useDelta ? deltaBase : (T)forBase;
+    const int  bits     = useDelta ? deltaBits : forBits;
+    const int  numExceptions = useDelta ? deltaExceptions : forExceptions;
+
+    unsigned char header[kHeaderSize] = {
+      (unsigned char)(useDelta ? PARTICLE_BITPACK_MODE_DELTA : PARTICLE_BITPACK_MODE_FOR),
+      (unsigned char)bits,
+      (unsigned char)numExceptions,
+      0
+    };
+    dst.insert(dst.end(), header, header + kHeaderSize);
+    dst.insert(dst.end(), reinterpret_cast<const char*>(&base),
+               reinterpret_cast<const char*>(&base) + sizeof(T));
+
+    if (bits > 0) {
+      const T mask = LowMask<T>(bits);
+      for (int i = 0; i < n; i++) {
+        packed[i] = offsets[i] & mask;
+      }
+      for (int i = n; i < kBlockSize; i++) {
+        packed[i] = 0;
+      }
+      PackBlock(buf, packed, bits);
+      dst.insert(dst.end(), buf, buf + 16 * bits);
+    }
+
+    if (numExceptions > 0) {
+      for (int i = 0; i < n; i++) {
+        if (BitWidth(offsets[i]) > bits) dst.push_back((char)i);
+      }
+      for (int i = 0; i < n; i++) {
+        if (BitWidth(offsets[i]) > bits) {
+          T high = offsets[i] >> bits;
+          dst.insert(dst.end(), reinterpret_cast<const char*>(&high),
+                     reinterpret_cast<const char*>(&high) + sizeof(T));
+        }
+      }
+    }
+  }
+}
+
+template<typename T>
+static bool
+DecodeWords(
+  T* words,
+  int numWords,
+  const char*& src,
+  const char* end,
+  int stride)
+{
+  const int W = 8 * sizeof(T);
+  T offsets[kBlockSize];
+
+  for (int begin = 0; begin < numWords; begin += kBlockSize) {
+    const int n = (numWords - begin < kBlockSize) ? (numWords - begin) : kBlockSize;
+    if (end - src < kHeaderSize + (int)sizeof(T)) {
+      return false;
+    }
+
+    const int mode          = (unsigned char)src[0];
+    const int bits          = (unsigned char)src[1];
+    const int numExceptions = (unsigned char)src[2];
+    T base;
+    memcpy(&base, src + kHeaderSize, sizeof(T));
+    src += kHeaderSize + sizeof(T);
+
+    if ((bits > W) || (numExceptions > n) || ((bits == W) && (numExceptions > 0)) ||
+        (end - src < 16 * bits + numExceptions * (1 + (int)sizeof(T)))) {
+      return false;
+    }
+
+    if (bits > 0) {
+      UnpackBlock(offsets, src, bits);
+      src += 16 * bits;
+    } else {
+      memset(offsets, 0, sizeof(offsets));
+    }
+
+    const char* highs = src + numExceptions;
+    for (int e = 0; e < numExceptions; e++) {
+      const int i = (unsigned char)src[e];
+      if (i >= n) {
+        return false;
+      }
+      T high;
+      memcpy(&high, highs + e * sizeof(T), sizeof(T));
+      offsets[i] |= high << bits;
+    }
+    src = highs + numExceptions * sizeof(T);
+
+    T* w = words + begin;
+    if (mode == PARTICLE_BITPACK_MODE_FOR) {
+      for (int i = 0; i < n; i++) {
+        w[i] = base + offsets[i];
+      }
+    } else if (mode == PARTICLE_BITPACK_MODE_DELTA) {
+      for (int i = 0; i < n; i++) {
+        const int g = begin + i;
+        w[i] = ((g >= stride) ? words[g - stride] : 0) + UnZigZag<T>(base + offsets[i]);
+      }
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void
+BitPackEncode(
+  std::vector<char>& dst,
+  const char* src,
+  int size,
+  int stride,
+  int wordSize)
+{
+  assert((wordSize == 4) || (wordSize == 8));
+
+  dst.clear();
+  dst.reserve(size + size / 16 + 64);
+
+  const int numWords = size / wordSize;
+  if (stride < 1) stride = 1;
+
+  // Copied, since `src` need not be word aligned.
+  if (wordSize == 8) {
+    std::vector<uint64_t> words(numWords);
+    if (numWords) memcpy(&words[0], src, numWords * wordSize);
+    EncodeWords<uint64_t>(dst, numWords ? &words[0] : NULL, numWords, stride);
+  } else {
+    std::vector<uint32_t> words(numWords);
+    if (numWords) memcpy(&words[0], src, numWords * wordSize);
+    EncodeWords<uint32_t>(dst, numWords ? &words[0] : NULL, numWords, stride);
+  }
+
+  dst.insert(dst.end(), src + numWords * wordSize, src + size);
+}
+
+bool
+BitPackDecode(
+  char* dst,
+  int rawSize,
+  const char* src,
+  int storedSize,
+  int stride,
+  int wordSize)
+{
+  if ((wordSize != 4) && (wordSize != 8)) {
+    return false;
+  }
+
+  const int numWords = rawSize / wordSize;
+  const int tail     = rawSize - numWords * wordSize;
+  const char* end    = src + storedSize;
+  if (stride < 1) stride = 1;
+
+  // Decoded in place unless `dst` is not word aligned.
+  const bool aligned = ((uintptr_t)dst % wordSize) == 0;
+  std::vector<char> storage;
+  char* words = dst;
+  if (!aligned) {
+    storage.resize(numWords * wordSize + 8);
+    words = &storage[0];
+  }
+
+  bool ok;
+  if (wordSize == 8) {
+    ok = DecodeWords<uint64_t>(reinterpret_cast<uint64_t*>(words), numWords, src, end, stride);
+  } else {
+    ok = DecodeWords<uint32_t>(reinterpret_cast<uint32_t*>(words), numWords, src, end, stride);
+  }
+  if (ok && !aligned && numWords) {
+    memcpy(dst, words, numWords * wordSize);
+  }
+
+  if (!ok || (end - src != tail)) {
+    return false;
+  }
+  memcpy(dst + numWords * wordSize, src, tail);
+  return true;
+}
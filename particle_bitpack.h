@@ -0,0 +1,60 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Frame of reference bit packing for integer channels(PARTICLE_CODEC_BITPACK).
+//
+// Words are coded in blocks of PARTICLE_BITPACK_BLOCK_SIZE. Each block is
+// either frame of reference(word - min) or delta(zigzag of the difference
+// from the same component of the previous element, minus its min),
+// whichever is smaller, and the offsets are packed with the bit width that
+// minimizes the block size. Offsets wider than that are stored as
+// exceptions(PFor), so a few outliers do not widen the whole block.
+//
+// Packed words are laid out vertically across 4(32bit) or 2(64bit) lanes
+// as in SIMD-BP128, so pack and unpack are SSE2 shifts of whole registers.
+//
+// Block:
+//
+//   uint8  mode            PARTICLE_BITPACK_MODE_*
+//   uint8  bits            0 - word bits
+//   uint8  numExceptions
+//   uint8  reserved
+//   word   base            min of the block(after delta)
+//   16 * bits bytes        packed low `bits` of every offset(always 128)
+//   uint8  x numExceptions position in the block
+//   word   x numExceptions offset >> bits
+//
+// Trailing bytes of a size which is not a multiple of the word size are
+// stored as is after the last block.
+//
+#ifndef PARTICLE_BITPACK_H_
+#define PARTICLE_BITPACK_H_
+
+#include <vector>
+
+#define PARTICLE_BITPACK_BLOCK_SIZE   (128)
+
+#define PARTICLE_BITPACK_MODE_FOR     (0)
+#define PARTICLE_BITPACK_MODE_DELTA   (1)
+
+// `stride` is the number of words per element(e.g. 3 for int3).
+extern void
+BitPackEncode(
+  std::vector<char>& dst,   // out
+  const char* src,          // in
+  int size,                 // in
+  int stride,               // in
+  int wordSize);            // in  4 or 8
+
+extern bool
+BitPackDecode(
+  char* dst,                // out
+  int rawSize,              // in
+  const char* src,          // in
+  int storedSize,           // in
+  int stride,               // in
+  int wordSize);            // in
+
+#endif  // PARTICLE_BITPACK_H_
@@ -0,0 +1,341 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Per chunk codecs for the custom particle format.
+//
+// Filters(shuffle, delta) only reorder or transform bits, so every codec
+// here is lossless.
+//
+
+#include "particle_codec.h"
+#include "particle_bitpack.h"
+#include "particle_fpredict.h"
+
+#include <cstring>
+#include <cassert>
+#include <stdint.h>
+
+extern "C" {
+#include "lz4.h"
+}
+
+static const char* kCodecNames[PARTICLE_CODEC_COUNT] = {
+  "raw",
+  "lz4",
+  "shuffle",
+  "delta",
+  "bitpack",
+  "fpredict"
+};
+
+const char*
+GetCodecName(
+  int codec)
+{
+  if (codec == PARTICLE_CODEC_AUTO) {
+    return "auto";
+  }
+  if ((codec < 0) || (codec >= PARTICLE_CODEC_COUNT)) {
+    return "unknown";
+  }
+  return kCodecNames[codec];
+}
+
+int
+GetCodecByName(
+  const char* name)
+{
+  if (strcmp(name, "auto") == 0) {
+    return PARTICLE_CODEC_AUTO;
+  }
+  for (int i = 0; i < PARTICLE_CODEC_COUNT; i++) {
+    if (strcmp(name, kCodecNames[i]) == 0) {
+      return i;
+    }
+  }
+  return PARTICLE_CODEC_COUNT;
+}
+
+int
+EstimateCompressedBufferSize(
+  int inputSize)
+{
+  // From LZ4:
+  // Worst case is one extra byte per 255 bytes of incompressible literals,
+  // plus the token and last literals.
+  return inputSize + (inputSize / 255) + 16;
+}
+
+//
+// Group n'th byte of every word together. Floats and ints of a channel
+// usually share their upper bytes, which LZ4 can then find as runs.
+//
+static void
+ShuffleBytes(
+  char* dst,
+  const char* src,
+  int size,
+  int wordSize)
+{
+  const int numWords = size / wordSize;
+  for (int w = 0; w < numWords; w++) {
+    for (int b = 0; b < wordSize; b++) {
+      dst[b * numWords + w] = src[w * wordSize + b];
+    }
+  }
+  // Trailing bytes are kept as is.
+  int tail = numWords * wordSize;
+  memcpy(dst + tail, src + tail, size - tail);
+}
+
+static void
+UnshuffleBytes(
+  char* dst,
+  const char* src,
+  int size,
+  int wordSize)
+{
+  const int numWords = size / wordSize;
+  for (int b = 0; b < wordSize; b++) {
+    for (int w = 0; w < numWords; w++) {
+      dst[w * wordSize + b] = src[b * numWords + w];
+    }
+  }
+  int tail = numWords * wordSize;
+  memcpy(dst + tail, src + tail, size - tail);
+}
+
+//
+// Replace each word with its difference from the same component of the
+// previous element. Works on bit patterns, thus lossless for floats too.
+//
+template<typename T>
+static void
+DeltaEncodeWords(
+  char* data,
+  int size,
+  int stride)
+{
+  T* w = reinterpret_cast<T*>(data);
+  const int n = size / sizeof(T);
+  for (int i = n - 1; i >= stride; i--) {
+    w[i] -= w[i - stride];
+  }
+}
+
+template<typename T>
+static void
+DeltaDecodeWords(
+  char* data,
+  int size,
+  int stride)
+{
+  T* w = reinterpret_cast<T*>(data);
+  const int n = size / sizeof(T);
+  for (int i = stride; i < n; i++) {
+    w[i] += w[i - stride];
+  }
+}
+
+static int
+CompressLZ4(
+  std::vector<char>& dst,
+  const char* src,
+  int size)
+{
+  dst.resize(EstimateCompressedBufferSize(size));
+  int len = LZ4_compress(src, &dst[0], size);
+  dst.resize(len);
+  return len;
+}
+
+// Apply the filter stage of `codec` and compress. Returns the stored size.
+static int
+EncodeFiltered(
+  std::vector<char>& dst,
+  int codec,
+  const char* src,
+  int size,
+  int elementSize,
+  int wordSize)
+{
+  switch (codec) {
+  case PARTICLE_CODEC_LZ4:
+    return CompressLZ4(dst, src, size);
+
+  case PARTICLE_CODEC_SHUFFLE_LZ4:
+    {
+      std::vector<char> shuffled(size);
+      ShuffleBytes(&shuffled[0], src, size, wordSize);
+      return CompressLZ4(dst, &shuffled[0], size);
+    }
+
+  case PARTICLE_CODEC_DELTA_LZ4:
+    {
+      std::vector<char> delta(src, src + size);
+      int stride = elementSize / wordSize;
+      if (wordSize == 8) {
+        DeltaEncodeWords<uint64_t>(&delta[0], size, stride);
+      } else {
+        DeltaEncodeWords<uint32_t>(&delta[0], size, stride);
+      }
+      std::vector<char> shuffled(size);
+      ShuffleBytes(&shuffled[0], &delta[0], size, wordSize);
+      return CompressLZ4(dst, &shuffled[0], size);
+    }
+
+  case PARTICLE_CODEC_BITPACK:
+    BitPackEncode(dst, src, size, elementSize / wordSize, wordSize);
+    return dst.size();
+
+  case PARTICLE_CODEC_FPREDICT:
+    if (!FloatPredictEncode(dst, src, size, elementSize / wordSize, wordSize)) {
+      dst.assign(src, src + size);  // Not 32bit words. Never selected.
+    }
+    return dst.size();
+
+  default:
+    dst.assign(src, src + size);
+    return size;
+  }
+}
+
+int
+SelectCodec(
+  const char* src,
+  int size,
+  int elementSize,
+  int wordSize,
+  bool integer,
+  const ParticleCodecOption& option)
+{
+  if (size <= 0) {
+    return PARTICLE_CODEC_RAW;
+  }
+
+  //
+  // Gather a sample from a few evenly spaced windows, so that a chunk
+  // which is only partially compressible is not judged by its head.
+  //
+  const int kNumWindows = 4;
+  std::vector<char> sample;
+  if (size <= option.sampleSize) {
+    sample.assign(src, src + size);
+  } else {
+    int window = option.sampleSize / kNumWindows;
+    window -= window % elementSize;
+    if (window < elementSize) window = elementSize;
+    int numElements = size / elementSize;
+    for (int i = 0; i < kNumWindows; i++) {
+      int begin = (int)(((int64_t)numElements * i) / kNumWindows) * elementSize;
+      int end   = begin + window;
+      if (end > size) end = size;
+      sample.insert(sample.end(), src + begin, src + end);
+    }
+  }
+
+  const int sampleSize = sample.size();
+  int bestCodec = PARTICLE_CODEC_RAW;
+  int bestSize  = sampleSize;
+  std::vector<char> buffer;
+  for (int codec = PARTICLE_CODEC_LZ4; codec < PARTICLE_CODEC_COUNT; codec++) {
+    if ((codec == PARTICLE_CODEC_BITPACK) && !integer) {
+      continue;
+    }
+    if ((codec == PARTICLE_CODEC_FPREDICT) && integer) {
+      continue;
+    }
+    int len = EncodeFiltered(buffer, codec, &sample[0], sampleSize, elementSize, wordSize);
+    if (len < bestSize) {
+      bestSize  = len;
+      bestCodec = codec;
+    }
+  }
+
+  // Not worth paying decompression at read time.
+  if ((double)bestSize > (double)sampleSize * (1.0 - option.minGain)) {
+    return PARTICLE_CODEC_RAW;
+  }
+
+  return bestCodec;
+}
+
+int
+EncodeChunk(
+  std::vector<char>& dst,
+  int codec,
+  const char* src,
+  int size,
+  int elementSize,
+  int wordSize)
+{
+  if (codec != PARTICLE_CODEC_RAW) {
+    int len = EncodeFiltered(dst, codec, src, size, elementSize, wordSize);
+    if (len < size) {
+      return codec;
+    }
+  }
+
+  dst.assign(src, src + size);
+  return PARTICLE_CODEC_RAW;
+}
+
+bool
+DecodeChunk(
+  char* dst,
+  int rawSize,
+  int codec,
+  const char* src,
+  int storedSize,
+  int elementSize,
+  int wordSize)
+{
+  if (codec == PARTICLE_CODEC_RAW) {
+    if (storedSize != rawSize) {
+      return false;
+    }
+    memcpy(dst, src, rawSize);
+    return true;
+  }
+
+  if (codec == PARTICLE_CODEC_BITPACK) {
+    return BitPackDecode(dst, rawSize, src, storedSize, elementSize / wordSize, wordSize);
+  }
+  if (codec == PARTICLE_CODEC_FPREDICT) {
+    return FloatPredictDecode(dst, rawSize, src, storedSize, elementSize / wordSize, wordSize);
+  }
+
+  if ((codec != PARTICLE_CODEC_LZ4) &&
+      (codec != PARTICLE_CODEC_SHUFFLE_LZ4) &&
+      (codec != PARTICLE_CODEC_DELTA_LZ4)) {
+    return false;
+  }
+
+  // Payloads come from files(and a pack shared with other processes), so
+  // the bounds checked decoder is used: neither the input nor the output
+  // is overrun by a corrupt or truncated chunk.
+  if (codec == PARTICLE_CODEC_LZ4) {
+    int len = LZ4_uncompress_unknownOutputSize(src, dst, storedSize, rawSize);
+    return (len == rawSize);
+  }
+
+  std::vector<char> shuffled(rawSize);
+  int len = LZ4_uncompress_unknownOutputSize(src, &shuffled[0], storedSize, rawSize);
+  if (len != rawSize) {
+    return false;
+  }
+  UnshuffleBytes(dst, &shuffled[0], rawSize, wordSize);
+
+  if (codec == PARTICLE_CODEC_DELTA_LZ4) {
+    int stride = elementSize / wordSize;
+    if (wordSize == 8) {
+      DeltaDecodeWords<uint64_t>(dst, rawSize, stride);
+    } else {
+      DeltaDecodeWords<uint32_t>(dst, rawSize, stride);
+    }
+  }
+
+  return true;
+}
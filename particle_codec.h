@@ -0,0 +1,93 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Per chunk codecs for the custom particle format.
+//
+#ifndef PARTICLE_CODEC_H_
+#define PARTICLE_CODEC_H_
+
+#include <vector>
+
+enum ParticleCodec
+{
+  PARTICLE_CODEC_AUTO         = -1, // Writer only. Never stored in a file.
+  PARTICLE_CODEC_RAW          = 0,
+  PARTICLE_CODEC_LZ4          = 1,
+  PARTICLE_CODEC_SHUFFLE_LZ4  = 2,  // Byte shuffle per word, then LZ4.
+  PARTICLE_CODEC_DELTA_LZ4    = 3,  // Word delta per component, byte shuffle, then LZ4.
+  PARTICLE_CODEC_BITPACK      = 4,  // Frame of reference/delta bit packing(see particle_bitpack.h).
+  PARTICLE_CODEC_FPREDICT     = 5,  // Predictive float coding(see particle_fpredict.h).
+  PARTICLE_CODEC_COUNT
+};
+
+struct ParticleCodecOption
+{
+  int   codec;        // PARTICLE_CODEC_AUTO selects the codec per chunk by sampling.
+  float minGain;      // Store raw when the sample saves less than this fraction.
+  int   sampleSize;   // Bytes of the chunk used for trial compression.
+  int   chunkSize;    // Max raw bytes per chunk.
+
+  ParticleCodecOption()
+    : codec(PARTICLE_CODEC_AUTO)
+    , minGain(0.1f)
+    , sampleSize(64 * 1024)
+    , chunkSize(4 * 1024 * 1024) {}
+};
+
+extern const char*
+GetCodecName(
+  int codec);
+
+// Returns PARTICLE_CODEC_COUNT when `name` is not a known codec name.
+extern int
+GetCodecByName(
+  const char* name);
+
+// Exact worst case size of LZ4 output.
+extern int
+EstimateCompressedBufferSize(
+  int inputSize);
+
+//
+// Trial compress a few windows of `src` with every candidate codec and
+// return the one giving the smallest output. PARTICLE_CODEC_BITPACK is a
+// candidate for `integer` data only, PARTICLE_CODEC_FPREDICT for float
+// data only.
+// Returns PARTICLE_CODEC_RAW when the best gain is below `option.minGain`.
+//
+extern int
+SelectCodec(
+  const char* src,                    // in
+  int size,                           // in
+  int elementSize,                    // in  e.g. 12 for float3
+  int wordSize,                       // in  e.g. 4 for float3
+  bool integer,                       // in
+  const ParticleCodecOption& option); // in
+
+//
+// Encode `src` with `codec`. Falls back to PARTICLE_CODEC_RAW when the
+// encoded data does not fit in `size` bytes.
+// Returns the codec actually used.
+//
+extern int
+EncodeChunk(
+  std::vector<char>& dst,   // out
+  int codec,                // in
+  const char* src,          // in
+  int size,                 // in
+  int elementSize,          // in
+  int wordSize);            // in
+
+extern bool
+DecodeChunk(
+  char* dst,                // out
+  int rawSize,              // in
+  int codec,                // in
+  const char* src,          // in
+  int storedSize,           // in
+  int elementSize,          // in
+  int wordSize);            // in
+
+#endif  // PARTICLE_CODEC_H_
@@ -0,0 +1,428 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "particle_density.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static const char* kKernelNames[PARTICLE_DENSITY_KERNEL_COUNT] = {
+  "box",
+  "tent",
+  "quadratic"
+};
+
+// Tile coordinates are biased into 21 bits each.
+static const int     kKeyBits = 21;
+static const int64_t kKeyBias = 1 << (kKeyBits - 1);
+
+// Particles further away(in voxels) are ignored, so that tiles fit in a key.
+static const float   kMaxVoxelCoord = (float)(kKeyBias * PARTICLE_DENSITY_TILE_SIZE / 2);
+
+const char*
+GetDensityKernelName(
+  int kernel)
+{
+  if ((kernel < 0) || (kernel >= PARTICLE_DENSITY_KERNEL_COUNT)) {
+    return NULL;
+  }
+  return kKernelNames[kernel];
+}
+
+int
+GetDensityKernelByName(
+  const std::string& name)
+{
+  for (int i = 0; i < PARTICLE_DENSITY_KERNEL_COUNT; i++) {
+    if (name == kKernelNames[i]) {
+      return i;
+    }
+  }
+  return PARTICLE_DENSITY_KERNEL_COUNT;
+}
+
+static inline uint64_t
+MakeTileKey(
+  int tx,
+  int ty,
+  int tz)
+{
+  // z major, so that sorting keys sorts tiles in z, y, x order.
+  return ((uint64_t)(tx + kKeyBias)) |
+         ((uint64_t)(ty + kKeyBias) << kKeyBits) |
+         ((uint64_t)(tz + kKeyBias) << (2 * kKeyBits));
+}
+
+static inline void
+GetTileCoord(
+  int coord[3],
+  uint64_t key)
+{
+  const uint64_t mask = (1ULL << kKeyBits) - 1;
+  coord[0] = (int)((key                    ) & mask) - (int)kKeyBias;
+  coord[1] = (int)((key >> kKeyBits        ) & mask) - (int)kKeyBias;
+  coord[2] = (int)((key >> (2 * kKeyBits)) & mask) - (int)kKeyBias;
+}
+
+static inline uint64_t
+HashTileKey(
+  uint64_t k)
+{
+  // MurmurHash3 finalizer. Neighbour tiles differ in a few bits only.
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// Floor division by the tile size, also for negative voxel indices.
+static inline int
+VoxelToTile(
+  int v)
+{
+  return (v >= 0) ? (v / PARTICLE_DENSITY_TILE_SIZE)
+                  : -((-v + PARTICLE_DENSITY_TILE_SIZE - 1) / PARTICLE_DENSITY_TILE_SIZE);
+}
+
+int
+ParticleDensityGrid::TileTable::Find(
+  uint64_t key) const
+{
+  if (slots.empty()) {
+    return -1;
+  }
+
+  const size_t mask = slots.size() - 1;
+  for (size_t s = HashTileKey(key) & mask; ; s = (s + 1) & mask) {
+    int32_t tile = slots[s];
+    if ((tile < 0) || (keys[tile] == key)) {
+      return tile;
+    }
+  }
+}
+
+int
+ParticleDensityGrid::TileTable::Insert(
+  uint64_t key)
+{
+  // Keep the load factor at most 1/2.
+  if (2 * (keys.size() + 1) > slots.size()) {
+    size_t capacity = slots.empty() ? 64 : 2 * slots.size();
+    slots.assign(capacity, -1);
+    for (size_t i = 0; i < keys.size(); i++) {
+      size_t s = HashTileKey(keys[i]) & (capacity - 1);
+      while (slots[s] >= 0) {
+        s = (s + 1) & (capacity - 1);
+      }
+      slots[s] = (int32_t)i;
+    }
+  }
+
+  const size_t mask = slots.size() - 1;
+  size_t s = HashTileKey(key) & mask;
+  for (; slots[s] >= 0; s = (s + 1) & mask) {
+    if (keys[slots[s]] == key) {
+      return slots[s];
+    }
+  }
+
+  int32_t tile = (int32_t)keys.size();
+  slots[s] = tile;
+  keys.push_back(key);
+  voxels.resize(voxels.size() + PARTICLE_DENSITY_TILE_VOXELS, 0.0f);
+  return tile;
+}
+
+void
+ParticleDensityGrid::TileTable::Clear()
+{
+  keys.clear();
+  slots.clear();
+  voxels.clear();
+}
+
+ParticleDensityGrid::ParticleDensityGrid(
+  float voxelSize,
+  int kernel)
+  : voxelSize_(voxelSize)
+  , kernel_(kernel)
+  , numParticles_(0)
+{
+  assert(voxelSize > 0.0f);
+  assert((kernel >= 0) && (kernel < PARTICLE_DENSITY_KERNEL_COUNT));
+}
+
+void
+ParticleDensityGrid::SplatRange(
+  TileTable& table,
+  const float* positions,
+  size_t begin,
+  size_t end,
+  float voxelSize,
+  int kernel)
+{
+  const float invVoxelSize = 1.0f / voxelSize;
+  const float invVolume    = invVoxelSize * invVoxelSize * invVoxelSize;
+  const int   T            = PARTICLE_DENSITY_TILE_SIZE;
+
+  // Consecutive particles(from the same EMP block) mostly hit the same tile.
+  uint64_t lastKey  = ~0ULL;
+  int      lastTile = -1;
+
+  for (size_t i = begin; i < end; i++) {
+    int   base[3];
+    float w[3][3];
+    int   numTaps = 1;
+    bool  valid   = true;
+
+    for (int c = 0; c < 3; c++) {
+      float u = positions[3 * i + c] * invVoxelSize;
+      if (!(std::fabs(u) < kMaxVoxelCoord)) {   // Also catches NaN/inf.
+        valid = false;
+        break;
+      }
+
+      switch (kernel) {
+      case PARTICLE_DENSITY_KERNEL_TENT: {
+        float f = u - 0.5f;
+        float b = std::floor(f);
+        float t = f - b;
+        base[c] = (int)b;
+        w[c][0] = 1.0f - t;
+        w[c][1] = t;
+        numTaps = 2;
+        break;
+      }
+      case PARTICLE_DENSITY_KERNEL_QUADRATIC: {
+        float b = std::floor(u);
+        float d = u - b - 0.5f;   // [-0.5, 0.5) from the voxel center.
+        base[c] = (int)b - 1;
+        w[c][0] = 0.5f * (0.5f - d) * (0.5f - d);
+        w[c][1] = 0.75f - d * d;
+        w[c][2] = 0.5f * (0.5f + d) * (0.5f + d);
+        numTaps = 3;
+        break;
+      }
+      default:
+        base[c] = (int)std::floor(u);
+        w[c][0] = 1.0f;
+        break;
+      }
+    }
+
+    if (!valid) {
+      continue;
+    }
+
+    for (int z = 0; z < numTaps; z++) {
+      const int vz = base[2] + z;
+      const int tz = VoxelToTile(vz);
+      for (int y = 0; y < numTaps; y++) {
+        const int   vy  = base[1] + y;
+        const int   ty  = VoxelToTile(vy);
+        const float wzy = w[2][z] * w[1][y] * invVolume;
+        for (int x = 0; x < numTaps; x++) {
+          const int vx = base[0] + x;
+          const int tx = VoxelToTile(vx);
+
+          uint64_t key = MakeTileKey(tx, ty, tz);
+          if (key != lastKey) {
+            lastKey  = key;
+            lastTile = table.Insert(key);
+          }
+
+          const int local = ((vz - tz * T) * T + (vy - ty * T)) * T + (vx - tx * T);
+          table.voxels[(size_t)lastTile * PARTICLE_DENSITY_TILE_VOXELS + local] += wzy * w[0][x];
+        }
+      }
+    }
+  }
+}
+
+void
+ParticleDensityGrid::Splat(
+  const float* positions,
+  size_t n)
+{
+#ifdef _OPENMP
+  const int numParts = omp_get_max_threads();
+#else
+  const int numParts = 1;
+#endif
+
+  std::vector<TileTable> locals(numParts);
+
+  #pragma omp parallel for schedule(static, 1)
+  for (int part = 0; part < numParts; part++) {
+    size_t begin = (n * part) / numParts;
+    size_t end   = (n * (part + 1)) / numParts;
+    SplatRange(locals[part], positions, begin, end, voxelSize_, kernel_);
+  }
+
+  // Allocate the union of touched tiles. Per tile, so cheap.
+  for (int part = 0; part < numParts; part++) {
+    for (size_t i = 0; i < locals[part].keys.size(); i++) {
+      table_.Insert(locals[part].keys[i]);
+    }
+  }
+
+  // Each grid tile is written by one thread only.
+  const long long numTiles = (long long)table_.keys.size();
+
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (long long i = 0; i < numTiles; i++) {
+    float* dst = &table_.voxels[i * PARTICLE_DENSITY_TILE_VOXELS];
+    for (int part = 0; part < numParts; part++) {
+      int tile = locals[part].Find(table_.keys[i]);
+      if (tile < 0) {
+        continue;
+      }
+      const float* src = &locals[part].voxels[(size_t)tile * PARTICLE_DENSITY_TILE_VOXELS];
+      for (int v = 0; v < PARTICLE_DENSITY_TILE_VOXELS; v++) {
+        dst[v] += src[v];
+      }
+    }
+  }
+
+  numParticles_ += n;
+}
+
+float
+ParticleDensityGrid::Lookup(
+  int x,
+  int y,
+  int z) const
+{
+  const int T  = PARTICLE_DENSITY_TILE_SIZE;
+  const int tx = VoxelToTile(x);
+  const int ty = VoxelToTile(y);
+  const int tz = VoxelToTile(z);
+  if ((std::abs(tx) >= kKeyBias) || (std::abs(ty) >= kKeyBias) || (std::abs(tz) >= kKeyBias)) {
+    return 0.0f;
+  }
+
+  int tile = table_.Find(MakeTileKey(tx, ty, tz));
+  if (tile < 0) {
+    return 0.0f;
+  }
+
+  const int local = ((z - tz * T) * T + (y - ty * T)) * T + (x - tx * T);
+  return table_.voxels[(size_t)tile * PARTICLE_DENSITY_TILE_VOXELS + local];
+}
+
+bool
+ParticleDensityGrid::Write(
+  const std::string& filename) const
+{
+  // Tiles in z, y, x order, independent of the thread count.
+  std::vector<std::pair<uint64_t, int32_t> > order(table_.keys.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = std::make_pair(table_.keys[i], (int32_t)i);
+  }
+  std::sort(order.begin(), order.end());
+
+  ParticleDensityHeader header;
+  memset(&header, 0, sizeof(ParticleDensityHeader));
+  memcpy(header.magic, PARTICLE_DENSITY_MAGIC, 4);
+  header.version      = PARTICLE_DENSITY_VERSION;
+  header.voxelSize    = voxelSize_;
+  header.kernel       = kernel_;
+  header.tileSize     = PARTICLE_DENSITY_TILE_SIZE;
+  header.numTiles     = (uint32_t)order.size();
+  header.numParticles = numParticles_;
+
+  std::string tmpFilename = filename + ".tmp";
+
+  FILE* fp = fopen(tmpFilename.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "Failed to open %s for writing.\n", tmpFilename.c_str());
+    return false;
+  }
+
+  bool ok = (fwrite(&header, sizeof(ParticleDensityHeader), 1, fp) == 1);
+
+  for (size_t i = 0; ok && (i < order.size()); i++) {
+    int32_t coord[3];
+    GetTileCoord(coord, order[i].first);
+    ok = (fwrite(coord, sizeof(int32_t), 3, fp) == 3);
+  }
+
+  for (size_t i = 0; ok && (i < order.size()); i++) {
+    const float* voxels = &table_.voxels[(size_t)order[i].second * PARTICLE_DENSITY_TILE_VOXELS];
+    ok = (fwrite(voxels, sizeof(float), PARTICLE_DENSITY_TILE_VOXELS, fp) == PARTICLE_DENSITY_TILE_VOXELS);
+  }
+
+  // A short write(e.g. disk full) must not be renamed into place.
+  if ((fclose(fp) != 0) || !ok) {
+    fprintf(stderr, "Failed to write %s.\n", tmpFilename.c_str());
+    remove(tmpFilename.c_str());
+    return false;
+  }
+
+  if (rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    fprintf(stderr, "Failed to rename %s to %s.\n", tmpFilename.c_str(), filename.c_str());
+    remove(tmpFilename.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool
+ParticleDensityGrid::Read(
+  const std::string& filename)
+{
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    return false;
+  }
+
+  ParticleDensityHeader header;
+  if ((fread(&header, sizeof(ParticleDensityHeader), 1, fp) != 1) ||
+      (memcmp(header.magic, PARTICLE_DENSITY_MAGIC, 4) != 0) ||
+      (header.version != PARTICLE_DENSITY_VERSION) ||
+      (header.tileSize != PARTICLE_DENSITY_TILE_SIZE) ||
+      (header.kernel >= PARTICLE_DENSITY_KERNEL_COUNT) ||
+      !(header.voxelSize > 0.0f)) {
+    fprintf(stderr, "%s is not a density grid file.\n", filename.c_str());
+    fclose(fp);
+    return false;
+  }
+
+  std::vector<int32_t> coords(3 * (size_t)header.numTiles);
+  table_.Clear();
+  for (uint32_t i = 0; i < header.numTiles; i++) {
+    if (fread(&coords[3 * i], sizeof(int32_t), 3, fp) != 3) {
+      fclose(fp);
+      return false;
+    }
+    table_.Insert(MakeTileKey(coords[3 * i + 0], coords[3 * i + 1], coords[3 * i + 2]));
+  }
+
+  size_t numVoxels = (size_t)header.numTiles * PARTICLE_DENSITY_TILE_VOXELS;
+  if ((table_.keys.size() != header.numTiles) ||
+      (fread(table_.voxels.empty() ? NULL : &table_.voxels[0], sizeof(float), numVoxels, fp) != numVoxels)) {
+    table_.Clear();
+    fclose(fp);
+    return false;
+  }
+
+  fclose(fp);
+
+  voxelSize_    = header.voxelSize;
+  kernel_       = header.kernel;
+  numParticles_ = header.numParticles;
+
+  return true;
+}
@@ -0,0 +1,104 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Sparse density grid rasterized from particle positions.
+//
+// Voxels are grouped in PARTICLE_DENSITY_TILE_SIZE^3 tiles, and only tiles
+// touched by a particle are allocated. A voxel holds the number of
+// particles per unit volume around its center, filtered by the kernel.
+//
+// File layout("*.density"):
+//
+//   ParticleDensityHeader
+//   int32_t  coords[numTiles][3]   Tile coordinates(voxel index / tile size).
+//   float    voxels[numTiles][PARTICLE_DENSITY_TILE_VOXELS]   x fastest.
+//
+#ifndef PARTICLE_DENSITY_H_
+#define PARTICLE_DENSITY_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#define PARTICLE_DENSITY_MAGIC        "PDEN"
+#define PARTICLE_DENSITY_VERSION      (1)
+#define PARTICLE_DENSITY_TILE_SIZE    (8)
+#define PARTICLE_DENSITY_TILE_VOXELS  (8 * 8 * 8)
+
+typedef enum {
+  PARTICLE_DENSITY_KERNEL_BOX = 0,    // Nearest voxel.
+  PARTICLE_DENSITY_KERNEL_TENT,       // Trilinear, 2^3 voxels.
+  PARTICLE_DENSITY_KERNEL_QUADRATIC,  // Quadratic B-spline, 3^3 voxels.
+  PARTICLE_DENSITY_KERNEL_COUNT
+} ParticleDensityKernel;
+
+typedef struct {
+  char      magic[4];
+  uint32_t  version;
+  float     voxelSize;
+  uint32_t  kernel;
+  uint32_t  tileSize;
+  uint32_t  numTiles;
+  uint64_t  numParticles;
+} ParticleDensityHeader;
+
+// Returns NULL for unknown kernel.
+extern const char*
+GetDensityKernelName(
+  int kernel);                // in
+
+// Returns PARTICLE_DENSITY_KERNEL_COUNT when not found.
+extern int
+GetDensityKernelByName(
+  const std::string& name);   // in
+
+class ParticleDensityGrid
+{
+ public:
+  ParticleDensityGrid(float voxelSize, int kernel);
+  ~ParticleDensityGrid() {}
+
+  //
+  // Add `n` particles(xyz interleaved). Threads accumulate into their own
+  // tiles, then each grid tile is summed from all threads by exactly one
+  // thread, so the merge needs no lock.
+  //
+  void Splat(const float* positions, size_t n);
+
+  // Atomic(temporary file + rename).
+  bool Write(const std::string& filename) const;
+  bool Read(const std::string& filename);
+
+  float    GetVoxelSize() const { return voxelSize_; }
+  int      GetKernel() const { return kernel_; }
+  uint64_t GetNumParticles() const { return numParticles_; }
+  size_t   GetNumTiles() const { return table_.keys.size(); }
+
+  // Density at voxel (x, y, z). 0 in unallocated tiles.
+  float Lookup(int x, int y, int z) const;
+
+ private:
+  // Tile key to tile index, open addressing.
+  struct TileTable {
+    std::vector<uint64_t> keys;     // Per tile.
+    std::vector<int32_t>  slots;    // Tile index, or -1 when empty.
+    std::vector<float>    voxels;   // Per tile, PARTICLE_DENSITY_TILE_VOXELS.
+
+    int  Find(uint64_t key) const;
+    int  Insert(uint64_t key);      // Returns the(possibly new, zeroed) tile.
+    void Clear();
+  };
+
+  static void SplatRange(TileTable& table, const float* positions, size_t begin, size_t end,
+                         float voxelSize, int kernel);
+
+  float               voxelSize_;
+  int                 kernel_;
+  uint64_t            numParticles_;
+  TileTable           table_;
+};
+
+#endif  // PARTICLE_DENSITY_H_
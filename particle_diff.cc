@@ -0,0 +1,618 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// particle-diff: compare two particle files, or the particle files of two
+// directories(e.g. two caches of a sequence), channel by channel.
+//
+// Chunks whose raw hashes(ParticleChunkHeader::hash) are equal are skipped
+// without reading their payloads, so identical frames cost a header read.
+// Differing chunks are decoded and compared in parallel(one reader pair
+// per OpenMP thread) with SSE2, giving the max and RMS absolute error of
+// each channel. Values differing by more than --epsilon(default 0), or a
+// NaN against a non-NaN value, make the files differ. NaN against NaN is
+// equal.
+//
+// Exit status: 0 when equal, 1 when different, 2 on error.
+//
+
+// To handle 2GB+ file.
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "particle_format.h"
+#include "particle_reader.h"
+
+enum DiffResult
+{
+  DIFF_EQUAL     = 0,
+  DIFF_DIFFERENT = 1,
+  DIFF_ERROR     = 2
+};
+
+struct DiffStats
+{
+  uint64_t numValues;
+  uint64_t numExceeding;      // |a - b| > epsilon, or NaN.
+  double   maxError;          // NaN excluded.
+  double   sumSquaredError;   // NaN excluded.
+
+  DiffStats() : numValues(0), numExceeding(0), maxError(0.0), sumSquaredError(0.0) {}
+
+  void Merge(const DiffStats& rhs) {
+    numValues       += rhs.numValues;
+    numExceeding    += rhs.numExceeding;
+    maxError         = std::max(maxError, rhs.maxError);
+    sumSquaredError += rhs.sumSquaredError;
+  }
+};
+
+#ifdef __SSE2__
+static inline int
+CountBits4(
+  int mask)
+{
+  return (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+}
+#endif
+
+//
+// Values with equal bits, or both NaN, are equal(difference 0), so that
+// comparing decoded values agrees with skipping chunks of equal hashes.
+// Otherwise a NaN(or Inf - Inf) difference always exceeds epsilon.
+//
+static void
+DiffFloat(
+  DiffStats& stats,           // inout
+  const float* a,             // in
+  const float* b,             // in
+  size_t n,                   // in
+  float epsilon)              // in
+{
+  size_t   i            = 0;
+  double   maxError     = 0.0;
+  double   sum          = 0.0;
+  uint64_t numExceeding = 0;
+
+#ifdef __SSE2__
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 eps     = _mm_set1_ps(epsilon);
+  __m128  vmax  = _mm_setzero_ps();
+  __m128d vsum0 = _mm_setzero_pd();
+  __m128d vsum1 = _mm_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    __m128 va   = _mm_loadu_ps(a + i);
+    __m128 vb   = _mm_loadu_ps(b + i);
+    __m128 same = _mm_or_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_castps_si128(va), _mm_castps_si128(vb))),
+                            _mm_and_ps(_mm_cmpunord_ps(va, va), _mm_cmpunord_ps(vb, vb)));
+    __m128 d    = _mm_andnot_ps(same, _mm_and_ps(_mm_sub_ps(va, vb), absMask));
+    // Not less-equal is also true for NaN.
+    numExceeding += CountBits4(_mm_movemask_ps(_mm_cmpnle_ps(d, eps)));
+    d = _mm_and_ps(d, _mm_cmpord_ps(d, d));
+    vmax = _mm_max_ps(vmax, d);
+
+    // Squares are summed in double, a float sum loses small errors.
+    __m128d lo = _mm_cvtps_pd(d);
+    __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(d, d));
+    vsum0 = _mm_add_pd(vsum0, _mm_mul_pd(lo, lo));
+    vsum1 = _mm_add_pd(vsum1, _mm_mul_pd(hi, hi));
+  }
+
+  float  m[4];
+  double s[2];
+  _mm_storeu_ps(m, vmax);
+  _mm_storeu_pd(s, _mm_add_pd(vsum0, vsum1));
+  maxError = std::max(std::max(m[0], m[1]), std::max(m[2], m[3]));
+  sum      = s[0] + s[1];
+#endif
+
+  for (; i < n; i++) {
+    uint32_t ba, bb;
+    memcpy(&ba, &a[i], 4);
+    memcpy(&bb, &b[i], 4);
+    const bool same = (ba == bb) || ((a[i] != a[i]) && (b[i] != b[i]));
+    float d = same ? 0.0f : fabsf(a[i] - b[i]);
+    if (!(d <= epsilon)) {
+      numExceeding++;
+    }
+    if (d == d) {
+      maxError = std::max(maxError, (double)d);
+      sum     += (double)d * d;
+    }
+  }
+
+  stats.numValues       += n;
+  stats.numExceeding    += numExceeding;
+  stats.maxError         = std::max(stats.maxError, maxError);
+  stats.sumSquaredError += sum;
+}
+
+static void
+DiffInt32(
+  DiffStats& stats,           // inout
+  const int32_t* a,           // in
+  const int32_t* b,           // in
+  size_t n,                   // in
+  double epsilon)             // in
+{
+  size_t   i            = 0;
+  double   maxError     = 0.0;
+  double   sum          = 0.0;
+  uint64_t numExceeding = 0;
+
+#ifdef __SSE2__
+  // Differences are taken in double, so they never overflow.
+  const __m128d absMask = _mm_castsi128_pd(_mm_set_epi32(0x7fffffff, -1, 0x7fffffff, -1));
+  const __m128d eps     = _mm_set1_pd(epsilon);
+  __m128d vmax = _mm_setzero_pd();
+  __m128d vsum = _mm_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    __m128d d0 = _mm_sub_pd(_mm_cvtepi32_pd(va), _mm_cvtepi32_pd(vb));
+    __m128d d1 = _mm_sub_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(va, 0xEE)),
+                            _mm_cvtepi32_pd(_mm_shuffle_epi32(vb, 0xEE)));
+    d0 = _mm_and_pd(d0, absMask);
+    d1 = _mm_and_pd(d1, absMask);
+
+    numExceeding += CountBits4(_mm_movemask_pd(_mm_cmpgt_pd(d0, eps)) |
+                               (_mm_movemask_pd(_mm_cmpgt_pd(d1, eps)) << 2));
+    vmax = _mm_max_pd(vmax, _mm_max_pd(d0, d1));
+    vsum = _mm_add_pd(vsum, _mm_add_pd(_mm_mul_pd(d0, d0), _mm_mul_pd(d1, d1)));
+  }
+
+  double m[2], s[2];
+  _mm_storeu_pd(m, vmax);
+  _mm_storeu_pd(s, vsum);
+  maxError = std::max(m[0], m[1]);
+  sum      = s[0] + s[1];
+#endif
+
+  for (; i < n; i++) {
+    double d = fabs((double)a[i] - (double)b[i]);
+    numExceeding += (d > epsilon) ? 1 : 0;
+    maxError      = std::max(maxError, d);
+    sum          += d * d;
+  }
+
+  stats.numValues       += n;
+  stats.numExceeding    += numExceeding;
+  stats.maxError         = std::max(stats.maxError, maxError);
+  stats.sumSquaredError += sum;
+}
+
+// Scalar. SSE2 has no 64bit integer compare and these are mostly ids.
+static void
+DiffInt64(
+  DiffStats& stats,           // inout
+  const int64_t* a,           // in
+  const int64_t* b,           // in
+  size_t n,                   // in
+  double epsilon)             // in
+{
+  uint64_t numExceeding = 0;
+  double   maxError     = 0.0;
+  double   sum          = 0.0;
+  for (size_t i = 0; i < n; i++) {
+    if (a[i] == b[i]) {
+      continue;
+    }
+    double d = fabs((double)a[i] - (double)b[i]);
+    numExceeding += (d > epsilon) ? 1 : 0;
+    maxError      = std::max(maxError, d);
+    sum          += d * d;
+  }
+
+  stats.numValues       += n;
+  stats.numExceeding    += numExceeding;
+  stats.maxError         = std::max(stats.maxError, maxError);
+  stats.sumSquaredError += sum;
+}
+
+static void
+DiffValues(
+  DiffStats& stats,           // inout
+  const char* a,              // in
+  const char* b,              // in
+  size_t size,                // in  bytes
+  int type,                   // in  ParticleValueType
+  double epsilon)             // in
+{
+  switch (type) {
+  case PARTICLE_TYPE_FLOAT:
+  case PARTICLE_TYPE_FLOAT3:
+    DiffFloat(stats, reinterpret_cast<const float*>(a), reinterpret_cast<const float*>(b),
+              size / sizeof(float), (float)epsilon);
+    break;
+  case PARTICLE_TYPE_INT32:
+  case PARTICLE_TYPE_INT3:
+    DiffInt32(stats, reinterpret_cast<const int32_t*>(a), reinterpret_cast<const int32_t*>(b),
+              size / sizeof(int32_t), epsilon);
+    break;
+  case PARTICLE_TYPE_INT64:
+    DiffInt64(stats, reinterpret_cast<const int64_t*>(a), reinterpret_cast<const int64_t*>(b),
+              size / sizeof(int64_t), epsilon);
+    break;
+  }
+}
+
+// SoA -> AoS. For channels stored planar in one file only.
+static void
+TransposeFromPlanes(
+  std::vector<char>& data,    // inout
+  size_t numElements,         // in
+  int numComponents,          // in
+  int wordSize)               // in
+{
+  std::vector<char> interleaved(data.size());
+  for (int c = 0; c < numComponents; c++) {
+    const char* plane = &data[c * numElements * wordSize];
+    for (size_t i = 0; i < numElements; i++) {
+      memcpy(&interleaved[(i * numComponents + c) * wordSize], plane + i * wordSize, wordSize);
+    }
+  }
+  data.swap(interleaved);
+}
+
+// A channel present in both files.
+struct ChannelPair
+{
+  std::string name;           // "body/channel"
+  int         channel[2];     // File global indices.
+  int         numChunks;
+  bool        sameLayout;     // Chunks are compared pairwise.
+  int         numSkipped;     // Equal by hash.
+  int         numDiffering;   // Chunks with any exceeding value.
+  DiffStats   stats;
+};
+
+// A differing chunk, or the whole channel(chunk -1) when the chunk layouts
+// of the two files differ(another --codec chunk size or --layout).
+struct DiffTask
+{
+  int       pair;
+  int       chunk;
+  DiffStats stats;
+};
+
+static bool
+RunTask(
+  DiffTask& task,
+  const ChannelPair& pair,
+  ParticleReader reader[2],
+  double epsilon)
+{
+  const ParticleChannelHeader& header = reader[0].GetChannelHeader(pair.channel[0]);
+  std::vector<char> data[2];
+
+  if (task.chunk >= 0) {
+    for (int f = 0; f < 2; f++) {
+      if (!reader[f].ReadChunk(data[f], pair.channel[f], task.chunk)) {
+        return false;
+      }
+    }
+  } else {
+    const int wordSize      = GetParticleTypeWordSize(header.type);
+    const int numComponents = GetParticleTypeSize(header.type) / wordSize;
+    for (int f = 0; f < 2; f++) {
+      if (!reader[f].ReadChannel(data[f], pair.channel[f])) {
+        return false;
+      }
+      const uint32_t flags = reader[f].GetChannelHeader(pair.channel[f]).flags;
+      if ((flags & PARTICLE_CHANNEL_FLAG_PLANAR) && (numComponents > 1)) {
+        TransposeFromPlanes(data[f], header.numElements, numComponents, wordSize);
+      }
+    }
+  }
+
+  if (data[0].size() != data[1].size()) {
+    return false;
+  }
+  if (!data[0].empty()) {
+    DiffValues(task.stats, &data[0][0], &data[1][0], data[0].size(), header.type, epsilon);
+  }
+  return true;
+}
+
+static bool
+IsSameChunkLayout(
+  const ParticleReader& a,
+  int channelA,
+  const ParticleReader& b,
+  int channelB)
+{
+  if ((a.GetChannelHeader(channelA).flags != b.GetChannelHeader(channelB).flags) ||
+      (a.GetNumChunks(channelA) != b.GetNumChunks(channelB))) {
+    return false;
+  }
+  for (int i = 0; i < a.GetNumChunks(channelA); i++) {
+    if (a.GetChunkHeader(channelA, i).rawSize != b.GetChunkHeader(channelB, i).rawSize) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int
+DiffFiles(
+  const std::string& fileA,
+  const std::string& fileB,
+  double epsilon,
+  bool verbose)
+{
+  const std::string files[2] = { fileA, fileB };
+  ParticleReader reader[2];
+  for (int f = 0; f < 2; f++) {
+    if (!reader[f].Open(files[f])) {
+      fprintf(stderr, "Failed to open %s.\n", files[f].c_str());
+      return DIFF_ERROR;
+    }
+  }
+
+  int result = DIFF_EQUAL;
+  std::vector<ChannelPair> pairs;
+  std::vector<DiffTask>    tasks;
+
+  //
+  // Match bodies and channels by name, and queue the chunks whose hashes
+  // differ. Only headers are read here.
+  //
+  for (int f = 0; f < 2; f++) {
+    ParticleReader& self  = reader[f];
+    ParticleReader& other = reader[1 - f];
+
+    for (int b = 0; b < self.GetNumBodies(); b++) {
+      const ParticleBodyHeader& body = self.GetBodyHeader(b);
+      const int otherBody = other.FindBody(body.name);
+      if (otherBody < 0) {
+        printf("  %s: only in %s\n", body.name, files[f].c_str());
+        result = DIFF_DIFFERENT;
+        continue;
+      }
+
+      self.SelectBody(b);
+      other.SelectBody(otherBody);
+
+      if ((f == 0) && (body.numParticles != other.GetNumParticles())) {
+        printf("  %s: %llu vs %llu particles\n", body.name,
+          (unsigned long long)body.numParticles, (unsigned long long)other.GetNumParticles());
+        result = DIFF_DIFFERENT;
+      }
+
+      for (uint32_t c = body.firstChannel; c < body.firstChannel + body.numChannels; c++) {
+        const ParticleChannelHeader& header = self.GetChannelHeader(c);
+        const std::string name = std::string(body.name) + "/" + header.name;
+        const int otherChannel = other.FindChannel(header.name);
+        if (otherChannel < 0) {
+          printf("  %s: only in %s\n", name.c_str(), files[f].c_str());
+          result = DIFF_DIFFERENT;
+          continue;
+        }
+        if (f == 1) {
+          continue;   // Pairs are made from the first file.
+        }
+
+        const ParticleChannelHeader& otherHeader = other.GetChannelHeader(otherChannel);
+        if ((header.type != otherHeader.type) || (header.numElements != otherHeader.numElements)) {
+          printf("  %s: type or size differs\n", name.c_str());
+          result = DIFF_DIFFERENT;
+          continue;
+        }
+
+        ChannelPair pair;
+        pair.name         = name;
+        pair.channel[0]   = c;
+        pair.channel[1]   = otherChannel;
+        pair.numChunks    = self.GetNumChunks(c);
+        pair.numSkipped   = 0;
+        pair.numDiffering = 0;
+
+        DiffTask task;
+        task.pair = (int)pairs.size();
+        pair.sameLayout = IsSameChunkLayout(self, c, other, otherChannel);
+        if (pair.sameLayout) {
+          for (int i = 0; i < pair.numChunks; i++) {
+            const ParticleChunkHeader& chunk = self.GetChunkHeader(c, i);
+            if (chunk.hash == other.GetChunkHeader(otherChannel, i).hash) {
+              // Error 0, but counted in the RMS.
+              pair.stats.numValues += chunk.rawSize / GetParticleTypeWordSize(header.type);
+              pair.numSkipped++;
+            } else {
+              task.chunk = i;
+              tasks.push_back(task);
+            }
+          }
+        } else {
+          task.chunk = -1;
+          tasks.push_back(task);
+        }
+        pairs.push_back(pair);
+      }
+    }
+  }
+
+  //
+  // Decode and compare the differing chunks. Readers are not thread safe,
+  // so each thread opens its own pair(headers only).
+  //
+  bool failed = false;
+  if (!tasks.empty()) {
+    #pragma omp parallel
+    {
+      ParticleReader threadReader[2];
+      bool opened = threadReader[0].Open(fileA) && threadReader[1].Open(fileB);
+
+      #pragma omp for schedule(dynamic)
+      for (int t = 0; t < (int)tasks.size(); t++) {
+        if (!opened || !RunTask(tasks[t], pairs[tasks[t].pair], threadReader, epsilon)) {
+          #pragma omp critical
+          failed = true;
+        }
+      }
+    }
+  }
+
+  if (failed) {
+    fprintf(stderr, "Failed to read chunks of %s or %s.\n", fileA.c_str(), fileB.c_str());
+    return DIFF_ERROR;
+  }
+
+  for (size_t t = 0; t < tasks.size(); t++) {
+    ChannelPair& pair = pairs[tasks[t].pair];
+    pair.stats.Merge(tasks[t].stats);
+    if (tasks[t].stats.numExceeding > 0) {
+      pair.numDiffering++;
+    }
+  }
+
+  for (size_t p = 0; p < pairs.size(); p++) {
+    const ChannelPair& pair = pairs[p];
+    const DiffStats&   stats = pair.stats;
+    if (stats.numExceeding > 0) {
+      result = DIFF_DIFFERENT;
+    } else if (!verbose) {
+      continue;
+    }
+
+    double rms = (stats.numValues > 0) ? sqrt(stats.sumSquaredError / stats.numValues) : 0.0;
+    printf("  %s: ", pair.name.c_str());
+    if (pair.sameLayout) {
+      printf("%d of %d chunks differ(%d equal by hash), ", pair.numDiffering, pair.numChunks, pair.numSkipped);
+    } else {
+      printf("chunk layout differs, ");
+    }
+    printf("max %g, rms %g, %llu of %llu values > %g\n", stats.maxError, rms,
+      (unsigned long long)stats.numExceeding, (unsigned long long)stats.numValues, epsilon);
+  }
+
+  return result;
+}
+
+static bool
+IsDirectory(
+  const std::string& path)
+{
+  struct stat st;
+  return (stat(path.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
+}
+
+// Sorted names of "*.dat" in `dir`.
+static bool
+ListParticleFiles(
+  std::vector<std::string>& names,
+  const std::string& dir)
+{
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return false;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(d)) != NULL) {
+    std::string name(entry->d_name);
+    if ((name.size() > 4) && (name.compare(name.size() - 4, 4, ".dat") == 0)) {
+      names.push_back(name);
+    }
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());
+  return true;
+}
+
+static int
+DiffDirectories(
+  const std::string& dirA,
+  const std::string& dirB,
+  double epsilon,
+  bool verbose)
+{
+  std::vector<std::string> names[2];
+  if (!ListParticleFiles(names[0], dirA) || !ListParticleFiles(names[1], dirB)) {
+    fprintf(stderr, "Failed to list %s or %s.\n", dirA.c_str(), dirB.c_str());
+    return DIFF_ERROR;
+  }
+
+  int result = DIFF_EQUAL;
+  int numDifferent = 0;
+  int numFiles     = (int)names[0].size();   // Of both directories.
+  for (size_t i = 0; i < names[1].size(); i++) {
+    if (!std::binary_search(names[0].begin(), names[0].end(), names[1][i])) {
+      printf("Only in %s: %s\n", dirB.c_str(), names[1][i].c_str());
+      result = std::max(result, (int)DIFF_DIFFERENT);
+      numDifferent++;
+      numFiles++;
+    }
+  }
+
+  for (size_t i = 0; i < names[0].size(); i++) {
+    const std::string& name = names[0][i];
+    if (!std::binary_search(names[1].begin(), names[1].end(), name)) {
+      printf("Only in %s: %s\n", dirA.c_str(), name.c_str());
+      result = std::max(result, (int)DIFF_DIFFERENT);
+      numDifferent++;
+      continue;
+    }
+
+    const std::string fileA = dirA + "/" + name;
+    const std::string fileB = dirB + "/" + name;
+    int r = DiffFiles(fileA, fileB, epsilon, verbose);
+    if (r != DIFF_EQUAL) {
+      printf("%s %s %s\n", fileA.c_str(), fileB.c_str(), (r == DIFF_ERROR) ? "failed" : "differ");
+      numDifferent++;
+    }
+    result = std::max(result, r);
+  }
+
+  printf("%d of %d files differ\n", numDifferent, numFiles);
+  return result;
+}
+
+int
+main(
+  int argc,
+  char **argv)
+{
+  std::vector<std::string> paths;
+  double epsilon = 0.0;
+  bool   verbose = false;
+
+  for (int i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "--epsilon") == 0) && (i + 1 < argc)) {
+      epsilon = atof(argv[++i]);
+    } else if ((strcmp(argv[i], "-v") == 0) || (strcmp(argv[i], "--verbose") == 0)) {
+      verbose = true;
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+
+  if (paths.size() != 2) {
+    fprintf(stderr, "Usage: particle-diff [--epsilon E] [-v] a.dat b.dat\n");
+    fprintf(stderr, "       particle-diff [--epsilon E] [-v] dirA dirB\n");
+    return DIFF_ERROR;
+  }
+
+  if (IsDirectory(paths[0]) && IsDirectory(paths[1])) {
+    return DiffDirectories(paths[0], paths[1], epsilon, verbose);
+  }
+
+  int result = DiffFiles(paths[0], paths[1], epsilon, verbose);
+  if (result == DIFF_DIFFERENT) {
+    printf("%s %s differ\n", paths[0].c_str(), paths[1].c_str());
+  }
+  return result;
+}
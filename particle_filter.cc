@@ -0,0 +1,250 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "particle_filter.h"
+
+#include <cfloat>
+#include <cstring>
+#include <cassert>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+ParticleFilter::ParticleFilter()
+  : useBounds(false)
+  , minRadius(-FLT_MAX)
+  , minAge(-FLT_MAX)
+  , keepFraction(1.0f)
+  , seed(0)
+{
+  for (int c = 0; c < 3; c++) {
+    bmin[c] = -FLT_MAX;
+    bmax[c] = FLT_MAX;
+  }
+}
+
+bool
+ParticleFilter::UsesRadius() const
+{
+  return minRadius > -FLT_MAX;
+}
+
+bool
+ParticleFilter::UsesAge() const
+{
+  return minAge > -FLT_MAX;
+}
+
+bool
+ParticleFilter::IsEnabled() const
+{
+  return useBounds || UsesRadius() || UsesAge() || (keepFraction < 1.0f);
+}
+
+bool
+TileIntersectsFilter(
+  const ParticleFilter& filter,
+  const float tmin[3],
+  const float tmax[3])
+{
+  if (!filter.useBounds) {
+    return true;
+  }
+  for (int c = 0; c < 3; c++) {
+    if ((tmax[c] < filter.bmin[c]) || (tmin[c] > filter.bmax[c])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static inline uint32_t
+ThinningHash(
+  uint64_t key,
+  uint32_t seed)
+{
+  // MurmurHash3 finalizer. Sequential keys must not thin in a pattern.
+  uint64_t k = key ^ ((uint64_t)seed * 0x9e3779b97f4a7c15ULL);
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return (uint32_t)(k >> 32);
+}
+
+// Bit i set when particle i(< count) passes.
+static inline uint32_t
+TestScalar(
+  const ParticleFilter& filter,
+  const float* p,
+  const float* radius,
+  const float* age,
+  int count)
+{
+  uint32_t mask = 0;
+  for (int i = 0; i < count; i++) {
+    bool pass = true;
+    if (filter.useBounds) {
+      for (int c = 0; c < 3; c++) {
+        float x = p[3 * i + c];
+        pass = pass && (x >= filter.bmin[c]) && (x <= filter.bmax[c]);
+      }
+    }
+    if (radius) pass = pass && (radius[i] >= filter.minRadius);
+    if (age)    pass = pass && (age[i] >= filter.minAge);
+    mask |= (pass ? 1u : 0u) << i;
+  }
+  return mask;
+}
+
+//
+// Filter particles [begin, end) into `out`, which has room for
+// (end - begin) indices. Returns the number of kept particles.
+//
+static size_t
+FilterRange(
+  uint32_t* out,
+  const ParticleFilter& filter,
+  const float* positions,
+  const float* radius,
+  const float* age,
+  const int64_t* ids,
+  size_t begin,
+  size_t end)
+{
+  const bool     thinning  = filter.keepFraction < 1.0f;
+  const uint64_t threshold = (uint64_t)((double)filter.keepFraction * 4294967296.0);
+
+#ifdef __SSE2__
+  //
+  // 4 particles are 3 vectors of xyz interleaved floats. Lane j of vector k
+  // holds component (4k + j) % 3, so the bounds are rotated the same way
+  // and no deinterleave is needed(same trick as ComputeStats()).
+  //
+  __m128 lo[3], hi[3];
+  lo[0] = _mm_setr_ps(filter.bmin[0], filter.bmin[1], filter.bmin[2], filter.bmin[0]);
+  lo[1] = _mm_setr_ps(filter.bmin[1], filter.bmin[2], filter.bmin[0], filter.bmin[1]);
+  lo[2] = _mm_setr_ps(filter.bmin[2], filter.bmin[0], filter.bmin[1], filter.bmin[2]);
+  hi[0] = _mm_setr_ps(filter.bmax[0], filter.bmax[1], filter.bmax[2], filter.bmax[0]);
+  hi[1] = _mm_setr_ps(filter.bmax[1], filter.bmax[2], filter.bmax[0], filter.bmax[1]);
+  hi[2] = _mm_setr_ps(filter.bmax[2], filter.bmax[0], filter.bmax[1], filter.bmax[2]);
+  const __m128 minRadius = _mm_set1_ps(filter.minRadius);
+  const __m128 minAge    = _mm_set1_ps(filter.minAge);
+#endif
+
+  size_t count = 0;
+  size_t i     = begin;
+
+  while (i < end) {
+    const int group = (end - i >= 4) ? 4 : (int)(end - i);
+    uint32_t mask;
+
+#ifdef __SSE2__
+    if (group == 4) {
+      mask = 0xf;
+      if (filter.useBounds) {
+        const float* p = positions + 3 * i;
+        uint32_t bits = 0;
+        for (int k = 0; k < 3; k++) {
+          __m128 x  = _mm_loadu_ps(p + 4 * k);
+          __m128 in = _mm_and_ps(_mm_cmpge_ps(x, lo[k]), _mm_cmple_ps(x, hi[k]));
+          bits |= (uint32_t)_mm_movemask_ps(in) << (4 * k);
+        }
+        // Particle j passes when all of its 3 bits are set.
+        mask = 0;
+        for (int j = 0; j < 4; j++) {
+          mask |= (((bits >> (3 * j)) & 7) == 7 ? 1u : 0u) << j;
+        }
+      }
+      if (radius) {
+        mask &= (uint32_t)_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(radius + i), minRadius));
+      }
+      if (age) {
+        mask &= (uint32_t)_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(age + i), minAge));
+      }
+    } else
+#endif
+    {
+      mask = TestScalar(filter, positions + 3 * i, radius ? radius + i : NULL,
+                        age ? age + i : NULL, group);
+    }
+
+    if (thinning) {
+      for (int j = 0; j < group; j++) {
+        uint64_t key = ids ? (uint64_t)ids[i + j] : (uint64_t)(i + j);
+        if ((uint64_t)ThinningHash(key, filter.seed) >= threshold) {
+          mask &= ~(1u << j);
+        }
+      }
+    }
+
+    // Branchless compaction: always store, advance only for kept lanes.
+    for (int j = 0; j < group; j++) {
+      out[count] = (uint32_t)(i + j);
+      count += (mask >> j) & 1;
+    }
+
+    i += group;
+  }
+
+  return count;
+}
+
+size_t
+FilterParticles(
+  std::vector<uint32_t>& selected,
+  const ParticleFilter& filter,
+  const float* positions,
+  const float* radius,
+  const float* age,
+  const int64_t* ids,
+  size_t n)
+{
+  assert(n <= 0xffffffffULL);
+
+  if (!filter.UsesRadius()) radius = NULL;
+  if (!filter.UsesAge())    age    = NULL;
+
+  // Each range is filtered in place of its own slots, then ranges are
+  // packed together.
+  const size_t kRangeSize = 64 * 1024;
+  const long long numRanges = (long long)((n + kRangeSize - 1) / kRangeSize);
+
+  selected.resize(n);
+  std::vector<size_t> counts(numRanges);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (long long r = 0; r < numRanges; r++) {
+    size_t begin = r * kRangeSize;
+    size_t end   = (begin + kRangeSize < n) ? (begin + kRangeSize) : n;
+    counts[r] = FilterRange(&selected[begin], filter, positions, radius, age, ids, begin, end);
+  }
+
+  size_t count = 0;
+  for (long long r = 0; r < numRanges; r++) {
+    if (count != (size_t)r * kRangeSize) {
+      memmove(&selected[count], &selected[r * kRangeSize], counts[r] * sizeof(uint32_t));
+    }
+    count += counts[r];
+  }
+  selected.resize(count);
+
+  return count;
+}
+
+void
+CompactElements(
+  char* data,
+  const std::vector<uint32_t>& selected,
+  int elementSize)
+{
+  // selected[i] >= i, so moving forward never overwrites a pending source.
+  for (size_t i = 0; i < selected.size(); i++) {
+    if (selected[i] != i) {
+      memcpy(data + i * elementSize, data + (size_t)selected[i] * elementSize, elementSize);
+    }
+  }
+}
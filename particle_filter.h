@@ -0,0 +1,68 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Export time particle filtering and decimation.
+//
+// Tiles are rejected against the bounding box first(TileIntersectsFilter),
+// then particles of the remaining tiles are tested by FilterParticles().
+// A particle is kept when it is inside the box, its radius/age is not below
+// the threshold and it survives random thinning.
+//
+#ifndef PARTICLE_FILTER_H_
+#define PARTICLE_FILTER_H_
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+struct ParticleFilter
+{
+  bool      useBounds;
+  float     bmin[3];
+  float     bmax[3];
+  float     minRadius;      // -FLT_MAX: no radius test.
+  float     minAge;         // -FLT_MAX: no age test.
+  float     keepFraction;   // Fraction of particles kept by thinning. 1: no thinning.
+  uint32_t  seed;           // Thinning seed.
+
+  ParticleFilter();
+
+  bool IsEnabled() const;
+  bool UsesRadius() const;
+  bool UsesAge() const;
+};
+
+// Returns false when no particle of the tile [tmin, tmax] can pass.
+extern bool
+TileIntersectsFilter(
+  const ParticleFilter& filter, // in
+  const float tmin[3],          // in
+  const float tmax[3]);         // in
+
+//
+// Indices of particles passing `filter`, in ascending order.
+// `radius`, `age` may be NULL when the filter does not use them.
+// Thinning is keyed on `ids` when given, so the same particles are kept
+// in every frame. Otherwise it is keyed on the particle index.
+// Uses SSE when available. Returns the number of kept particles.
+//
+extern size_t
+FilterParticles(
+  std::vector<uint32_t>& selected,  // out
+  const ParticleFilter& filter,     // in
+  const float* positions,           // in  xyz interleaved.
+  const float* radius,              // in
+  const float* age,                 // in
+  const int64_t* ids,               // in
+  size_t n);                        // in
+
+// data[i] = data[selected[i]] in place. `selected` must be ascending.
+extern void
+CompactElements(
+  char* data,                           // inout
+  const std::vector<uint32_t>& selected,// in
+  int elementSize);                     // in
+
+#endif  // PARTICLE_FILTER_H_
@@ -0,0 +1,162 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// On-disk layout of the custom particle format.
+//
+// File layout:
+//
+//   ParticleFileHeader
+//   ParticleBodyHeader    x numBodies
+//   ParticleChannelHeader x numChannels, grouped by body
+//   ParticleChunkHeader   x (sum of numChunks), in channel order
+//   chunk payloads(each starts at a PARTICLE_FILE_ALIGNMENT byte boundary)
+//
+// A file holds one or more bodies. Each body owns a contiguous range of
+// channels, so a body can be read without touching the others.
+//
+// Every chunk carries its own codec id, so a reader never needs to know
+// which codec the writer was configured with.
+//
+// A chunk with PARTICLE_CHUNK_FLAG_PACKED has no payload in the file. Its
+// payload is in the pack file `packName`(in the directory of the file),
+// shared by all frames of a sequence and looked up by the content hash
+// stored in `offset`(see particle_pack.h).
+//
+// Every chunk also records the hash of its raw(decoded) bytes, so two files
+// can be compared chunk by chunk without reading identical payloads.
+//
+// All values are stored in host(little) endian.
+//
+#ifndef PARTICLE_FORMAT_H_
+#define PARTICLE_FORMAT_H_
+
+#include <stdint.h>
+
+#define PARTICLE_FILE_MAGIC         "PTCL"
+#define PARTICLE_FILE_VERSION       (6)
+#define PARTICLE_CHANNEL_NAME_LEN   (64)
+#define PARTICLE_BODY_NAME_LEN      (64)
+#define PARTICLE_MAX_COMPONENTS     (3)
+#define PARTICLE_HISTOGRAM_BINS     (16)
+#define PARTICLE_PACK_NAME_LEN      (64)
+
+// Chunk payloads are aligned so that a raw chunk in an mmap'ed file can be
+// loaded with aligned SIMD(up to AVX-512) loads.
+#define PARTICLE_FILE_ALIGNMENT     (64)
+
+// ParticleBodyHeader::flags
+#define PARTICLE_BODY_FLAG_SORTED_BY_ID  (1 << 0)  // Particles are in ascending "id" order.
+
+// ParticleChannelHeader::flags
+//
+// Planar: components of a vector channel are stored as separate planes
+// (x0 x1 ... y0 y1 ... z0 z1 ...) instead of interleaved(x0 y0 z0 x1 ...).
+// A chunk never crosses a plane boundary, and the raw size of each chunk
+// except the last of a plane is a multiple of PARTICLE_FILE_ALIGNMENT, so
+// raw chunks of a plane are contiguous in the file.
+#define PARTICLE_CHANNEL_FLAG_PLANAR  (1 << 0)
+
+// ParticleChunkHeader::flags
+#define PARTICLE_CHUNK_FLAG_PACKED    (1 << 0)  // Payload is in the pack file.
+
+// Channel names with a special meaning(see particle_index.h).
+#define PARTICLE_CHANNEL_ID         "id"
+#define PARTICLE_CHANNEL_ID_INDEX   "id.index"
+
+enum ParticleValueType
+{
+  PARTICLE_TYPE_FLOAT   = 0,
+  PARTICLE_TYPE_INT32   = 1,
+  PARTICLE_TYPE_INT64   = 2,
+  PARTICLE_TYPE_FLOAT3  = 3,
+  PARTICLE_TYPE_INT3    = 4
+};
+
+struct ParticleFileHeader
+{
+  char     magic[4];        // PARTICLE_FILE_MAGIC
+  uint32_t version;         // PARTICLE_FILE_VERSION
+  uint64_t numParticles;    // Sum over all bodies.
+  uint32_t numChannels;     // Sum over all bodies.
+  uint32_t numBodies;
+  char     packName[PARTICLE_PACK_NAME_LEN];  // Empty when no chunk is packed.
+};
+
+struct ParticleBodyHeader
+{
+  char     name[PARTICLE_BODY_NAME_LEN];
+  uint64_t firstParticle;   // Range of the body in the whole file.
+  uint64_t numParticles;
+  uint32_t firstChannel;    // Range of ParticleChannelHeader of the body.
+  uint32_t numChannels;
+  uint32_t flags;           // PARTICLE_BODY_FLAG_*
+  uint32_t reserved;
+};
+
+//
+// Per component value range, so that readers get bounds and shading ranges
+// without decoding payloads. Doubles hold int64 ids exactly up to 2^53.
+// NaN values are not counted. A component with no values(e.g. y of a
+// chunk holding the x plane of a planar channel, or NaNs only) has
+// min > max and count 0.
+//
+struct ParticleStats
+{
+  double   min[PARTICLE_MAX_COMPONENTS];
+  double   max[PARTICLE_MAX_COMPONENTS];
+  double   mean[PARTICLE_MAX_COMPONENTS];
+  uint64_t count[PARTICLE_MAX_COMPONENTS];
+};
+
+struct ParticleChannelHeader
+{
+  char     name[PARTICLE_CHANNEL_NAME_LEN];
+  uint32_t type;            // ParticleValueType
+  uint32_t numChunks;
+  uint64_t numElements;     // Usually equal to numParticles.
+  uint32_t flags;           // PARTICLE_CHANNEL_FLAG_*
+  uint32_t reserved;
+  ParticleStats stats;
+  // Per component, PARTICLE_HISTOGRAM_BINS equal bins over [stats.min, stats.max].
+  uint32_t histogram[PARTICLE_MAX_COMPONENTS][PARTICLE_HISTOGRAM_BINS];
+};
+
+struct ParticleChunkHeader
+{
+  uint32_t codec;           // ParticleCodec
+  uint32_t rawSize;         // in bytes
+  uint32_t storedSize;      // in bytes
+  uint32_t flags;           // PARTICLE_CHUNK_FLAG_*
+  uint64_t offset;          // Absolute file offset of the payload, or its
+                            // content hash when packed.
+  uint64_t hash;            // HashBytes64() of the raw bytes, seed 0.
+  ParticleStats stats;
+};
+
+// Byte size of one element(e.g. 12 for float3).
+static inline int
+GetParticleTypeSize(
+  int type)
+{
+  switch (type) {
+  case PARTICLE_TYPE_FLOAT:  return 4;
+  case PARTICLE_TYPE_INT32:  return 4;
+  case PARTICLE_TYPE_INT64:  return 8;
+  case PARTICLE_TYPE_FLOAT3: return 12;
+  case PARTICLE_TYPE_INT3:   return 12;
+  default:                   return 0;
+  }
+}
+
+// Byte size of one scalar component(e.g. 4 for float3).
+// Also the element size of a planar channel as seen by the codecs.
+static inline int
+GetParticleTypeWordSize(
+  int type)
+{
+  return (type == PARTICLE_TYPE_INT64) ? 8 : 4;
+}
+
+#endif  // PARTICLE_FORMAT_H_
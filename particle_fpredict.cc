@@ -0,0 +1,303 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "particle_fpredict.h"
+
+#include <cstring>
+#include <stdint.h>
+
+static const int kBlockSize = PARTICLE_FPREDICT_BLOCK_SIZE;
+
+enum
+{
+  PREDICT_PREVIOUS = 0,
+  PREDICT_LINEAR   = 1
+};
+
+// Monotonic: a < b as floats(ignoring NaN) iff Map(a) < Map(b) as integers.
+static inline uint32_t
+MapFloatBits(
+  uint32_t bits)
+{
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+static inline uint32_t
+UnmapFloatBits(
+  uint32_t m)
+{
+  return (m & 0x80000000u) ? (m & 0x7fffffffu) : ~m;
+}
+
+static inline int
+BitWidth(
+  uint32_t v)
+{
+  return v ? 32 - __builtin_clz(v) : 0;
+}
+
+//
+// Prediction of word i from the previous words of the same component.
+// Words before the first element are 0.0f.
+//
+static inline uint32_t
+Predict(
+  const uint32_t* m,
+  int i,
+  int stride,
+  int predictor)
+{
+  const uint32_t zero = 0x80000000u;   // MapFloatBits(0.0f)
+  const uint32_t prev = (i >= stride) ? m[i - stride] : zero;
+  if (predictor == PREDICT_PREVIOUS) {
+    return prev;
+  }
+
+  const uint32_t prev2 = (i >= 2 * stride) ? m[i - 2 * stride] : prev;
+  int64_t p = 2 * (int64_t)prev - (int64_t)prev2;
+  if (p < 0) p = 0;
+  if (p > 0xffffffffLL) p = 0xffffffffLL;
+  return (uint32_t)p;
+}
+
+static inline uint32_t
+Residual(
+  uint32_t value,
+  uint32_t prediction)
+{
+  int32_t r = (int32_t)(value - prediction);
+  return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+class BitWriter
+{
+ public:
+  explicit BitWriter(std::vector<char>& out) : out_(out), acc_(0), n_(0) {}
+
+  // count <= 32
+  void Put(uint32_t bits, int count) {
+    acc_ |= (uint64_t)bits << n_;
+    n_   += count;
+    if (n_ >= 32) {
+      const uint32_t word = (uint32_t)acc_;
+      out_.insert(out_.end(), reinterpret_cast<const char*>(&word),
+                  reinterpret_cast<const char*>(&word) + 4);
+      acc_ >>= 32;
+      n_    -= 32;
+    }
+  }
+
+  void Flush() {
+    while (n_ > 0) {
+      out_.push_back((char)(acc_ & 0xff));
+      acc_ >>= 8;
+      n_    -= 8;
+    }
+    n_ = 0;
+  }
+
+ private:
+  std::vector<char>& out_;
+  uint64_t           acc_;
+  int                n_;
+};
+
+class BitReader
+{
+ public:
+  BitReader(const char* src, const char* end)
+    : p_(reinterpret_cast<const unsigned char*>(src))
+    , end_(reinterpret_cast<const unsigned char*>(end))
+    , acc_(0), n_(0), overrun_(false) {}
+
+  // count <= 32
+  uint32_t Get(int count) {
+    if (n_ < count) {
+      Refill();
+      if (n_ < count) {
+        overrun_ = true;
+        return 0;
+      }
+    }
+    const uint32_t v = (uint32_t)(acc_ & ((count == 32) ? 0xffffffffull : ((1ull << count) - 1)));
+    acc_ >>= count;
+    n_    -= count;
+    return v;
+  }
+
+  // Number of 0 bits before the next 1 bit, which is consumed too.
+  int GetUnary() {
+    int zeros = 0;
+    for (;;) {
+      if (n_ == 0) {
+        Refill();
+        if (n_ == 0) {
+          overrun_ = true;
+          return 0;
+        }
+      }
+      const uint64_t valid = (n_ == 64) ? acc_ : (acc_ & ((1ull << n_) - 1));
+      if (valid) {
+        const int z = __builtin_ctzll(valid);
+        acc_ = (z == 63) ? 0 : (acc_ >> (z + 1));
+        n_  -= z + 1;
+        return zeros + z;
+      }
+      zeros += n_;
+      acc_   = 0;
+      n_     = 0;
+    }
+  }
+
+  bool IsOverrun() const { return overrun_; }
+
+ private:
+  void Refill() {
+    while ((n_ <= 56) && (p_ < end_)) {
+      acc_ |= (uint64_t)*p_++ << n_;
+      n_   += 8;
+    }
+  }
+
+  const unsigned char* p_;
+  const unsigned char* end_;
+  uint64_t             acc_;
+  int                  n_;
+  bool                 overrun_;
+};
+
+bool
+FloatPredictEncode(
+  std::vector<char>& dst,
+  const char* src,
+  int size,
+  int stride,
+  int wordSize)
+{
+  if (wordSize != 4) {
+    return false;
+  }
+  if (stride < 1) stride = 1;
+
+  const int numWords = size / 4;
+  std::vector<uint32_t> m(numWords);
+  if (numWords) memcpy(&m[0], src, numWords * 4);
+  for (int i = 0; i < numWords; i++) {
+    m[i] = MapFloatBits(m[i]);
+  }
+
+  dst.assign(4, 0);   // Stream size, filled below.
+  dst.reserve(size + 64);
+  BitWriter writer(dst);
+
+  std::vector<int> prevWidth(stride, 0);
+  uint32_t residuals[2][kBlockSize];
+
+  for (int begin = 0; begin < numWords; begin += kBlockSize) {
+    const int end = (numWords - begin < kBlockSize) ? numWords : (begin + kBlockSize);
+
+    // The predictor with the narrower residuals in total.
+    int total[2] = { 0, 0 };
+    for (int p = 0; p < 2; p++) {
+      for (int i = begin; i < end; i++) {
+        residuals[p][i - begin] = Residual(m[i], Predict(&m[0], i, stride, p));
+        total[p] += BitWidth(residuals[p][i - begin]);
+      }
+    }
+    const int predictor = (total[PREDICT_LINEAR] < total[PREDICT_PREVIOUS]) ? PREDICT_LINEAR : PREDICT_PREVIOUS;
+    writer.Put(predictor, 1);
+
+    for (int i = begin; i < end; i++) {
+      const uint32_t r = residuals[predictor][i - begin];
+      const int width  = BitWidth(r);
+      int& prev        = prevWidth[i % stride];
+
+      if (width == prev) {
+        writer.Put(1, 1);
+      } else {
+        const int change = (width > prev) ? (width - prev) : (prev - width);
+        writer.Put((width > prev) ? 0 : 2, 2);    // "0", then the sign.
+        writer.Put(1u << (change - 1), change);   // Unary change - 1(<= 31 zeros).
+        prev = width;
+      }
+
+      if (width > 1) {
+        writer.Put(r & ((1u << (width - 1)) - 1), width - 1);
+      }
+    }
+  }
+  writer.Flush();
+
+  const uint32_t streamSize = dst.size() - 4;
+  memcpy(&dst[0], &streamSize, 4);
+
+  dst.insert(dst.end(), src + numWords * 4, src + size);
+  return true;
+}
+
+bool
+FloatPredictDecode(
+  char* dst,
+  int rawSize,
+  const char* src,
+  int storedSize,
+  int stride,
+  int wordSize)
+{
+  if ((wordSize != 4) || (storedSize < 4)) {
+    return false;
+  }
+  if (stride < 1) stride = 1;
+
+  const int numWords = rawSize / 4;
+  const int tail     = rawSize - numWords * 4;
+
+  uint32_t streamSize;
+  memcpy(&streamSize, src, 4);
+  if ((uint64_t)streamSize + 4 + tail != (uint64_t)storedSize) {
+    return false;
+  }
+
+  BitReader reader(src + 4, src + 4 + streamSize);
+  std::vector<int>      prevWidth(stride, 0);
+  std::vector<uint32_t> m(numWords);
+
+  for (int begin = 0; begin < numWords; begin += kBlockSize) {
+    const int end = (numWords - begin < kBlockSize) ? numWords : (begin + kBlockSize);
+    const int predictor = reader.Get(1);
+
+    for (int i = begin; i < end; i++) {
+      int& width = prevWidth[i % stride];
+      if (!reader.Get(1)) {
+        const bool narrower = reader.Get(1) != 0;
+        const int  change   = reader.GetUnary() + 1;
+        width += narrower ? -change : change;
+        if ((width < 0) || (width > 32)) {
+          return false;
+        }
+      }
+
+      uint32_t r = 0;
+      if (width > 0) {
+        r = (width > 1) ? reader.Get(width - 1) : 0;
+        r |= 1u << (width - 1);
+      }
+
+      const int32_t d = (int32_t)((r >> 1) ^ (uint32_t)(-(int32_t)(r & 1)));
+      m[i] = Predict(&m[0], i, stride, predictor) + (uint32_t)d;
+    }
+
+    if (reader.IsOverrun()) {
+      return false;
+    }
+  }
+
+  for (int i = 0; i < numWords; i++) {
+    const uint32_t bits = UnmapFloatBits(m[i]);
+    memcpy(dst + 4 * i, &bits, 4);
+  }
+  memcpy(dst + numWords * 4, src + 4 + streamSize, tail);
+
+  return true;
+}
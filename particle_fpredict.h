@@ -0,0 +1,57 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Lossless predictive codec for float channels(PARTICLE_CODEC_FPREDICT),
+// in the spirit of fpzip.
+//
+// Float bits are mapped to unsigned integers which keep the order of the
+// values. Each word is predicted from the same component of the previous
+// particles, which are neighbors in space since particles are written in
+// TileLayout block order(or sorted). The residual(difference from the
+// prediction, zigzag coded) is stored with its significant bits only:
+//
+//   width   change from the width of the previous residual of the same
+//           component: "1" when equal, otherwise "0", sign, and unary
+//           |change| - 1
+//   bits    width - 1 low bits(the top bit is always set)
+//
+// Every block of PARTICLE_FPREDICT_BLOCK_SIZE words starts with one bit
+// selecting the predictor: the previous value, or the linear extrapolation
+// of the previous two, whichever gives narrower residuals.
+//
+// Chunk:
+//
+//   uint32  size of the bit stream in bytes
+//   bit stream(little endian, LSB first)
+//   trailing bytes of a size which is not a multiple of 4, as is
+//
+// Bit exact for every float including NaN payloads and -0.
+//
+#ifndef PARTICLE_FPREDICT_H_
+#define PARTICLE_FPREDICT_H_
+
+#include <vector>
+
+#define PARTICLE_FPREDICT_BLOCK_SIZE  (256)
+
+// Returns false for a word size other than 4.
+extern bool
+FloatPredictEncode(
+  std::vector<char>& dst,   // out
+  const char* src,          // in
+  int size,                 // in
+  int stride,               // in  Words per element(e.g. 3 for float3).
+  int wordSize);            // in
+
+extern bool
+FloatPredictDecode(
+  char* dst,                // out
+  int rawSize,              // in
+  const char* src,          // in
+  int storedSize,           // in
+  int stride,               // in
+  int wordSize);            // in
+
+#endif  // PARTICLE_FPREDICT_H_
@@ -0,0 +1,184 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+// To handle 2GB+ file.
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "particle_hash.h"
+
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+static const uint64_t kPrime1 = 11400714785074694791ULL;
+static const uint64_t kPrime2 = 14029467366897019727ULL;
+static const uint64_t kPrime3 =  1609587929392839161ULL;
+static const uint64_t kPrime4 =  9650029242287828579ULL;
+static const uint64_t kPrime5 =  2870177450012600261ULL;
+
+static inline uint64_t
+Rotl64(
+  uint64_t x,
+  int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+Read64(
+  const unsigned char* p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(uint64_t));
+  return v;
+}
+
+static inline uint32_t
+Read32(
+  const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(uint32_t));
+  return v;
+}
+
+static inline uint64_t
+Round(
+  uint64_t acc,
+  uint64_t input)
+{
+  acc += input * kPrime2;
+  acc  = Rotl64(acc, 31);
+  acc *= kPrime1;
+  return acc;
+}
+
+static inline uint64_t
+MergeRound(
+  uint64_t acc,
+  uint64_t val)
+{
+  acc ^= Round(0, val);
+  acc  = acc * kPrime1 + kPrime4;
+  return acc;
+}
+
+uint64_t
+HashBytes64(
+  const void* data,
+  size_t size,
+  uint64_t seed)
+{
+  const unsigned char* p   = reinterpret_cast<const unsigned char*>(data);
+  const unsigned char* end = p + size;
+  uint64_t h;
+
+  if (size >= 32) {
+    const unsigned char* limit = end - 32;
+    uint64_t v1 = seed + kPrime1 + kPrime2;
+    uint64_t v2 = seed + kPrime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kPrime1;
+
+    do {
+      v1 = Round(v1, Read64(p)); p += 8;
+      v2 = Round(v2, Read64(p)); p += 8;
+      v3 = Round(v3, Read64(p)); p += 8;
+      v4 = Round(v4, Read64(p)); p += 8;
+    } while (p <= limit);
+
+    h = Rotl64(v1, 1) + Rotl64(v2, 7) + Rotl64(v3, 12) + Rotl64(v4, 18);
+    h = MergeRound(h, v1);
+    h = MergeRound(h, v2);
+    h = MergeRound(h, v3);
+    h = MergeRound(h, v4);
+  } else {
+    h = seed + kPrime5;
+  }
+
+  h += (uint64_t)size;
+
+  while (p + 8 <= end) {
+    h ^= Round(0, Read64(p));
+    h  = Rotl64(h, 27) * kPrime1 + kPrime4;
+    p += 8;
+  }
+
+  if (p + 4 <= end) {
+    h ^= (uint64_t)Read32(p) * kPrime1;
+    h  = Rotl64(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+
+  while (p < end) {
+    h ^= (*p) * kPrime5;
+    h  = Rotl64(h, 11) * kPrime1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+bool
+HashFile64(
+  uint64_t& hash,
+  const std::string& filename)
+{
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    return false;
+  }
+
+  std::vector<char> buf(4 * 1024 * 1024);
+  hash = 0;
+  size_t len;
+  while ((len = fread(&buf[0], 1, buf.size(), fp)) > 0) {
+    hash = HashBytes64(&buf[0], len, hash);
+  }
+
+  bool ok = (ferror(fp) == 0);
+  fclose(fp);
+
+  return ok;
+}
+
+std::string
+HashToString(
+  uint64_t hash)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+  return std::string(buf);
+}
+
+bool
+StringToHash(
+  uint64_t& hash,
+  const std::string& str)
+{
+  if (str.size() != 16) {
+    return false;
+  }
+
+  uint64_t h = 0;
+  for (size_t i = 0; i < str.size(); i++) {
+    char c = str[i];
+    int  d;
+    if ((c >= '0') && (c <= '9'))      d = c - '0';
+    else if ((c >= 'a') && (c <= 'f')) d = c - 'a' + 10;
+    else if ((c >= 'A') && (c <= 'F')) d = c - 'A' + 10;
+    else return false;
+    h = (h << 4) | d;
+  }
+
+  hash = h;
+  return true;
+}
@@ -0,0 +1,41 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Fast non-cryptographic 64bit hash(xxHash64 algorithm).
+//
+#ifndef PARTICLE_HASH_H_
+#define PARTICLE_HASH_H_
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+extern uint64_t
+HashBytes64(
+  const void* data,   // in
+  size_t size,        // in
+  uint64_t seed);     // in
+
+//
+// Hash whole file contents. Reads the file in fixed size blocks and
+// chains the block hashes.
+// Returns false when the file cannot be read.
+//
+extern bool
+HashFile64(
+  uint64_t& hash,               // out
+  const std::string& filename); // in
+
+extern std::string
+HashToString(
+  uint64_t hash);
+
+// Returns false when `str` is not a 16 digit hex string.
+extern bool
+StringToHash(
+  uint64_t& hash,               // out
+  const std::string& str);      // in
+
+#endif  // PARTICLE_HASH_H_
@@ -0,0 +1,200 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "particle_index.h"
+
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static inline uint64_t
+HashId(
+  int64_t id)
+{
+  // MurmurHash3 finalizer. Ids are often sequential, so they need mixing.
+  uint64_t k = (uint64_t)id;
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+void
+RadixSortIds(
+  std::vector<uint32_t>& perm,
+  const int64_t* ids,
+  size_t n)
+{
+  assert(n <= 0xffffffffULL);
+
+  // Flip the sign bit so that negative ids sort first as unsigned.
+  std::vector<uint64_t> keys(n);
+  std::vector<uint64_t> tmpKeys(n);
+  std::vector<uint32_t> tmpPerm(n);
+  perm.resize(n);
+
+  uint64_t orBits  = 0;
+  uint64_t andBits = ~0ULL;
+  for (size_t i = 0; i < n; i++) {
+    keys[i]  = (uint64_t)ids[i] ^ (1ULL << 63);
+    perm[i]  = (uint32_t)i;
+    orBits  |= keys[i];
+    andBits &= keys[i];
+  }
+
+  // Digits which are the same for all keys(e.g. upper bytes of small ids)
+  // need no pass.
+  const uint64_t diffBits = orBits ^ andBits;
+
+#ifdef _OPENMP
+  const int numParts = omp_get_max_threads();
+#else
+  const int numParts = 1;
+#endif
+  std::vector<size_t> counts(numParts * 256);
+
+  for (int shift = 0; shift < 64; shift += 8) {
+    if (((diffBits >> shift) & 0xff) == 0) {
+      continue;
+    }
+
+    std::fill(counts.begin(), counts.end(), 0);
+
+    #pragma omp parallel for schedule(static, 1)
+    for (int part = 0; part < numParts; part++) {
+      size_t begin = (n * part) / numParts;
+      size_t end   = (n * (part + 1)) / numParts;
+      size_t* c    = &counts[part * 256];
+      for (size_t i = begin; i < end; i++) {
+        c[(keys[i] >> shift) & 0xff]++;
+      }
+    }
+
+    // Digit major, part minor prefix sum keeps the sort stable.
+    size_t offset = 0;
+    for (int d = 0; d < 256; d++) {
+      for (int part = 0; part < numParts; part++) {
+        size_t count = counts[part * 256 + d];
+        counts[part * 256 + d] = offset;
+        offset += count;
+      }
+    }
+
+    #pragma omp parallel for schedule(static, 1)
+    for (int part = 0; part < numParts; part++) {
+      size_t begin = (n * part) / numParts;
+      size_t end   = (n * (part + 1)) / numParts;
+      size_t* c    = &counts[part * 256];
+      for (size_t i = begin; i < end; i++) {
+        size_t pos = c[(keys[i] >> shift) & 0xff]++;
+        tmpKeys[pos] = keys[i];
+        tmpPerm[pos] = perm[i];
+      }
+    }
+
+    keys.swap(tmpKeys);
+    perm.swap(tmpPerm);
+  }
+}
+
+void
+PermuteElements(
+  char* dst,
+  const char* src,
+  const std::vector<uint32_t>& perm,
+  int elementSize)
+{
+  const long long n = perm.size();
+
+  #pragma omp parallel for
+  for (long long i = 0; i < n; i++) {
+    memcpy(dst + i * elementSize, src + (size_t)perm[i] * elementSize, elementSize);
+  }
+}
+
+void
+BuildIdHashTable(
+  std::vector<int32_t>& table,
+  const int64_t* ids,
+  size_t n)
+{
+  assert(n < 0x7fffffffULL);
+
+  size_t capacity = 16;
+  while (capacity < 2 * n) {
+    capacity *= 2;
+  }
+  const size_t mask = capacity - 1;
+
+  table.assign(capacity, -1);
+  for (size_t i = 0; i < n; i++) {
+    size_t slot = HashId(ids[i]) & mask;
+    while (table[slot] != -1) {
+      slot = (slot + 1) & mask;
+    }
+    table[slot] = (int32_t)i;
+  }
+}
+
+bool
+ValidateIdHashTable(
+  const int32_t* table,
+  size_t tableSize,
+  size_t numIds)
+{
+  if ((tableSize == 0) || ((tableSize & (tableSize - 1)) != 0)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < tableSize; i++) {
+    if ((table[i] < -1) || ((table[i] >= 0) && ((size_t)table[i] >= numIds))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int64_t
+LookupIdHashTable(
+  const int32_t* table,
+  size_t tableSize,
+  const int64_t* ids,
+  int64_t id)
+{
+  if (tableSize == 0) {
+    return -1;
+  }
+
+  // Bounded, since a table from a broken file may have no empty slot.
+  const size_t mask = tableSize - 1;
+  size_t slot = HashId(id) & mask;
+  for (size_t n = 0; (n < tableSize) && (table[slot] != -1); n++) {
+    if (ids[table[slot]] == id) {
+      return table[slot];
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  return -1;
+}
+
+int64_t
+LookupIdSorted(
+  const int64_t* ids,
+  size_t n,
+  int64_t id)
+{
+  const int64_t* it = std::lower_bound(ids, ids + n, id);
+  if ((it == ids + n) || (*it != id)) {
+    return -1;
+  }
+  return it - ids;
+}
@@ -0,0 +1,77 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Particle id index.
+//
+// Two layouts are supported:
+//
+//  * Id sorted: particles are reordered by id(PARTICLE_BODY_FLAG_SORTED_BY_ID),
+//    and a lookup is a binary search over the "id" channel.
+//  * Hash table: particles keep their block order and an open addressing
+//    table of particle indices is stored as "id.index" channel.
+//    A slot holds the index of a particle, or -1 when empty. The key is
+//    read back from the "id" channel, so the table costs 4 bytes per slot.
+//
+#ifndef PARTICLE_INDEX_H_
+#define PARTICLE_INDEX_H_
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+//
+// Stable parallel LSD radix sort of int64 ids.
+// `perm[i]` is the original index of the i'th smallest id.
+//
+extern void
+RadixSortIds(
+  std::vector<uint32_t>& perm,  // out
+  const int64_t* ids,           // in
+  size_t n);                    // in
+
+// dst[i] = src[perm[i]] for `elementSize` byte elements.
+extern void
+PermuteElements(
+  char* dst,                          // out
+  const char* src,                    // in
+  const std::vector<uint32_t>& perm,  // in
+  int elementSize);                   // in
+
+// Table capacity is a power of two, at least twice the number of ids.
+extern void
+BuildIdHashTable(
+  std::vector<int32_t>& table,  // out
+  const int64_t* ids,           // in
+  size_t n);                    // in
+
+//
+// Checks a table read from a file: the size is a power of two and every
+// slot is -1 or the index of one of `numIds` ids. Returns false otherwise.
+//
+extern bool
+ValidateIdHashTable(
+  const int32_t* table,         // in
+  size_t tableSize,             // in
+  size_t numIds);               // in
+
+//
+// Returns particle index, or -1 when not found. `table` must be valid for
+// `ids`(see ValidateIdHashTable()). At most `tableSize` slots are probed.
+//
+extern int64_t
+LookupIdHashTable(
+  const int32_t* table,         // in
+  size_t tableSize,             // in
+  const int64_t* ids,           // in
+  int64_t id);                  // in
+
+// Returns particle index, or -1 when not found. `ids` must be sorted.
+extern int64_t
+LookupIdSorted(
+  const int64_t* ids,           // in
+  size_t n,                     // in
+  int64_t id);                  // in
+
+#endif  // PARTICLE_INDEX_H_
@@ -0,0 +1,258 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+// To handle 2GB+ file.
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "particle_pack.h"
+#include "particle_format.h"
+#include "particle_hash.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+static uint64_t
+AlignUp(
+  uint64_t offset)
+{
+  return (offset + PARTICLE_FILE_ALIGNMENT - 1) & ~(uint64_t)(PARTICLE_FILE_ALIGNMENT - 1);
+}
+
+static bool
+PReadAll(
+  int fd,
+  void* dst,
+  size_t size,
+  uint64_t offset)
+{
+  char* p = reinterpret_cast<char*>(dst);
+  while (size > 0) {
+    ssize_t n = pread(fd, p, size, (off_t)offset);
+    if (n <= 0) {
+      return false;
+    }
+    p      += n;
+    size   -= n;
+    offset += n;
+  }
+  return true;
+}
+
+static bool
+PWriteAll(
+  int fd,
+  const void* src,
+  size_t size,
+  uint64_t offset)
+{
+  const char* p = reinterpret_cast<const char*>(src);
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, (off_t)offset);
+    if (n <= 0) {
+      return false;
+    }
+    p      += n;
+    size   -= n;
+    offset += n;
+  }
+  return true;
+}
+
+uint64_t
+GetPackKey(
+  const char* data,
+  int size,
+  int elementSize,
+  int wordSize)
+{
+  uint64_t seed = ((uint64_t)elementSize << 32) | (uint32_t)wordSize;
+  return HashBytes64(data, size, seed);
+}
+
+ParticlePack::ParticlePack()
+  : fd_(-1)
+  , scanned_(0)
+{
+}
+
+ParticlePack::~ParticlePack()
+{
+  Close();
+}
+
+bool
+ParticlePack::Open(
+  const std::string& filename,
+  bool writable)
+{
+  Close();
+
+  fd_ = open(filename.c_str(), writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  ParticlePackHeader header;
+  if (writable) {
+    // Only one process writes the header of a new pack.
+    flock(fd_, LOCK_EX);
+    struct stat st;
+    if ((fstat(fd_, &st) == 0) && (st.st_size == 0)) {
+      memset(&header, 0, sizeof(ParticlePackHeader));
+      memcpy(header.magic, PARTICLE_PACK_MAGIC, 4);
+      header.version = PARTICLE_PACK_VERSION;
+      if (!PWriteAll(fd_, &header, sizeof(ParticlePackHeader), 0)) {
+        flock(fd_, LOCK_UN);
+        Close();
+        return false;
+      }
+    }
+    flock(fd_, LOCK_UN);
+  }
+
+  if (!PReadAll(fd_, &header, sizeof(ParticlePackHeader), 0) ||
+      (memcmp(header.magic, PARTICLE_PACK_MAGIC, 4) != 0) ||
+      (header.version != PARTICLE_PACK_VERSION)) {
+    fprintf(stderr, "%s is not a particle pack file(or unsupported version).\n", filename.c_str());
+    Close();
+    return false;
+  }
+
+  scanned_ = sizeof(ParticlePackHeader);
+  Scan();
+
+  return true;
+}
+
+void
+ParticlePack::Close()
+{
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  scanned_ = 0;
+  entries_.clear();
+}
+
+void
+ParticlePack::Scan()
+{
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    return;
+  }
+  const uint64_t fileSize = st.st_size;
+
+  while (scanned_ + sizeof(ParticlePackRecord) <= fileSize) {
+    ParticlePackRecord record;
+    if (!PReadAll(fd_, &record, sizeof(ParticlePackRecord), scanned_) ||
+        (memcmp(record.magic, PARTICLE_PACK_RECORD_MAGIC, 4) != 0)) {
+      break;
+    }
+
+    const uint64_t payload = scanned_ + sizeof(ParticlePackRecord);
+    const uint64_t next    = AlignUp(payload + record.storedSize);
+    if (payload + record.storedSize > fileSize) {
+      break;  // Torn.
+    }
+
+    Entry entry;
+    entry.offset     = payload;
+    entry.codec      = record.codec;
+    entry.rawSize    = record.rawSize;
+    entry.storedSize = record.storedSize;
+    entries_.insert(std::make_pair(record.hash, entry));
+
+    scanned_ = next;
+  }
+}
+
+const ParticlePack::Entry*
+ParticlePack::Find(
+  uint64_t key)
+{
+  if (fd_ < 0) {
+    return NULL;
+  }
+
+  std::map<uint64_t, Entry>::const_iterator it = entries_.find(key);
+  if (it == entries_.end()) {
+    Scan();
+    it = entries_.find(key);
+  }
+  return (it == entries_.end()) ? NULL : &it->second;
+}
+
+const ParticlePack::Entry*
+ParticlePack::Append(
+  uint64_t key,
+  int codec,
+  uint32_t rawSize,
+  const char* payload,
+  uint32_t storedSize)
+{
+  if (fd_ < 0) {
+    return NULL;
+  }
+
+  flock(fd_, LOCK_EX);
+
+  // Another process may have stored it meanwhile.
+  Scan();
+  std::map<uint64_t, Entry>::const_iterator it = entries_.find(key);
+  if (it != entries_.end()) {
+    flock(fd_, LOCK_UN);
+    return &it->second;
+  }
+
+  ParticlePackRecord record;
+  memset(&record, 0, sizeof(ParticlePackRecord));
+  memcpy(record.magic, PARTICLE_PACK_RECORD_MAGIC, 4);
+  record.codec      = codec;
+  record.hash       = key;
+  record.rawSize    = rawSize;
+  record.storedSize = storedSize;
+
+  // Written at the end of the last valid record, over a torn one if any.
+  const uint64_t offset = scanned_;
+  const uint64_t next   = AlignUp(offset + sizeof(ParticlePackRecord) + storedSize);
+  const char padding[PARTICLE_FILE_ALIGNMENT] = {0};
+  const size_t padSize = next - (offset + sizeof(ParticlePackRecord) + storedSize);
+
+  bool ok = PWriteAll(fd_, &record, sizeof(ParticlePackRecord), offset) &&
+            PWriteAll(fd_, payload, storedSize, offset + sizeof(ParticlePackRecord)) &&
+            PWriteAll(fd_, padding, padSize, next - padSize);
+
+  const Entry* result = NULL;
+  if (ok) {
+    Entry entry;
+    entry.offset     = offset + sizeof(ParticlePackRecord);
+    entry.codec      = codec;
+    entry.rawSize    = rawSize;
+    entry.storedSize = storedSize;
+    result   = &entries_.insert(std::make_pair(key, entry)).first->second;
+    scanned_ = next;
+  } else {
+    fprintf(stderr, "Failed to append to the pack file.\n");
+  }
+
+  flock(fd_, LOCK_UN);
+
+  return result;
+}
+
+bool
+ParticlePack::ReadPayload(
+  std::vector<char>& dst,
+  const Entry& entry)
+{
+  dst.resize(entry.storedSize);
+  return (entry.storedSize == 0) || PReadAll(fd_, &dst[0], entry.storedSize, entry.offset);
+}
@@ -0,0 +1,116 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Content addressed chunk store shared by the frames of a sequence.
+//
+// Chunks which are byte identical across frames(emitter ids, constant
+// attributes, static bodies) are stored and compressed once. A frame
+// refers to a chunk by the hash of its raw bytes(see
+// PARTICLE_CHUNK_FLAG_PACKED in particle_format.h).
+//
+// The pack is append only:
+//
+//   ParticlePackHeader
+//   (ParticlePackRecord, payload padded to PARTICLE_FILE_ALIGNMENT) x N
+//
+// Appends hold an exclusive flock(), so several converter processes of one
+// host can share one pack. flock() is not reliable over NFS, so processes
+// on different hosts must not append to the same pack. A record torn by a
+// crash is overwritten by the next append.
+//
+#ifndef PARTICLE_PACK_H_
+#define PARTICLE_PACK_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#define PARTICLE_PACK_MAGIC         "PPAK"
+#define PARTICLE_PACK_RECORD_MAGIC  "PREC"
+#define PARTICLE_PACK_VERSION       (1)
+
+struct ParticlePackHeader
+{
+  char     magic[4];        // PARTICLE_PACK_MAGIC
+  uint32_t version;         // PARTICLE_PACK_VERSION
+  char     reserved[56];    // Keeps records aligned.
+};
+
+struct ParticlePackRecord
+{
+  char     magic[4];        // PARTICLE_PACK_RECORD_MAGIC
+  uint32_t codec;           // ParticleCodec of the payload.
+  uint64_t hash;            // Content hash(see GetPackKey()).
+  uint32_t rawSize;
+  uint32_t storedSize;
+  char     reserved[40];    // Keeps payloads aligned.
+};
+
+//
+// Key of a raw chunk. Element and word size are part of it, since the
+// payload is only decodable with the sizes it was encoded with.
+//
+extern uint64_t
+GetPackKey(
+  const char* data,         // in
+  int size,                 // in
+  int elementSize,          // in
+  int wordSize);            // in
+
+class ParticlePack
+{
+ public:
+  struct Entry {
+    uint64_t offset;        // Of the payload.
+    uint32_t codec;
+    uint32_t rawSize;
+    uint32_t storedSize;
+  };
+
+  ParticlePack();
+  ~ParticlePack();
+
+  // `writable` creates the pack when it does not exist.
+  bool Open(const std::string& filename, bool writable);
+  void Close();
+  bool IsOpen() const { return fd_ >= 0; }
+
+  //
+  // Returns NULL when not found. Records appended by other processes since
+  // the last scan are picked up when the key is not known yet.
+  //
+  const Entry* Find(uint64_t key);
+
+  //
+  // Store a payload unless the key is already there. Returns the entry,
+  // or NULL on I/O failure.
+  //
+  const Entry* Append(
+    uint64_t key,           // in
+    int codec,              // in
+    uint32_t rawSize,       // in
+    const char* payload,    // in
+    uint32_t storedSize);   // in
+
+  bool ReadPayload(
+    std::vector<char>& dst, // out
+    const Entry& entry);    // in
+
+  size_t GetNumEntries() const { return entries_.size(); }
+
+ private:
+  ParticlePack(const ParticlePack&);
+  ParticlePack& operator=(const ParticlePack&);
+
+  // Index records in [scanned_, EOF). Stops at a torn record.
+  void Scan();
+
+  int                          fd_;
+  uint64_t                     scanned_;  // End of the last valid record.
+  std::map<uint64_t, Entry>    entries_;
+};
+
+#endif  // PARTICLE_PACK_H_
@@ -0,0 +1,336 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "particle_prefetcher.h"
+#include "particle_reader.h"
+
+#include <cstdio>
+#include <cassert>
+
+const ParticleFrame::Channel*
+ParticleFrame::FindChannel(
+  const std::string& bodyName,
+  const std::string& name) const
+{
+  for (size_t i = 0; i < channels.size(); i++) {
+    if ((name == channels[i].header.name) &&
+        (bodyName == bodies[channels[i].body].name)) {
+      return &channels[i];
+    }
+  }
+  return NULL;
+}
+
+bool
+LoadParticleFrame(
+  ParticleFrame& frame,
+  const std::string& filename,
+  const volatile bool* canceled)
+{
+  ParticleReader reader;
+  if (!reader.Open(filename)) {
+    return false;
+  }
+
+  frame.bodies.clear();
+  frame.channels.clear();
+
+  for (int b = 0; b < reader.GetNumBodies(); b++) {
+    const ParticleBodyHeader& body = reader.GetBodyHeader(b);
+    frame.bodies.push_back(body);
+
+    for (uint32_t c = body.firstChannel; c < body.firstChannel + body.numChannels; c++) {
+      if (canceled && *canceled) {
+        return false;
+      }
+
+      frame.channels.push_back(ParticleFrame::Channel());
+      ParticleFrame::Channel& channel = frame.channels.back();
+      channel.body   = b;
+      channel.header = reader.GetChannelHeader(c);
+      if (!reader.ReadChannel(channel.data, c)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+ParticlePrefetcher::ParticlePrefetcher(
+  const std::string& pattern,
+  int numThreads,
+  int readAhead,
+  int cacheSize)
+  : pattern_(pattern)
+  , readAhead_(readAhead)
+  , cacheSize_(cacheSize)
+  , stop_(false)
+  , useCounter_(0)
+  , position_(0)
+  , direction_(1)
+{
+  assert(numThreads > 0);
+
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&queueCond_, NULL);
+  pthread_cond_init(&readyCond_, NULL);
+
+  threads_.resize(numThreads);
+  for (int i = 0; i < numThreads; i++) {
+    pthread_create(&threads_[i], NULL, WorkerEntry, this);
+  }
+}
+
+ParticlePrefetcher::~ParticlePrefetcher()
+{
+  pthread_mutex_lock(&mutex_);
+  stop_ = true;
+  for (std::map<int, Entry*>::iterator it = entries_.begin(); it != entries_.end(); ++it) {
+    it->second->canceled = true;
+  }
+  pthread_cond_broadcast(&queueCond_);
+  pthread_mutex_unlock(&mutex_);
+
+  for (size_t i = 0; i < threads_.size(); i++) {
+    pthread_join(threads_[i], NULL);
+  }
+
+  for (std::map<int, Entry*>::iterator it = entries_.begin(); it != entries_.end(); ++it) {
+    delete it->second;
+  }
+
+  pthread_cond_destroy(&readyCond_);
+  pthread_cond_destroy(&queueCond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+std::string
+ParticlePrefetcher::GetFilename(
+  int frame) const
+{
+  char buf[4096];
+  snprintf(buf, sizeof(buf), pattern_.c_str(), frame);
+  return std::string(buf);
+}
+
+bool
+ParticlePrefetcher::InWindow(
+  int frame) const
+{
+  int distance = (frame - position_) * direction_;
+  return (distance >= 0) && (distance <= readAhead_);
+}
+
+void
+ParticlePrefetcher::SetPosition(
+  int frame,
+  int direction)
+{
+  pthread_mutex_lock(&mutex_);
+
+  position_  = frame;
+  direction_ = (direction < 0) ? -1 : 1;
+
+  //
+  // Drop queued frames nobody waits for, and cancel in-flight frames
+  // outside the new window. Frames waited for by Acquire() are kept.
+  //
+  std::deque<int> waited;
+  for (std::map<int, Entry*>::iterator it = entries_.begin(); it != entries_.end(); ) {
+    Entry* entry = it->second;
+    if ((entry->state == STATE_QUEUED) && (entry->refCount == 0)) {
+      delete entry;
+      entries_.erase(it++);
+      continue;
+    }
+    if (entry->state == STATE_QUEUED) {
+      waited.push_back(it->first);
+    } else if ((entry->state == STATE_LOADING) && (entry->refCount == 0) && !InWindow(it->first)) {
+      entry->canceled = true;
+    }
+    ++it;
+  }
+  queue_.swap(waited);
+
+  for (int i = 0; i <= readAhead_; i++) {
+    int f = position_ + direction_ * i;
+    if (entries_.find(f) == entries_.end()) {
+      Entry* entry    = new Entry();
+      entry->state    = STATE_QUEUED;
+      entry->refCount = 0;
+      entry->lastUse  = 0;
+      entry->canceled = false;
+      entries_[f] = entry;
+      queue_.push_back(f);
+    }
+  }
+
+  pthread_cond_broadcast(&queueCond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+const ParticleFrame*
+ParticlePrefetcher::Acquire(
+  int frame)
+{
+  pthread_mutex_lock(&mutex_);
+
+  Entry* entry;
+  std::map<int, Entry*>::iterator it = entries_.find(frame);
+  if (it == entries_.end()) {
+    // Not prefetched. Load it before anything else.
+    entry           = new Entry();
+    entry->state    = STATE_QUEUED;
+    entry->refCount = 0;
+    entry->lastUse  = 0;
+    entry->canceled = false;
+    entries_[frame] = entry;
+    queue_.push_front(frame);
+    pthread_cond_signal(&queueCond_);
+  } else {
+    entry = it->second;
+  }
+
+  entry->refCount++;  // Also protects it from cancellation while waiting.
+  while ((entry->state == STATE_QUEUED) || (entry->state == STATE_LOADING)) {
+    pthread_cond_wait(&readyCond_, &mutex_);
+  }
+  entry->lastUse = ++useCounter_;
+
+  const ParticleFrame* result = &entry->data;
+  if (entry->state == STATE_FAILED) {
+    // Not cached, so that the next request tries again(e.g. a sequence
+    // still being written).
+    if (--entry->refCount == 0) {
+      entries_.erase(frame);
+      delete entry;
+    }
+    result = NULL;
+  }
+
+  pthread_mutex_unlock(&mutex_);
+
+  return result;
+}
+
+void
+ParticlePrefetcher::Release(
+  const ParticleFrame* frame)
+{
+  if (!frame) {
+    return;
+  }
+
+  pthread_mutex_lock(&mutex_);
+
+  std::map<int, Entry*>::iterator it = entries_.find(frame->frame);
+  assert(it != entries_.end());
+  assert(it->second->refCount > 0);
+  it->second->refCount--;
+  EvictLocked();
+
+  pthread_mutex_unlock(&mutex_);
+}
+
+void
+ParticlePrefetcher::EvictLocked()
+{
+  for (;;) {
+    int numLoaded = 0;
+    std::map<int, Entry*>::iterator victim = entries_.end();
+    for (std::map<int, Entry*>::iterator it = entries_.begin(); it != entries_.end(); ++it) {
+      const Entry* entry = it->second;
+      if ((entry->state != STATE_READY) && (entry->state != STATE_FAILED)) {
+        continue;
+      }
+      numLoaded++;
+      if (entry->refCount > 0) {
+        continue;
+      }
+
+      // Frames outside the read-ahead window go first, then least recently used.
+      if (victim == entries_.end()) {
+        victim = it;
+      } else {
+        bool inWindow       = InWindow(it->first);
+        bool victimInWindow = InWindow(victim->first);
+        if ((inWindow == victimInWindow) ? (entry->lastUse < victim->second->lastUse)
+                                         : victimInWindow) {
+          victim = it;
+        }
+      }
+    }
+
+    if ((numLoaded <= cacheSize_) || (victim == entries_.end())) {
+      break;
+    }
+
+    delete victim->second;
+    entries_.erase(victim);
+  }
+}
+
+void*
+ParticlePrefetcher::WorkerEntry(
+  void* arg)
+{
+  reinterpret_cast<ParticlePrefetcher*>(arg)->WorkerLoop();
+  return NULL;
+}
+
+void
+ParticlePrefetcher::WorkerLoop()
+{
+  pthread_mutex_lock(&mutex_);
+
+  while (!stop_) {
+    if (queue_.empty()) {
+      pthread_cond_wait(&queueCond_, &mutex_);
+      continue;
+    }
+
+    int frame = queue_.front();
+    queue_.pop_front();
+
+    std::map<int, Entry*>::iterator it = entries_.find(frame);
+    if ((it == entries_.end()) || (it->second->state != STATE_QUEUED)) {
+      continue;
+    }
+
+    Entry* entry = it->second;
+    entry->state = STATE_LOADING;
+    std::string filename = GetFilename(frame);
+
+    pthread_mutex_unlock(&mutex_);
+
+    ParticleFrame data;
+    bool ok = LoadParticleFrame(data, filename, &entry->canceled);
+
+    pthread_mutex_lock(&mutex_);
+
+    if ((entry->canceled || !ok) && (entry->refCount == 0)) {
+      // Canceled, or failed with nobody waiting. A failed frame is loaded
+      // again when requested next.
+      entries_.erase(frame);
+      delete entry;
+    } else if (entry->canceled && !stop_) {
+      // Canceled, but someone started waiting meanwhile. Load again.
+      entry->canceled = false;
+      entry->state    = STATE_QUEUED;
+      queue_.push_front(frame);
+    } else {
+      entry->data.frame = frame;
+      entry->data.bodies.swap(data.bodies);
+      entry->data.channels.swap(data.channels);
+      entry->state   = ok ? STATE_READY : STATE_FAILED;
+      entry->lastUse = ++useCounter_;
+    }
+
+    pthread_cond_broadcast(&readyCond_);
+    EvictLocked();
+  }
+
+  pthread_mutex_unlock(&mutex_);
+}
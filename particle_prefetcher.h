@@ -0,0 +1,120 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Read-ahead prefetcher for playback of a particle file sequence.
+//
+// Frames ahead of the playback position(in the playback direction) are
+// loaded and decoded by a pool of background threads into a bounded LRU
+// cache. Moving the position(scrubbing) drops queued frames and cancels
+// in-flight frames which fell out of the read-ahead window.
+//
+#ifndef PARTICLE_PREFETCHER_H_
+#define PARTICLE_PREFETCHER_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "particle_format.h"
+
+// All channels of all bodies of one frame, decoded.
+struct ParticleFrame
+{
+  struct Channel {
+    int                   body;     // Index into `bodies`.
+    ParticleChannelHeader header;
+    std::vector<char>     data;     // Stored layout(see ParticleReader::ReadChannel).
+  };
+
+  int                             frame;
+  std::vector<ParticleBodyHeader> bodies;
+  std::vector<Channel>            channels;
+
+  // Returns NULL when not found.
+  const Channel* FindChannel(const std::string& bodyName, const std::string& name) const;
+};
+
+// Loads and decodes every channel of `filename`. Returns false on failure.
+extern bool
+LoadParticleFrame(
+  ParticleFrame& frame,                 // out
+  const std::string& filename,          // in
+  const volatile bool* canceled = NULL); // in  Checked between channels.
+
+class ParticlePrefetcher
+{
+ public:
+  //
+  // `pattern` is a printf style filename with one integer conversion,
+  // e.g. "out/fluid.%04d.particles.dat".
+  // `cacheSize` frames are kept at most(plus frames currently acquired).
+  //
+  ParticlePrefetcher(
+    const std::string& pattern,
+    int numThreads,
+    int readAhead,
+    int cacheSize);
+  ~ParticlePrefetcher();
+
+  //
+  // Move the playback position. `direction` is +1(forward) or -1(backward).
+  // Queued frames outside the new window are dropped and in-flight ones
+  // are canceled.
+  //
+  void SetPosition(int frame, int direction);
+
+  //
+  // Blocks until `frame` is decoded. Returns NULL when the frame could not
+  // be loaded. Failed frames are not cached: the next Acquire() or
+  // SetPosition() covering the frame loads it again. A loaded frame stays
+  // valid(never evicted) until Release().
+  //
+  const ParticleFrame* Acquire(int frame);
+  void Release(const ParticleFrame* frame);
+
+ private:
+  enum State {
+    STATE_QUEUED,
+    STATE_LOADING,
+    STATE_READY,
+    STATE_FAILED
+  };
+
+  struct Entry {
+    State         state;
+    ParticleFrame data;
+    int           refCount;
+    uint64_t      lastUse;
+    volatile bool canceled;
+  };
+
+  static void* WorkerEntry(void* arg);
+  void WorkerLoop();
+
+  std::string GetFilename(int frame) const;
+  bool InWindow(int frame) const;
+  void EvictLocked();
+
+  std::string                 pattern_;
+  int                         readAhead_;
+  int                         cacheSize_;
+
+  pthread_mutex_t             mutex_;
+  pthread_cond_t              queueCond_;   // Signaled when the queue grows or on stop.
+  pthread_cond_t              readyCond_;   // Signaled when a frame finished loading.
+  std::vector<pthread_t>      threads_;
+  bool                        stop_;
+
+  std::deque<int>             queue_;
+  std::map<int, Entry*>       entries_;
+  uint64_t                    useCounter_;
+  int                         position_;
+  int                         direction_;
+};
+
+#endif  // PARTICLE_PREFETCHER_H_
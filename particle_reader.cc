@@ -0,0 +1,336 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+// To handle 2GB+ file.
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "particle_reader.h"
+#include "particle_codec.h"
+#include "particle_index.h"
+
+#include <cstring>
+#include <sys/types.h>
+
+ParticleReader::ParticleReader()
+  : fp_(NULL)
+  , currentBody_(0)
+  , idIndexLoaded_(false)
+{
+  memset(&header_, 0, sizeof(ParticleFileHeader));
+}
+
+ParticleReader::~ParticleReader()
+{
+  Close();
+}
+
+bool
+ParticleReader::Open(
+  const std::string& filename)
+{
+  Close();
+
+  fp_ = fopen(filename.c_str(), "rb");
+  if (!fp_) {
+    return false;
+  }
+
+  if ((fread(&header_, sizeof(ParticleFileHeader), 1, fp_) != 1) ||
+      (memcmp(header_.magic, PARTICLE_FILE_MAGIC, 4) != 0) ||
+      (header_.version != PARTICLE_FILE_VERSION)) {
+    fprintf(stderr, "%s is not a particle file(or unsupported version).\n", filename.c_str());
+    Close();
+    return false;
+  }
+
+  bodies_.resize(header_.numBodies);
+  if (bodies_.empty() ||
+      (fread(&bodies_[0], sizeof(ParticleBodyHeader), bodies_.size(), fp_) != bodies_.size())) {
+    Close();
+    return false;
+  }
+
+  channels_.resize(header_.numChannels);
+  if (!channels_.empty() &&
+      (fread(&channels_[0], sizeof(ParticleChannelHeader), channels_.size(), fp_) != channels_.size())) {
+    Close();
+    return false;
+  }
+
+  size_t numChunks = 0;
+  firstChunk_.resize(channels_.size());
+  for (size_t c = 0; c < channels_.size(); c++) {
+    channels_[c].name[PARTICLE_CHANNEL_NAME_LEN - 1] = '\0';
+    firstChunk_[c] = numChunks;
+    numChunks += channels_[c].numChunks;
+  }
+
+  chunks_.resize(numChunks);
+  if (!chunks_.empty() &&
+      (fread(&chunks_[0], sizeof(ParticleChunkHeader), chunks_.size(), fp_) != chunks_.size())) {
+    Close();
+    return false;
+  }
+
+  header_.packName[PARTICLE_PACK_NAME_LEN - 1] = '\0';
+  if (header_.packName[0] != '\0') {
+    // Relative to the directory of the file.
+    size_t slash = filename.find_last_of('/');
+    packFilename_ = (slash == std::string::npos) ? std::string() : filename.substr(0, slash + 1);
+    packFilename_ += header_.packName;
+  }
+
+  for (size_t b = 0; b < bodies_.size(); b++) {
+    bodies_[b].name[PARTICLE_BODY_NAME_LEN - 1] = '\0';
+    if ((uint64_t)bodies_[b].firstChannel + bodies_[b].numChannels > channels_.size()) {
+      Close();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int
+ParticleReader::FindBody(
+  const std::string& name) const
+{
+  for (size_t b = 0; b < bodies_.size(); b++) {
+    if (name == bodies_[b].name) {
+      return (int)b;
+    }
+  }
+  return -1;
+}
+
+bool
+ParticleReader::SelectBody(
+  int body)
+{
+  if ((body < 0) || (body >= (int)bodies_.size())) {
+    return false;
+  }
+
+  if (body != currentBody_) {
+    currentBody_   = body;
+    idIndexLoaded_ = false;
+    ids_.clear();
+    idTable_.clear();
+  }
+
+  return true;
+}
+
+void
+ParticleReader::Close()
+{
+  if (fp_) {
+    fclose(fp_);
+    fp_ = NULL;
+  }
+
+  memset(&header_, 0, sizeof(ParticleFileHeader));
+  bodies_.clear();
+  currentBody_ = 0;
+  channels_.clear();
+  chunks_.clear();
+  firstChunk_.clear();
+  packFilename_.clear();
+  pack_.Close();
+
+  idIndexLoaded_ = false;
+  ids_.clear();
+  idTable_.clear();
+}
+
+int
+ParticleReader::FindChannel(
+  const std::string& name) const
+{
+  if (bodies_.empty()) {
+    return -1;
+  }
+
+  const ParticleBodyHeader& body = bodies_[currentBody_];
+  for (uint32_t c = body.firstChannel; c < body.firstChannel + body.numChannels; c++) {
+    if (name == channels_[c].name) {
+      return (int)c;
+    }
+  }
+  return -1;
+}
+
+bool
+ParticleReader::GetBounds(
+  double bmin[3],
+  double bmax[3],
+  const std::string& name) const
+{
+  int channel = FindChannel(name);
+  if (channel < 0) {
+    return false;
+  }
+
+  const ParticleStats& stats = channels_[channel].stats;
+  for (int c = 0; c < 3; c++) {
+    if (stats.count[c] == 0) {
+      return false;
+    }
+    bmin[c] = stats.min[c];
+    bmax[c] = stats.max[c];
+  }
+
+  return true;
+}
+
+bool
+ParticleReader::ReadChannel(
+  std::vector<char>& data,
+  int channel)
+{
+  if (!fp_ || (channel < 0) || (channel >= (int)channels_.size())) {
+    return false;
+  }
+
+  const ParticleChannelHeader& header = channels_[channel];
+  data.resize(header.numElements * GetParticleTypeSize(header.type));
+
+  std::vector<char> stored;
+  size_t offset = 0;
+  for (uint32_t i = 0; i < header.numChunks; i++) {
+    const ParticleChunkHeader& chunk = chunks_[firstChunk_[channel] + i];
+    if ((offset + chunk.rawSize > data.size()) ||
+        !DecodeChunkOf(data.empty() ? NULL : &data[offset], stored, header, chunk)) {
+      return false;
+    }
+    offset += chunk.rawSize;
+  }
+
+  return (offset == data.size());
+}
+
+bool
+ParticleReader::ReadChunk(
+  std::vector<char>& data,
+  int channel,
+  int i)
+{
+  if (!fp_ || (channel < 0) || (channel >= (int)channels_.size()) ||
+      (i < 0) || (i >= (int)channels_[channel].numChunks)) {
+    return false;
+  }
+
+  const ParticleChunkHeader& chunk = chunks_[firstChunk_[channel] + i];
+  data.resize(chunk.rawSize);
+
+  std::vector<char> stored;
+  return DecodeChunkOf(data.empty() ? NULL : &data[0], stored, channels_[channel], chunk);
+}
+
+bool
+ParticleReader::DecodeChunkOf(
+  char* dst,
+  std::vector<char>& stored,
+  const ParticleChannelHeader& header,
+  const ParticleChunkHeader& chunk)
+{
+  const int wordSize    = GetParticleTypeWordSize(header.type);
+  const int elementSize = (header.flags & PARTICLE_CHANNEL_FLAG_PLANAR)
+                        ? wordSize : GetParticleTypeSize(header.type);
+
+  if (chunk.flags & PARTICLE_CHUNK_FLAG_PACKED) {
+    if (!pack_.IsOpen() && (packFilename_.empty() || !pack_.Open(packFilename_, false))) {
+      fprintf(stderr, "Failed to open pack file %s.\n", packFilename_.c_str());
+      return false;
+    }
+    const ParticlePack::Entry* entry = pack_.Find(chunk.offset);
+    if (!entry || (entry->storedSize != chunk.storedSize) || !pack_.ReadPayload(stored, *entry)) {
+      return false;
+    }
+  } else {
+    stored.resize(chunk.storedSize);
+    if ((fseeko(fp_, (off_t)chunk.offset, SEEK_SET) != 0) ||
+        (chunk.storedSize && (fread(&stored[0], 1, chunk.storedSize, fp_) != chunk.storedSize))) {
+      return false;
+    }
+  }
+
+  return (chunk.rawSize == 0) ||
+         DecodeChunk(dst, chunk.rawSize, chunk.codec, stored.empty() ? NULL : &stored[0],
+                     chunk.storedSize, elementSize, wordSize);
+}
+
+bool
+ParticleReader::LoadIdIndex()
+{
+  if (idIndexLoaded_) {
+    return true;
+  }
+
+  int idChannel = FindChannel(PARTICLE_CHANNEL_ID);
+  if ((idChannel < 0) || (channels_[idChannel].type != PARTICLE_TYPE_INT64)) {
+    return false;
+  }
+
+  std::vector<char> data;
+  if (!ReadChannel(data, idChannel)) {
+    return false;
+  }
+  ids_.resize(channels_[idChannel].numElements);
+  if (!ids_.empty()) {
+    memcpy(&ids_[0], &data[0], data.size());
+  }
+
+  if (!(GetFlags() & PARTICLE_BODY_FLAG_SORTED_BY_ID)) {
+    int indexChannel = FindChannel(PARTICLE_CHANNEL_ID_INDEX);
+    if ((indexChannel >= 0) && (channels_[indexChannel].type == PARTICLE_TYPE_INT32)) {
+      if (!ReadChannel(data, indexChannel)) {
+        return false;
+      }
+      idTable_.resize(channels_[indexChannel].numElements);
+      if (!idTable_.empty()) {
+        memcpy(&idTable_[0], &data[0], data.size());
+      }
+
+      // Slots index `ids_`, so a broken table would read out of bounds.
+      if (!ValidateIdHashTable(idTable_.empty() ? NULL : &idTable_[0], idTable_.size(), ids_.size())) {
+        fprintf(stderr, "Broken %s channel. Rebuilding the id index.\n", PARTICLE_CHANNEL_ID_INDEX);
+        BuildIdHashTable(idTable_, ids_.empty() ? NULL : &ids_[0], ids_.size());
+      }
+    } else {
+      // Written without an index(or not as int32). Build it here once.
+      BuildIdHashTable(idTable_, ids_.empty() ? NULL : &ids_[0], ids_.size());
+    }
+  }
+
+  idIndexLoaded_ = true;
+  return true;
+}
+
+bool
+ParticleReader::LookupIds(
+  int64_t* indices,
+  const int64_t* ids,
+  size_t n)
+{
+  if (!LoadIdIndex()) {
+    return false;
+  }
+
+  const int64_t* fileIds = ids_.empty() ? NULL : &ids_[0];
+
+  if (GetFlags() & PARTICLE_BODY_FLAG_SORTED_BY_ID) {
+    for (size_t i = 0; i < n; i++) {
+      indices[i] = LookupIdSorted(fileIds, ids_.size(), ids[i]);
+    }
+  } else {
+    const int32_t* table = idTable_.empty() ? NULL : &idTable_[0];
+    for (size_t i = 0; i < n; i++) {
+      indices[i] = LookupIdHashTable(table, idTable_.size(), fileIds, ids[i]);
+    }
+  }
+
+  return true;
+}
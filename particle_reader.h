@@ -0,0 +1,123 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Reader for the custom particle format(see particle_format.h).
+//
+// Channel lookup, GetNumParticles() and LookupIds() work on the selected
+// body(the first one after Open()). Channel indices are file global.
+//
+#ifndef PARTICLE_READER_H_
+#define PARTICLE_READER_H_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "particle_format.h"
+#include "particle_pack.h"
+
+class ParticleReader
+{
+ public:
+  ParticleReader();
+  ~ParticleReader();
+
+  // Reads headers only. Returns false when the file is not a particle file.
+  bool Open(const std::string& filename);
+  void Close();
+
+  int GetNumBodies() const { return (int)bodies_.size(); }
+  const ParticleBodyHeader& GetBodyHeader(int body) const {
+    return bodies_[body];
+  }
+
+  // Returns -1 when not found.
+  int FindBody(const std::string& name) const;
+
+  // Only the headers of the body are looked at. Returns false when out of range.
+  bool SelectBody(int body);
+  int  GetSelectedBody() const { return currentBody_; }
+
+  // Of the selected body.
+  uint64_t GetNumParticles() const { return bodies_[currentBody_].numParticles; }
+  uint32_t GetFlags() const { return bodies_[currentBody_].flags; }
+
+  int GetNumChannels() const { return (int)channels_.size(); }
+
+  const ParticleChannelHeader& GetChannelHeader(int channel) const {
+    return channels_[channel];
+  }
+
+  // Chunk headers of `channel`, e.g. to access raw(aligned) chunks of an
+  // mmap'ed file directly.
+  int GetNumChunks(int channel) const { return channels_[channel].numChunks; }
+  const ParticleChunkHeader& GetChunkHeader(int channel, int i) const {
+    return chunks_[firstChunk_[channel] + i];
+  }
+
+  // Searches channels of the selected body. Returns -1 when not found.
+  int FindChannel(const std::string& name) const;
+
+  //
+  // Bounding box of a vector channel(e.g. "position") of the selected body,
+  // from the stats in the header. No payload is read.
+  // Returns false when the channel does not exist or is empty.
+  //
+  bool GetBounds(
+    double bmin[3],                 // out
+    double bmax[3],                 // out
+    const std::string& name) const; // in
+
+  // Read and decode all chunks of `channel`. Data is returned in the stored
+  // layout, i.e. as planes when the channel is PARTICLE_CHANNEL_FLAG_PLANAR.
+  // Packed chunks are read from the pack file, opened on first use.
+  bool ReadChannel(
+    std::vector<char>& data,    // out
+    int channel);               // in
+
+  // Read and decode chunk `i` of `channel` only(rawSize bytes).
+  bool ReadChunk(
+    std::vector<char>& data,    // out
+    int channel,                // in
+    int i);                     // in
+
+  //
+  // Look up particle indices of `ids`. indices[i] is -1 when ids[i] is not
+  // found. The id index is loaded on the first call and kept, so looking
+  // up many ids across calls costs O(1) each.
+  // Returns false when the file has no "id" channel.
+  //
+  bool LookupIds(
+    int64_t* indices,           // out
+    const int64_t* ids,         // in
+    size_t n);                  // in
+
+ private:
+  bool LoadIdIndex();
+
+  bool DecodeChunkOf(
+    char* dst,                            // out
+    std::vector<char>& stored,            // inout  Scratch buffer.
+    const ParticleChannelHeader& header,  // in
+    const ParticleChunkHeader& chunk);    // in
+
+  FILE*                               fp_;
+  ParticleFileHeader                  header_;
+  std::vector<ParticleBodyHeader>     bodies_;
+  int                                 currentBody_;
+  std::vector<ParticleChannelHeader>  channels_;
+  std::vector<ParticleChunkHeader>    chunks_;
+  std::vector<size_t>                 firstChunk_;  // Per channel.
+
+  std::string                         packFilename_;  // Empty when nothing is packed.
+  ParticlePack                        pack_;
+
+  bool                                idIndexLoaded_;
+  std::vector<int64_t>                ids_;
+  std::vector<int32_t>                idTable_;
+};
+
+#endif  // PARTICLE_READER_H_
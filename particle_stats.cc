@@ -0,0 +1,289 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "particle_stats.h"
+
+#include <cfloat>
+#include <cstring>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Running min/max/sum/count of up to 3 components. NaNs are left out.
+struct Accumulator
+{
+  double   min[PARTICLE_MAX_COMPONENTS];
+  double   max[PARTICLE_MAX_COMPONENTS];
+  double   sum[PARTICLE_MAX_COMPONENTS];
+  uint64_t count[PARTICLE_MAX_COMPONENTS];
+
+  Accumulator() {
+    for (int c = 0; c < PARTICLE_MAX_COMPONENTS; c++) {
+      min[c]   = DBL_MAX;
+      max[c]   = -DBL_MAX;
+      sum[c]   = 0.0;
+      count[c] = 0;
+    }
+  }
+};
+
+void
+InitStats(
+  ParticleStats& stats)
+{
+  for (int c = 0; c < PARTICLE_MAX_COMPONENTS; c++) {
+    stats.min[c]   = DBL_MAX;
+    stats.max[c]   = -DBL_MAX;
+    stats.mean[c]  = 0.0;
+    stats.count[c] = 0;
+  }
+}
+
+template<typename T>
+static void
+AccumulateScalar(
+  Accumulator& acc,
+  const T* v,
+  size_t numElements,
+  int numComponents)
+{
+  for (size_t i = 0; i < numElements; i++) {
+    for (int c = 0; c < numComponents; c++) {
+      double x = (double)v[i * numComponents + c];
+      if (x != x) {
+        continue;   // NaN
+      }
+      acc.min[c]  = std::min(acc.min[c], x);
+      acc.max[c]  = std::max(acc.max[c], x);
+      acc.sum[c] += x;
+      acc.count[c]++;
+    }
+  }
+}
+
+#ifdef __SSE2__
+
+//
+// Processes groups of 4 * numComponents floats as numComponents vectors.
+// Since a group is a multiple of numComponents, lane j of vector k always
+// holds component (4k + j) % numComponents, so no deinterleave is needed.
+// NaN lanes are masked out of the sum and count. MINPS/MAXPS return the
+// second operand when either is NaN, so the running min/max is passed
+// second and is kept.
+// Returns the number of elements processed.
+//
+static size_t
+AccumulateFloatSSE(
+  Accumulator& acc,
+  const float* v,
+  size_t numElements,
+  int numComponents)
+{
+  const int    K          = numComponents;  // 1 or 3
+  const size_t groupSize  = 4 * K;
+  const size_t numGroups  = (numElements * K) / groupSize;
+  // Flush float sums to double often enough to keep precision.
+  const size_t kFlushGroups = 1024;
+
+  __m128 vmin[PARTICLE_MAX_COMPONENTS];
+  __m128 vmax[PARTICLE_MAX_COMPONENTS];
+  __m128 vsum[PARTICLE_MAX_COMPONENTS];
+  __m128i vcount[PARTICLE_MAX_COMPONENTS];
+  double lane[PARTICLE_MAX_COMPONENTS][4];
+  uint64_t laneCount[PARTICLE_MAX_COMPONENTS][4];
+  for (int k = 0; k < K; k++) {
+    vmin[k]   = _mm_set1_ps(FLT_MAX);
+    vmax[k]   = _mm_set1_ps(-FLT_MAX);
+    vsum[k]   = _mm_setzero_ps();
+    vcount[k] = _mm_setzero_si128();
+    for (int j = 0; j < 4; j++) {
+      lane[k][j]      = 0.0;
+      laneCount[k][j] = 0;
+    }
+  }
+
+  for (size_t g = 0; g < numGroups; g++) {
+    const float* p = v + g * groupSize;
+    for (int k = 0; k < K; k++) {
+      __m128 x       = _mm_loadu_ps(p + 4 * k);
+      __m128 ordered = _mm_cmpord_ps(x, x);   // All ones unless NaN.
+      vmin[k]   = _mm_min_ps(x, vmin[k]);
+      vmax[k]   = _mm_max_ps(x, vmax[k]);
+      vsum[k]   = _mm_add_ps(vsum[k], _mm_and_ps(x, ordered));
+      vcount[k] = _mm_sub_epi32(vcount[k], _mm_castps_si128(ordered));
+    }
+
+    if (((g + 1) % kFlushGroups == 0) || (g + 1 == numGroups)) {
+      for (int k = 0; k < K; k++) {
+        float s[4];
+        uint32_t n[4];
+        _mm_storeu_ps(s, vsum[k]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(n), vcount[k]);
+        for (int j = 0; j < 4; j++) {
+          lane[k][j]      += s[j];
+          laneCount[k][j] += n[j];
+        }
+        vsum[k]   = _mm_setzero_ps();
+        vcount[k] = _mm_setzero_si128();
+      }
+    }
+  }
+
+  if (numGroups == 0) {
+    return 0;
+  }
+
+  for (int k = 0; k < K; k++) {
+    float mn[4], mx[4];
+    _mm_storeu_ps(mn, vmin[k]);
+    _mm_storeu_ps(mx, vmax[k]);
+    for (int j = 0; j < 4; j++) {
+      int c = (4 * k + j) % K;
+      acc.min[c]  = std::min(acc.min[c], (double)mn[j]);
+      acc.max[c]  = std::max(acc.max[c], (double)mx[j]);
+      acc.sum[c]   += lane[k][j];
+      acc.count[c] += laneCount[k][j];
+    }
+  }
+
+  return (numGroups * groupSize) / K;
+}
+
+#endif  // __SSE2__
+
+static void
+AccumulateFloat(
+  Accumulator& acc,
+  const float* v,
+  size_t numElements,
+  int numComponents)
+{
+  size_t done = 0;
+#ifdef __SSE2__
+  done = AccumulateFloatSSE(acc, v, numElements, numComponents);
+#endif
+  AccumulateScalar(acc, v + done * numComponents, numElements - done, numComponents);
+}
+
+void
+ComputeStats(
+  ParticleStats& stats,
+  const char* data,
+  size_t size,
+  int type,
+  int plane)
+{
+  InitStats(stats);
+
+  const int    wordSize      = GetParticleTypeWordSize(type);
+  const int    numComponents = (plane >= 0) ? 1 : GetParticleTypeSize(type) / wordSize;
+  const size_t numElements   = size / (wordSize * numComponents);
+
+  Accumulator acc;
+  switch (type) {
+  case PARTICLE_TYPE_FLOAT:
+  case PARTICLE_TYPE_FLOAT3:
+    AccumulateFloat(acc, reinterpret_cast<const float*>(data), numElements, numComponents);
+    break;
+  case PARTICLE_TYPE_INT32:
+  case PARTICLE_TYPE_INT3:
+    AccumulateScalar(acc, reinterpret_cast<const int32_t*>(data), numElements, numComponents);
+    break;
+  case PARTICLE_TYPE_INT64:
+    AccumulateScalar(acc, reinterpret_cast<const int64_t*>(data), numElements, numComponents);
+    break;
+  default:
+    return;
+  }
+
+  for (int c = 0; c < numComponents; c++) {
+    if (acc.count[c] == 0) {
+      continue;   // Empty, or NaN only.
+    }
+    int dst = (plane >= 0) ? plane : c;
+    stats.min[dst]   = acc.min[c];
+    stats.max[dst]   = acc.max[c];
+    stats.mean[dst]  = acc.sum[c] / (double)acc.count[c];
+    stats.count[dst] = acc.count[c];
+  }
+}
+
+void
+MergeStats(
+  ParticleStats& dst,
+  const ParticleStats& src)
+{
+  for (int c = 0; c < PARTICLE_MAX_COMPONENTS; c++) {
+    if (src.count[c] == 0) {
+      continue;
+    }
+
+    uint64_t count = dst.count[c] + src.count[c];
+    dst.mean[c]  = (dst.mean[c] * (double)dst.count[c] + src.mean[c] * (double)src.count[c]) / (double)count;
+    dst.min[c]   = std::min(dst.min[c], src.min[c]);
+    dst.max[c]   = std::max(dst.max[c], src.max[c]);
+    dst.count[c] = count;
+  }
+}
+
+template<typename T>
+static void
+AccumulateHistogramT(
+  uint32_t histogram[PARTICLE_MAX_COMPONENTS][PARTICLE_HISTOGRAM_BINS],
+  const ParticleStats& range,
+  const T* v,
+  size_t numElements,
+  int numComponents,
+  int plane)
+{
+  double scale[PARTICLE_MAX_COMPONENTS];
+  for (int c = 0; c < numComponents; c++) {
+    int comp = (plane >= 0) ? plane : c;
+    double width = range.max[comp] - range.min[comp];
+    scale[c] = (width > 0.0) ? (PARTICLE_HISTOGRAM_BINS / width) : 0.0;
+  }
+
+  for (size_t i = 0; i < numElements; i++) {
+    for (int c = 0; c < numComponents; c++) {
+      int comp = (plane >= 0) ? plane : c;
+      double x = ((double)v[i * numComponents + c] - range.min[comp]) * scale[c];
+      int bin = (int)x;
+      if (!(x >= 0.0)) bin = 0;   // Also catches NaN.
+      if (bin >= PARTICLE_HISTOGRAM_BINS) bin = PARTICLE_HISTOGRAM_BINS - 1;
+      histogram[comp][bin]++;
+    }
+  }
+}
+
+void
+AccumulateHistogram(
+  uint32_t histogram[PARTICLE_MAX_COMPONENTS][PARTICLE_HISTOGRAM_BINS],
+  const ParticleStats& range,
+  const char* data,
+  size_t size,
+  int type,
+  int plane)
+{
+  const int    wordSize      = GetParticleTypeWordSize(type);
+  const int    numComponents = (plane >= 0) ? 1 : GetParticleTypeSize(type) / wordSize;
+  const size_t numElements   = size / (wordSize * numComponents);
+
+  switch (type) {
+  case PARTICLE_TYPE_FLOAT:
+  case PARTICLE_TYPE_FLOAT3:
+    AccumulateHistogramT(histogram, range, reinterpret_cast<const float*>(data), numElements, numComponents, plane);
+    break;
+  case PARTICLE_TYPE_INT32:
+  case PARTICLE_TYPE_INT3:
+    AccumulateHistogramT(histogram, range, reinterpret_cast<const int32_t*>(data), numElements, numComponents, plane);
+    break;
+  case PARTICLE_TYPE_INT64:
+    AccumulateHistogramT(histogram, range, reinterpret_cast<const int64_t*>(data), numElements, numComponents, plane);
+    break;
+  default:
+    break;
+  }
+}
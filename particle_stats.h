@@ -0,0 +1,51 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Per channel/chunk value statistics(see ParticleStats).
+//
+#ifndef PARTICLE_STATS_H_
+#define PARTICLE_STATS_H_
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "particle_format.h"
+
+// Empty stats(min > max, count 0).
+extern void
+InitStats(
+  ParticleStats& stats);    // out
+
+//
+// Compute stats of `size` bytes of `type` values in one pass.
+// `plane` is the component index when `data` is one plane of a planar
+// channel, or -1 when `data` is interleaved.
+// Float channels are processed with SSE when available. NaN values are
+// left out of min, max, mean and count.
+//
+extern void
+ComputeStats(
+  ParticleStats& stats,     // out
+  const char* data,         // in
+  size_t size,              // in
+  int type,                 // in  ParticleValueType
+  int plane);               // in
+
+extern void
+MergeStats(
+  ParticleStats& dst,       // inout
+  const ParticleStats& src);// in
+
+// Add values to PARTICLE_HISTOGRAM_BINS bins over [range.min, range.max].
+extern void
+AccumulateHistogram(
+  uint32_t histogram[PARTICLE_MAX_COMPONENTS][PARTICLE_HISTOGRAM_BINS], // inout
+  const ParticleStats& range, // in
+  const char* data,           // in
+  size_t size,                // in
+  int type,                   // in
+  int plane);                 // in
+
+#endif  // PARTICLE_STATS_H_
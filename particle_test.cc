@@ -0,0 +1,1449 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// particle-test: round trip tests of the Naiad independent parts.
+//
+//  * Every codec on interleaved and planar float, int32 and int64 data of
+//    sizes with partial blocks and partial words, with NaN, -0, Inf and
+//    denormals. Decoding must be bit exact, must not write past rawSize,
+//    and must reject truncated payloads.
+//  * ComputeStats() with NaN at every lane position, against a scalar
+//    reference, and the bounds stored by the writer.
+//  * FilterParticles() against a scalar reference(SSE groups, tails,
+//    NaN, box edges) and id keyed thinning.
+//  * ParticleDensityGrid: mass of every kernel, negative coordinates, and
+//    Write()/Read() round trip.
+//  * ParticleWriter/ParticleReader with and without a pack: multiple
+//    bodies, small chunks, planar channels, chunk hashes, id lookups.
+//  * Id lookups through a broken id.index channel.
+//  * ConversionManifest, WorkQueue(retries, lease takeover from a dead
+//    worker process) and LoadParticleFrames() through io_uring and
+//    through pread().
+//
+//  * ParticlePrefetcher over a sequence with missing frames, which load
+//    once written.
+//  * particle-diff(given as `particle-test [particle-diff]`): NaN at the
+//    same position compares equal through the chunk and the whole channel
+//    paths, and the directory summary counts files of both directories.
+//
+// Files are written into a temporary directory, removed at exit.
+// Exit status: 0 when all tests pass, 1 otherwise.
+//
+
+// To handle 2GB+ file.
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <unistd.h>
+#include <utime.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "particle_format.h"
+#include "particle_codec.h"
+#include "particle_hash.h"
+#include "particle_index.h"
+#include "particle_stats.h"
+#include "particle_filter.h"
+#include "particle_density.h"
+#include "particle_writer.h"
+#include "particle_reader.h"
+#include "particle_pack.h"
+#include "particle_prefetcher.h"
+#include "particle_batch.h"
+#include "conversion_cache.h"
+#include "work_queue.h"
+
+static int gNumChecks   = 0;
+static int gNumFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    gNumChecks++; \
+    if (!(cond)) { \
+      gNumFailures++; \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed.\n", __FILE__, __LINE__, #cond); \
+    } \
+  } while (0)
+
+// xorshift64*. Deterministic, so a failure is reproducible.
+static uint64_t
+NextRandom(
+  uint64_t& state)  // inout
+{
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 2685821657736338717ULL;
+}
+
+static float
+BitsToFloat(
+  uint32_t bits)
+{
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+//
+// Test data
+//
+
+enum DataKind
+{
+  DATA_SMOOTH_FLOAT,    // Positions on a jittered grid, plus special values.
+  DATA_RANDOM_BITS,     // Incompressible.
+  DATA_SORTED_INT,      // Ascending ids with gaps.
+  DATA_SMALL_INT,       // Small values with rare outliers.
+  DATA_CONSTANT,
+  DATA_KIND_COUNT
+};
+
+static const char* kDataKindNames[DATA_KIND_COUNT] = {
+  "smooth float", "random bits", "sorted int", "small int", "constant"
+};
+
+static void
+MakeData(
+  std::vector<char>& data,  // out
+  int kind,                 // in  DataKind
+  int size,                 // in  in bytes
+  int wordSize,             // in
+  uint64_t seed)            // in
+{
+  data.assign(size, 0);
+  uint64_t state = seed | 1;
+
+  const int numWords = size / wordSize;
+  for (int i = 0; i < numWords; i++) {
+    char* dst = &data[i * wordSize];
+    uint64_t r = NextRandom(state);
+
+    if (kind == DATA_SMOOTH_FLOAT) {
+      float f = 0.01f * (float)(i / 3) + 0.001f * (float)(r % 1000) / 1000.0f;
+      // NaN with payload, -0, Inf and a denormal every now and then.
+      switch (r % 97) {
+      case 0: f = BitsToFloat(0x7fc12345u); break;
+      case 1: f = -0.0f; break;
+      case 2: f = -std::numeric_limits<float>::infinity(); break;
+      case 3: f = BitsToFloat(0x00000123u); break;
+      default: break;
+      }
+      if (wordSize == 8) {
+        double d = f;
+        memcpy(dst, &d, 8);
+      } else {
+        memcpy(dst, &f, 4);
+      }
+    } else if (kind == DATA_RANDOM_BITS) {
+      memcpy(dst, &r, wordSize);
+    } else if (kind == DATA_SORTED_INT) {
+      uint64_t v = 1000000 + 3 * (uint64_t)i + (r & 1);
+      memcpy(dst, &v, wordSize);
+    } else if (kind == DATA_SMALL_INT) {
+      uint64_t v = ((r % 50) == 0) ? (r >> 16) : (r % 17);
+      memcpy(dst, &v, wordSize);
+    } else {
+      uint64_t v = 0x3f800000;
+      memcpy(dst, &v, wordSize);
+    }
+  }
+
+  // Trailing bytes of a size which is not a multiple of the word size.
+  for (int i = numWords * wordSize; i < size; i++) {
+    data[i] = (char)(NextRandom(state) & 0xff);
+  }
+}
+
+//
+// Codecs
+//
+
+static bool
+RoundTripChunk(
+  int& usedCodec,               // out
+  const std::vector<char>& src, // in
+  int codec,                    // in
+  int elementSize,              // in
+  int wordSize)                 // in
+{
+  const int size = (int)src.size();
+  const char* srcPtr = src.empty() ? NULL : &src[0];
+
+  std::vector<char> encoded;
+  usedCodec = EncodeChunk(encoded, codec, srcPtr, size, elementSize, wordSize);
+  if ((usedCodec != codec) && (usedCodec != PARTICLE_CODEC_RAW)) {
+    return false;
+  }
+  if ((int)encoded.size() > size) {
+    return false;
+  }
+
+  // Guard bytes after rawSize catch a decoder writing past the chunk.
+  const int kGuard = 64;
+  std::vector<char> decoded(size + kGuard, (char)0xa5);
+  const char* encPtr = encoded.empty() ? NULL : &encoded[0];
+  if (!DecodeChunk(&decoded[0], size, usedCodec, encPtr, (int)encoded.size(), elementSize, wordSize)) {
+    return false;
+  }
+  for (int i = 0; i < kGuard; i++) {
+    if (decoded[size + i] != (char)0xa5) {
+      return false;
+    }
+  }
+  if ((size > 0) && (memcmp(&decoded[0], srcPtr, size) != 0)) {
+    return false;
+  }
+
+  // A truncated payload must be rejected(and not be overrun).
+  if ((usedCodec != PARTICLE_CODEC_RAW) && !encoded.empty()) {
+    const int cuts[2] = { (int)encoded.size() - 1, (int)encoded.size() / 2 };
+    for (int k = 0; k < 2; k++) {
+      std::vector<char> truncated(encoded.begin(), encoded.begin() + cuts[k]);
+      const char* truncPtr = truncated.empty() ? NULL : &truncated[0];
+      if (DecodeChunk(&decoded[0], size, usedCodec, truncPtr, cuts[k], elementSize, wordSize)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+static void
+TestCodecs()
+{
+  // Element layouts: float3/int3 interleaved, float/int32(or a plane of a
+  // planar channel) and int64.
+  const int layouts[3][2] = { { 12, 4 }, { 4, 4 }, { 8, 8 } };
+
+  // Element counts around the bitpack(128) and fpredict(256) block sizes.
+  const int counts[] = { 1, 2, 3, 31, 127, 128, 129, 255, 256, 257, 1000, 4099 };
+  const int numCounts = sizeof(counts) / sizeof(counts[0]);
+
+  // Extra bytes giving partial elements and partial words.
+  const int tails[] = { 0, 1, 3, 5 };
+  const int numTails = sizeof(tails) / sizeof(tails[0]);
+
+  int numEncoded[PARTICLE_CODEC_COUNT] = { 0 };
+  int numCases = 0;
+
+  for (int l = 0; l < 3; l++) {
+    const int elementSize = layouts[l][0];
+    const int wordSize    = layouts[l][1];
+
+    for (int kind = 0; kind < DATA_KIND_COUNT; kind++) {
+      for (int c = 0; c < numCounts; c++) {
+        for (int t = 0; t < numTails; t++) {
+          const int size = counts[c] * elementSize + tails[t];
+
+          std::vector<char> src;
+          MakeData(src, kind, size, wordSize, 0x9e3779b97f4a7c15ULL + (uint64_t)(size * 31 + kind));
+
+          for (int codec = 0; codec < PARTICLE_CODEC_COUNT; codec++) {
+            int used = PARTICLE_CODEC_RAW;
+            bool ok = RoundTripChunk(used, src, codec, elementSize, wordSize);
+            if (!ok) {
+              fprintf(stderr, "  %s: %s, %d bytes, element %d, word %d\n",
+                GetCodecName(codec), kDataKindNames[kind], size, elementSize, wordSize);
+            }
+            CHECK(ok);
+            numEncoded[used]++;
+            numCases++;
+          }
+        }
+      }
+    }
+  }
+
+  // Every codec must actually have been exercised(not only its raw fallback).
+  for (int codec = 0; codec < PARTICLE_CODEC_COUNT; codec++) {
+    CHECK(numEncoded[codec] > 0);
+  }
+
+  // Names.
+  for (int codec = 0; codec < PARTICLE_CODEC_COUNT; codec++) {
+    CHECK(GetCodecByName(GetCodecName(codec)) == codec);
+  }
+  CHECK(GetCodecByName("auto") == PARTICLE_CODEC_AUTO);
+  CHECK(GetCodecByName("bogus") == PARTICLE_CODEC_COUNT);
+
+  // Selection never picks a codec which does not apply to the data type.
+  {
+    ParticleCodecOption option;
+    for (int kind = 0; kind < DATA_KIND_COUNT; kind++) {
+      std::vector<char> src;
+      MakeData(src, kind, 12 * 5000, 4, 12345 + kind);
+      int floatCodec = SelectCodec(&src[0], (int)src.size(), 12, 4, false, option);
+      int intCodec   = SelectCodec(&src[0], (int)src.size(), 12, 4, true, option);
+      CHECK((floatCodec >= 0) && (floatCodec < PARTICLE_CODEC_COUNT) && (floatCodec != PARTICLE_CODEC_BITPACK));
+      CHECK((intCodec >= 0) && (intCodec < PARTICLE_CODEC_COUNT) && (intCodec != PARTICLE_CODEC_FPREDICT));
+    }
+    std::vector<char> src;
+    MakeData(src, DATA_RANDOM_BITS, 12 * 5000, 4, 777);
+    CHECK(SelectCodec(&src[0], (int)src.size(), 12, 4, false, option) == PARTICLE_CODEC_RAW);
+  }
+
+  printf("codecs: %d round trips(", numCases);
+  for (int codec = 0; codec < PARTICLE_CODEC_COUNT; codec++) {
+    printf("%s%s %d", (codec > 0) ? ", " : "", GetCodecName(codec), numEncoded[codec]);
+  }
+  printf(")\n");
+}
+
+//
+// Stats
+//
+
+// Min/max/mean/count per component of float values, NaNs left out.
+static void
+ComputeReferenceStats(
+  ParticleStats& stats,           // out
+  const std::vector<float>& v,    // in
+  int numComponents)              // in
+{
+  InitStats(stats);
+  double sum[PARTICLE_MAX_COMPONENTS] = { 0.0, 0.0, 0.0 };
+  for (size_t i = 0; i + numComponents <= v.size(); i += numComponents) {
+    for (int c = 0; c < numComponents; c++) {
+      double x = v[i + c];
+      if (x != x) {
+        continue;
+      }
+      stats.min[c] = std::min(stats.min[c], x);
+      stats.max[c] = std::max(stats.max[c], x);
+      sum[c] += x;
+      stats.count[c]++;
+    }
+  }
+  for (int c = 0; c < numComponents; c++) {
+    stats.mean[c] = (stats.count[c] > 0) ? (sum[c] / (double)stats.count[c]) : 0.0;
+  }
+}
+
+static bool
+StatsEqual(
+  const ParticleStats& a,
+  const ParticleStats& b,
+  int numComponents)
+{
+  for (int c = 0; c < numComponents; c++) {
+    if ((a.count[c] != b.count[c]) || (a.min[c] != b.min[c]) || (a.max[c] != b.max[c])) {
+      return false;
+    }
+    // Sums are in float per SSE lane, so the mean is not bit exact.
+    if (std::fabs(a.mean[c] - b.mean[c]) > 1e-5 * std::max(1.0, std::fabs(b.mean[c]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void
+TestStats()
+{
+  const float kNaN = BitsToFloat(0x7fc00000u);
+
+  // A NaN must not reset the running min/max of its SSE lane.
+  {
+    std::vector<float> v(16);
+    v[0] = 1.0f;
+    for (int i = 1; i < 16; i++) {
+      v[i] = 10.0f + (float)i;
+    }
+    v[4] = kNaN;
+
+    ParticleStats stats;
+    ComputeStats(stats, (const char*)&v[0], v.size() * 4, PARTICLE_TYPE_FLOAT, -1);
+    CHECK(stats.min[0] == 1.0);
+    CHECK(stats.max[0] == 25.0);
+    CHECK(stats.count[0] == 15);
+    CHECK(stats.mean[0] == (1.0 + (11.0 + 25.0) * 15.0 / 2.0 - 14.0) / 15.0);
+  }
+
+  // NaN at each position of float and float3 data, through the SSE groups
+  // and the scalar tail, interleaved and as a plane.
+  int numCases = 0;
+  for (int numComponents = 1; numComponents <= 3; numComponents += 2) {
+    const int type = (numComponents == 3) ? PARTICLE_TYPE_FLOAT3 : PARTICLE_TYPE_FLOAT;
+    const int counts[] = { 1, 3, 4, 5, 8, 13, 4100 };
+    for (size_t k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+      const int numValues = counts[k] * numComponents;
+      for (int nanAt = -1; nanAt < std::min(numValues, 24); nanAt++) {
+        std::vector<float> v(numValues);
+        for (int i = 0; i < numValues; i++) {
+          v[i] = (float)((i * 7919) % 1000) - 300.0f;
+        }
+        if (nanAt >= 0) {
+          v[nanAt] = kNaN;
+        }
+        if (nanAt == 0) {
+          v[numValues - 1] = kNaN;  // Also at the end(the tail).
+        }
+
+        ParticleStats expected;
+        ComputeReferenceStats(expected, v, numComponents);
+        ParticleStats stats;
+        ComputeStats(stats, (const char*)&v[0], v.size() * 4, type, -1);
+        CHECK(StatsEqual(stats, expected, numComponents));
+
+        // One plane of a planar channel goes to component `plane`.
+        ComputeReferenceStats(expected, v, 1);
+        ComputeStats(stats, (const char*)&v[0], v.size() * 4, PARTICLE_TYPE_FLOAT, 2);
+        CHECK((stats.count[0] == 0) && (stats.count[1] == 0));
+        CHECK((stats.count[2] == expected.count[0]) && (stats.min[2] == expected.min[0]) &&
+              (stats.max[2] == expected.max[0]));
+        numCases++;
+      }
+    }
+  }
+
+  // NaN only: empty, and ignored by MergeStats().
+  {
+    std::vector<float> v(9, kNaN);
+    ParticleStats stats;
+    ComputeStats(stats, (const char*)&v[0], v.size() * 4, PARTICLE_TYPE_FLOAT, -1);
+    CHECK((stats.count[0] == 0) && (stats.min[0] > stats.max[0]));
+
+    ParticleStats merged;
+    std::vector<float> w(5, 2.0f);
+    ComputeStats(merged, (const char*)&w[0], w.size() * 4, PARTICLE_TYPE_FLOAT, -1);
+    MergeStats(merged, stats);
+    CHECK((merged.count[0] == 5) && (merged.min[0] == 2.0) && (merged.mean[0] == 2.0));
+  }
+
+  // Integer channels.
+  {
+    std::vector<int64_t> ids;
+    for (int64_t i = 0; i < 37; i++) {
+      ids.push_back((int64_t)1 << 40 | (i * 3));
+    }
+    ParticleStats stats;
+    ComputeStats(stats, (const char*)&ids[0], ids.size() * 8, PARTICLE_TYPE_INT64, -1);
+    CHECK((stats.count[0] == 37) && (stats.min[0] == (double)ids[0]) && (stats.max[0] == (double)ids[36]));
+  }
+
+  printf("stats: %d NaN cases\n", numCases);
+}
+
+//
+// Filter
+//
+
+static bool
+PassesReference(
+  const ParticleFilter& filter,
+  const float* p,
+  float radius,
+  float age)
+{
+  for (int c = 0; c < 3; c++) {
+    if (filter.useBounds && !((p[c] >= filter.bmin[c]) && (p[c] <= filter.bmax[c]))) {
+      return false;
+    }
+  }
+  return (!filter.UsesRadius() || (radius >= filter.minRadius)) &&
+         (!filter.UsesAge() || (age >= filter.minAge));
+}
+
+static void
+TestFilter()
+{
+  // More than one 64K range of FilterParticles(), with a partial group.
+  const size_t n = 150001;
+  std::vector<float>   positions(3 * n);
+  std::vector<float>   radius(n);
+  std::vector<float>   age(n);
+  std::vector<int64_t> ids(n);
+  uint64_t state = 99;
+  for (size_t i = 0; i < n; i++) {
+    for (int c = 0; c < 3; c++) {
+      positions[3 * i + c] = (float)(NextRandom(state) % 2001) / 1000.0f - 1.0f;   // [-1, 1]
+    }
+    radius[i] = (float)(NextRandom(state) % 100) / 100.0f;
+    age[i]    = (float)(NextRandom(state) % 48);
+    ids[i]    = 1000 + (int64_t)i;
+  }
+  positions[3 * 7 + 1] = BitsToFloat(0x7fc00000u);  // NaN never passes a box.
+  positions[3 * 8 + 0] = 0.5f;                      // On the box edge.
+  radius[9]            = BitsToFloat(0x7fc00000u);
+  positions[3 * (n - 1) + 2] = BitsToFloat(0x7fc00000u);
+
+  ParticleFilter filters[4];
+  filters[0].useBounds = true;
+  for (int c = 0; c < 3; c++) {
+    filters[0].bmin[c] = -0.5f;
+    filters[0].bmax[c] = 0.5f;
+  }
+  filters[1].minRadius = 0.3f;
+  filters[2].minAge    = 10.0f;
+  filters[3]           = filters[0];
+  filters[3].minRadius = 0.2f;
+  filters[3].minAge    = 5.0f;
+
+  for (int k = 0; k < 4; k++) {
+    std::vector<uint32_t> expected;
+    for (size_t i = 0; i < n; i++) {
+      if (PassesReference(filters[k], &positions[3 * i], radius[i], age[i])) {
+        expected.push_back((uint32_t)i);
+      }
+    }
+    std::vector<uint32_t> selected;
+    CHECK(FilterParticles(selected, filters[k], &positions[0], &radius[0], &age[0], &ids[0], n) == expected.size());
+    CHECK(selected == expected);
+    CHECK(!expected.empty() && (expected.size() < n));
+  }
+
+  // Tiles.
+  const float tmin[3] = { 0.6f, -0.2f, -0.2f };
+  const float tmax[3] = { 0.9f, 0.2f, 0.2f };
+  CHECK(!TileIntersectsFilter(filters[0], tmin, tmax));
+  CHECK(TileIntersectsFilter(filters[1], tmin, tmax));
+  const float edge[3] = { 0.5f, 0.5f, 0.5f };
+  CHECK(TileIntersectsFilter(filters[0], edge, tmax));
+
+  // Thinning keeps about the fraction, keyed on ids: the same particles
+  // are kept in another order(another frame), another seed keeps others.
+  ParticleFilter thin;
+  thin.keepFraction = 0.25f;
+  std::vector<uint32_t> selected;
+  const size_t numKept = FilterParticles(selected, thin, &positions[0], NULL, NULL, &ids[0], n);
+  CHECK((numKept > n / 4 - n / 100) && (numKept < n / 4 + n / 100));
+
+  std::vector<int64_t> kept;
+  for (size_t i = 0; i < selected.size(); i++) {
+    kept.push_back(ids[selected[i]]);
+  }
+  std::vector<int64_t> reversed(ids.rbegin(), ids.rend());
+  FilterParticles(selected, thin, &positions[0], NULL, NULL, &reversed[0], n);
+  std::vector<int64_t> keptReversed;
+  for (size_t i = 0; i < selected.size(); i++) {
+    keptReversed.push_back(reversed[selected[i]]);
+  }
+  std::sort(keptReversed.begin(), keptReversed.end());
+  CHECK(kept == keptReversed);
+
+  thin.seed = 1;
+  FilterParticles(selected, thin, &positions[0], NULL, NULL, &ids[0], n);
+  size_t numSame = 0;
+  for (size_t i = 0; i < selected.size(); i++) {
+    numSame += std::binary_search(kept.begin(), kept.end(), ids[selected[i]]) ? 1 : 0;
+  }
+  CHECK(numSame < selected.size() / 2);
+
+  // Compaction in place.
+  std::vector<float> data(positions);
+  FilterParticles(selected, filters[3], &positions[0], &radius[0], &age[0], &ids[0], n);
+  CompactElements(reinterpret_cast<char*>(&data[0]), selected, 12);
+  bool compacted = true;
+  for (size_t i = 0; i < selected.size(); i++) {
+    compacted = compacted && (memcmp(&data[3 * i], &positions[3 * selected[i]], 12) == 0);
+  }
+  CHECK(compacted);
+
+  printf("filter: ok\n");
+}
+
+//
+// Density grid
+//
+
+// Sum of density * voxel volume over the voxels around [-1, 1]^3.
+static double
+GetDensityMass(
+  const ParticleDensityGrid& grid,  // in
+  float voxelSize)                  // in
+{
+  const int r = (int)(1.0f / voxelSize) + 3;
+  double sum = 0.0;
+  for (int z = -r; z <= r; z++) {
+    for (int y = -r; y <= r; y++) {
+      for (int x = -r; x <= r; x++) {
+        sum += grid.Lookup(x, y, z);
+      }
+    }
+  }
+  return sum * voxelSize * voxelSize * voxelSize;
+}
+
+static void
+TestDensity(
+  const std::string& dir)   // in
+{
+  const float  voxelSize = 0.1f;
+  const size_t n         = 20000;
+  std::vector<float> positions(3 * n);
+  uint64_t state = 7;
+  for (size_t i = 0; i < 3 * n; i++) {
+    positions[i] = (float)(NextRandom(state) % 1801) / 1000.0f - 0.9f;   // [-0.9, 0.9]
+  }
+  positions[3 * 5] = BitsToFloat(0x7fc00000u);    // Skipped.
+  positions[3 * 6] = std::numeric_limits<float>::infinity();
+
+  for (int kernel = 0; kernel < PARTICLE_DENSITY_KERNEL_COUNT; kernel++) {
+    CHECK(GetDensityKernelByName(GetDensityKernelName(kernel)) == kernel);
+
+    // Every kernel is a partition of unity: each particle adds mass 1.
+    ParticleDensityGrid grid(voxelSize, kernel);
+    grid.Splat(&positions[0], n / 2);
+    grid.Splat(&positions[3 * (n / 2)], n - n / 2);
+    CHECK(grid.GetNumParticles() == n);
+    CHECK(std::fabs(GetDensityMass(grid, voxelSize) - (double)(n - 2)) < 1e-3 * (double)n);
+
+    const std::string filename = dir + "/grid." + GetDensityKernelName(kernel) + ".density";
+    CHECK(grid.Write(filename));
+
+    ParticleDensityGrid loaded(1.0f, PARTICLE_DENSITY_KERNEL_BOX);
+    CHECK(loaded.Read(filename));
+    CHECK((loaded.GetVoxelSize() == voxelSize) && (loaded.GetKernel() == kernel));
+    CHECK((loaded.GetNumParticles() == n) && (loaded.GetNumTiles() == grid.GetNumTiles()));
+    bool same = true;
+    for (int z = -12; z <= 12; z++) {
+      for (int y = -12; y <= 12; y++) {
+        for (int x = -12; x <= 12; x++) {
+          same = same && (loaded.Lookup(x, y, z) == grid.Lookup(x, y, z));
+        }
+      }
+    }
+    CHECK(same);
+
+    // Truncated files are rejected.
+    FILE* fp = fopen(filename.c_str(), "r+b");
+    CHECK(fp && (fseek(fp, 0, SEEK_END) == 0));
+    if (fp) {
+      long size = ftell(fp);
+      fclose(fp);
+      CHECK(truncate(filename.c_str(), size - 4) == 0);
+      CHECK(!loaded.Read(filename));
+    }
+  }
+
+  // One particle, box kernel: 1 / voxel volume in its voxel, negative too.
+  ParticleDensityGrid grid(0.5f, PARTICLE_DENSITY_KERNEL_BOX);
+  const float p[3] = { -0.1f, 0.25f, -3.9f };
+  grid.Splat(p, 1);
+  CHECK(grid.Lookup(-1, 0, -8) == 8.0f);
+  CHECK(grid.Lookup(0, 0, -8) == 0.0f);
+  CHECK(grid.Lookup(1000, 1000, 1000) == 0.0f);
+  CHECK(grid.GetNumTiles() == 1);
+
+  printf("density grid: ok\n");
+}
+
+//
+// Writer and reader
+//
+
+struct TestBody
+{
+  std::string           name;
+  uint32_t              flags;
+  std::vector<float>    position;   // float3
+  std::vector<float>    velocity;   // float3, written planar
+  std::vector<float>    density;    // float
+  std::vector<int32_t>  count;      // int32, forced bitpack
+  std::vector<int64_t>  id;
+  std::vector<int32_t>  idTable;    // Of unsorted bodies.
+};
+
+static void
+MakeBody(
+  TestBody& body,             // out
+  const std::string& name,    // in
+  size_t n,                   // in
+  bool sortedById,            // in
+  uint64_t seed)              // in
+{
+  body.name  = name;
+  body.flags = sortedById ? PARTICLE_BODY_FLAG_SORTED_BY_ID : 0;
+
+  std::vector<char> data;
+  MakeData(data, DATA_SMOOTH_FLOAT, (int)(n * 12), 4, seed);
+  body.position.resize(3 * n);
+  memcpy(&body.position[0], &data[0], data.size());
+
+  MakeData(data, DATA_RANDOM_BITS, (int)(n * 12), 4, seed + 1);
+  body.velocity.resize(3 * n);
+  memcpy(&body.velocity[0], &data[0], data.size());
+  for (size_t i = 0; i < 3 * n; i++) {
+    // Finite, sign mixed, with -0.
+    body.velocity[i] = ((i % 11) == 0) ? -0.0f : (float)((int32_t)(((uint32_t*)&data[0])[i]) >> 8) / 65536.0f;
+  }
+
+  body.density.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    body.density[i] = ((i % 500) == 7) ? BitsToFloat(0x7fc00001u) : 1000.0f + 0.5f * (float)(i % 64);
+  }
+
+  MakeData(data, DATA_SMALL_INT, (int)(n * 4), 4, seed + 2);
+  body.count.resize(n);
+  memcpy(&body.count[0], &data[0], data.size());
+
+  body.id.resize(n);
+  uint64_t state = seed | 1;
+  for (size_t i = 0; i < n; i++) {
+    body.id[i] = 5000000 + 2 * (int64_t)i;
+  }
+  if (!sortedById) {
+    for (size_t i = n - 1; i > 0; i--) {
+      std::swap(body.id[i], body.id[NextRandom(state) % (i + 1)]);
+    }
+    BuildIdHashTable(body.idTable, &body.id[0], n);
+  }
+}
+
+static bool
+WriteBodies(
+  const std::string& filename,            // in
+  const std::vector<TestBody>& bodies,    // in
+  ParticlePack* pack,                     // in  NULL writes payloads into the file.
+  const std::string& packName)            // in
+{
+  ParticleCodecOption option;
+  option.chunkSize = 64 * 1024 + 12;      // Many chunks, with a partial last one.
+
+  ParticleWriter writer(option);
+  if (pack) {
+    writer.SetPack(pack, packName);
+  }
+
+  for (size_t b = 0; b < bodies.size(); b++) {
+    const TestBody& body = bodies[b];
+    const size_t n = body.id.size();
+    writer.BeginBody(body.name, n, body.flags);
+    writer.AddChannel("position", PARTICLE_TYPE_FLOAT3, &body.position[0], n);
+    writer.AddChannel("velocity", PARTICLE_TYPE_FLOAT3, &body.velocity[0], n, PARTICLE_CHANNEL_FLAG_PLANAR);
+    writer.AddChannel("density", PARTICLE_TYPE_FLOAT, &body.density[0], n, 0, PARTICLE_CODEC_FPREDICT);
+    writer.AddChannel("count", PARTICLE_TYPE_INT32, &body.count[0], n, 0, PARTICLE_CODEC_BITPACK);
+    writer.AddChannel(PARTICLE_CHANNEL_ID, PARTICLE_TYPE_INT64, &body.id[0], n);
+    if (!body.idTable.empty()) {
+      writer.AddChannel(PARTICLE_CHANNEL_ID_INDEX, PARTICLE_TYPE_INT32, &body.idTable[0], body.idTable.size());
+    }
+  }
+
+  return writer.Write(filename.c_str());
+}
+
+// Expected stored bytes of a channel(planes for a planar float3 channel).
+static void
+GetExpected(
+  std::vector<char>& expected,  // out
+  const TestBody& body,         // in
+  const std::string& name)      // in
+{
+  const size_t n = body.id.size();
+  expected.clear();
+
+  if (name == "position") {
+    expected.assign((const char*)&body.position[0], (const char*)&body.position[0] + 12 * n);
+  } else if (name == "velocity") {
+    std::vector<float> planes(3 * n);
+    for (size_t i = 0; i < n; i++) {
+      for (int k = 0; k < 3; k++) {
+        planes[k * n + i] = body.velocity[3 * i + k];
+      }
+    }
+    expected.assign((const char*)&planes[0], (const char*)&planes[0] + 12 * n);
+  } else if (name == "density") {
+    expected.assign((const char*)&body.density[0], (const char*)&body.density[0] + 4 * n);
+  } else if (name == "count") {
+    expected.assign((const char*)&body.count[0], (const char*)&body.count[0] + 4 * n);
+  } else if (name == PARTICLE_CHANNEL_ID) {
+    expected.assign((const char*)&body.id[0], (const char*)&body.id[0] + 8 * n);
+  } else if (name == PARTICLE_CHANNEL_ID_INDEX) {
+    expected.assign((const char*)&body.idTable[0], (const char*)&body.idTable[0] + 4 * body.idTable.size());
+  }
+}
+
+static void
+CheckFile(
+  const std::string& filename,            // in
+  const std::vector<TestBody>& bodies,    // in
+  bool packed)                            // in
+{
+  ParticleReader reader;
+  CHECK(reader.Open(filename));
+  CHECK(reader.GetNumBodies() == (int)bodies.size());
+  if (reader.GetNumBodies() != (int)bodies.size()) {
+    return;
+  }
+
+  for (size_t b = 0; b < bodies.size(); b++) {
+    const TestBody& body = bodies[b];
+    const int index = reader.FindBody(body.name);
+    CHECK(index == (int)b);
+    CHECK(reader.SelectBody(index));
+    CHECK(reader.GetNumParticles() == body.id.size());
+    CHECK(reader.GetFlags() == body.flags);
+
+    // Channel indices are of the whole file. The body's range holds its own.
+    const ParticleBodyHeader& bodyHeader = reader.GetBodyHeader(index);
+    CHECK(bodyHeader.numChannels == (body.idTable.empty() ? 5u : 6u));
+    CHECK(reader.FindChannel("position") == (int)bodyHeader.firstChannel);
+
+    for (int ch = (int)bodyHeader.firstChannel; ch < (int)(bodyHeader.firstChannel + bodyHeader.numChannels); ch++) {
+      const ParticleChannelHeader& header = reader.GetChannelHeader(ch);
+      std::vector<char> expected;
+      GetExpected(expected, body, header.name);
+
+      std::vector<char> data;
+      CHECK(reader.ReadChannel(data, ch));
+      CHECK(!expected.empty() && (data == expected));
+
+      if (std::string(header.name) == "velocity") {
+        CHECK(header.flags & PARTICLE_CHANNEL_FLAG_PLANAR);
+      }
+
+      // Chunks: sizes add up, hashes match, payloads in the file aligned.
+      size_t offset = 0;
+      bool chunksOk = true;
+      for (int i = 0; i < reader.GetNumChunks(ch); i++) {
+        const ParticleChunkHeader& chunk = reader.GetChunkHeader(ch, i);
+        std::vector<char> raw;
+        if (!reader.ReadChunk(raw, ch, i) ||
+            (raw.size() != chunk.rawSize) ||
+            (offset + raw.size() > expected.size()) ||
+            (memcmp(&raw[0], &expected[offset], raw.size()) != 0) ||
+            (HashBytes64(&raw[0], raw.size(), 0) != chunk.hash) ||
+            (((chunk.flags & PARTICLE_CHUNK_FLAG_PACKED) != 0) != packed) ||
+            (!packed && ((chunk.offset % PARTICLE_FILE_ALIGNMENT) != 0))) {
+          chunksOk = false;
+        }
+        offset += chunk.rawSize;
+      }
+      CHECK(chunksOk);
+      CHECK(offset == expected.size());
+    }
+
+    // Id lookups through the hash table or the sorted ids.
+    const size_t n = body.id.size();
+    std::vector<int64_t> ids;
+    std::vector<int64_t> expectedIndices;
+    for (size_t i = 0; i < n; i += 997) {
+      ids.push_back(body.id[i]);
+      expectedIndices.push_back((int64_t)i);
+    }
+    ids.push_back(-1);
+    expectedIndices.push_back(-1);
+    ids.push_back(5000000 + 1);   // Between two ids.
+    expectedIndices.push_back(-1);
+
+    std::vector<int64_t> indices(ids.size());
+    CHECK(reader.LookupIds(&indices[0], &ids[0], ids.size()));
+    CHECK(indices == expectedIndices);
+
+    // Bounds from the header stats. Positions hold NaNs and -Inf.
+    double bmin[3], bmax[3];
+    CHECK(reader.GetBounds(bmin, bmax, "position"));
+    ParticleStats expectedStats;
+    ComputeReferenceStats(expectedStats, body.position, 3);
+    for (int c = 0; c < 3; c++) {
+      CHECK((bmin[c] == expectedStats.min[c]) && (bmax[c] == expectedStats.max[c]));
+    }
+  }
+}
+
+// Same frame as LoadParticleFrame() gives, compared channel by channel.
+static bool
+FramesEqual(
+  const ParticleFrame& a,
+  const ParticleFrame& b)
+{
+  if ((a.bodies.size() != b.bodies.size()) || (a.channels.size() != b.channels.size())) {
+    return false;
+  }
+  for (size_t i = 0; i < a.bodies.size(); i++) {
+    if (memcmp(&a.bodies[i], &b.bodies[i], sizeof(ParticleBodyHeader)) != 0) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < a.channels.size(); i++) {
+    if ((a.channels[i].body != b.channels[i].body) ||
+        (strcmp(a.channels[i].header.name, b.channels[i].header.name) != 0) ||
+        (a.channels[i].data != b.channels[i].data)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void
+TestWriterReader(
+  std::vector<std::string>& files,  // out  Written files, for the batch test.
+  const std::string& dir,           // in
+  bool withPack)                    // in
+{
+  std::vector<TestBody> bodies(3);
+  MakeBody(bodies[0], "fluid", 100003, false, 11);
+  MakeBody(bodies[1], "spray", 4099, true, 22);
+  MakeBody(bodies[2], "single", 1, false, 33);
+
+  const std::string prefix = dir + (withPack ? "/packed" : "/plain");
+  const std::string packName = "chunks.pack";
+
+  ParticlePack pack;
+  if (withPack) {
+    CHECK(pack.Open(dir + "/" + packName, true));
+  }
+
+  const std::string first = prefix + ".0001.dat";
+  CHECK(WriteBodies(first, bodies, withPack ? &pack : NULL, packName));
+  CheckFile(first, bodies, withPack);
+  files.push_back(first);
+
+  // An identical frame adds nothing to the pack.
+  const size_t numEntries = pack.GetNumEntries();
+  const std::string second = prefix + ".0002.dat";
+  CHECK(WriteBodies(second, bodies, withPack ? &pack : NULL, packName));
+  CheckFile(second, bodies, withPack);
+  files.push_back(second);
+  if (withPack) {
+    CHECK(numEntries > 0);
+    CHECK(pack.GetNumEntries() == numEntries);
+
+    // A second process's view of the pack.
+    ParticlePack other;
+    CHECK(other.Open(dir + "/" + packName, false));
+    CHECK(other.GetNumEntries() == numEntries);
+  }
+
+  // A changed body only adds its own chunks.
+  bodies[1].density[17] = -0.0f;
+  const std::string third = prefix + ".0003.dat";
+  CHECK(WriteBodies(third, bodies, withPack ? &pack : NULL, packName));
+  CheckFile(third, bodies, withPack);
+  files.push_back(third);
+  if (withPack) {
+    CHECK(pack.GetNumEntries() == numEntries + 1);
+  }
+
+  ParticleFrame frame;
+  CHECK(LoadParticleFrame(frame, third));
+  const ParticleFrame::Channel* density = frame.FindChannel("spray", "density");
+  CHECK(density && (density->data.size() == 4 * 4099) &&
+        (memcmp(&density->data[4 * 17], &bodies[1].density[17], 4) == 0));
+
+  printf("writer/reader %s pack: %d files\n", withPack ? "with" : "without", 3);
+}
+
+//
+// Id index
+//
+
+static void
+TestIdIndex(
+  const std::string& dir)   // in
+{
+  std::vector<int64_t> ids;
+  for (int64_t i = 0; i < 100; i++) {
+    ids.push_back(7 * i + 3);
+  }
+  std::vector<int32_t> table;
+  BuildIdHashTable(table, &ids[0], ids.size());
+  CHECK(ValidateIdHashTable(&table[0], table.size(), ids.size()));
+  CHECK(LookupIdHashTable(&table[0], table.size(), &ids[0], ids[42]) == 42);
+
+  // Broken tables: not a power of two, slots out of range.
+  CHECK(!ValidateIdHashTable(&table[0], table.size() - 1, ids.size()));
+  CHECK(!ValidateIdHashTable(&table[0], table.size(), ids.size() - 1));
+  std::vector<int32_t> broken(table);
+  broken[0] = -2;
+  CHECK(!ValidateIdHashTable(&broken[0], broken.size(), ids.size()));
+
+  // No empty slot: a missing id must still end the probe.
+  std::vector<int32_t> full(256, 5);
+  CHECK(ValidateIdHashTable(&full[0], full.size(), ids.size()));
+  CHECK(LookupIdHashTable(&full[0], full.size(), &ids[0], -1) == -1);
+
+  // Files with a broken id.index channel fall back to a rebuilt index.
+  for (int k = 0; k < 3; k++) {
+    std::vector<int32_t> bad;
+    if (k == 0) {
+      bad.assign(256, 0x7fffffff);        // Out of range.
+    } else if (k == 1) {
+      bad.assign(256, 5);                 // Valid, but no empty slot.
+    } else {
+      bad.assign(table.begin(), table.end() - 3);  // Truncated.
+    }
+
+    const std::string filename = dir + "/broken_index.dat";
+    ParticleCodecOption option;
+    ParticleWriter writer(option);
+    writer.BeginBody("body", ids.size());
+    writer.AddChannel(PARTICLE_CHANNEL_ID, PARTICLE_TYPE_INT64, &ids[0], ids.size());
+    writer.AddChannel(PARTICLE_CHANNEL_ID_INDEX, PARTICLE_TYPE_INT32, &bad[0], bad.size());
+    CHECK(writer.Write(filename.c_str()));
+
+    ParticleReader reader;
+    CHECK(reader.Open(filename));
+    int64_t query[3]    = { ids[0], ids[99], 4 };
+    int64_t indices[3]  = { 0, 0, 0 };
+    CHECK(reader.LookupIds(indices, query, 3));
+    // A valid table without the ids finds nothing, but must terminate.
+    if (k == 1) {
+      CHECK((indices[0] == -1) && (indices[1] == -1) && (indices[2] == -1));
+    } else {
+      CHECK((indices[0] == 0) && (indices[1] == 99) && (indices[2] == -1));
+    }
+  }
+
+  printf("id index: ok\n");
+}
+
+//
+// Batch loader
+//
+
+static void
+TestBatch(
+  const std::vector<std::string>& files)  // in
+{
+  std::vector<ParticleFrame> expected(files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    CHECK(LoadParticleFrame(expected[i], files[i]));
+  }
+
+  for (int mode = 0; mode < 4; mode++) {
+    const bool useIoUring = (mode & 1) != 0;
+    const bool selected   = (mode & 2) != 0;
+
+    std::vector<ParticleBatchRequest> requests;
+    for (size_t i = 0; i < files.size(); i++) {
+      ParticleBatchRequest request;
+      request.filename = files[i];
+      if (selected) {
+        request.channels.push_back("velocity");
+        request.channels.push_back(PARTICLE_CHANNEL_ID);
+      }
+      requests.push_back(request);
+    }
+    ParticleBatchRequest missing;
+    missing.filename = files[0] + ".missing";
+    requests.push_back(missing);
+
+    ParticleBatchOption option;
+    option.numThreads = 3;
+    option.queueDepth = 8;    // Less than the reads of one file.
+    option.useIoUring = useIoUring;
+
+    std::vector<ParticleFrame> frames;
+    std::vector<bool> loaded;
+    CHECK(LoadParticleFrames(frames, loaded, requests, option) == (int)files.size());
+    CHECK((frames.size() == requests.size()) && (loaded.size() == requests.size()));
+    if (frames.size() != requests.size()) {
+      continue;
+    }
+    CHECK(!loaded[files.size()]);
+
+    for (size_t i = 0; i < files.size(); i++) {
+      CHECK(loaded[i] && (frames[i].frame == (int)i));
+      if (!selected) {
+        CHECK(FramesEqual(frames[i], expected[i]));
+        continue;
+      }
+
+      // Every body, only the requested channels.
+      CHECK(frames[i].bodies.size() == expected[i].bodies.size());
+      size_t numSelected = 0;
+      for (size_t c = 0; c < expected[i].channels.size(); c++) {
+        const ParticleFrame::Channel& e = expected[i].channels[c];
+        const std::string name = e.header.name;
+        if ((name != "velocity") && (name != PARTICLE_CHANNEL_ID)) {
+          continue;
+        }
+        const ParticleFrame::Channel* ch = frames[i].FindChannel(expected[i].bodies[e.body].name, name);
+        CHECK(ch && (ch->data == e.data));
+        numSelected++;
+      }
+      CHECK(frames[i].channels.size() == numSelected);
+    }
+  }
+
+  printf("batch loader: %d files, io_uring and pread\n", (int)files.size());
+}
+
+//
+// Conversion manifest
+//
+
+static void
+TestManifest(
+  const std::string& dir)   // in
+{
+  const std::string filename = dir + "/particle.manifest";
+  const std::string output   = dir + "/plain.0001.dat";   // Exists.
+
+  ConversionManifest manifest;
+  manifest.inputHash_    = 0x0123456789abcdefULL;
+  manifest.settingsHash_ = 0xfedcba9876543210ULL;
+  manifest.numOutputs_   = 2;
+  ConversionManifest::Body body;
+  body.index    = 0;
+  body.dataHash = 42;
+  body.output   = output;
+  manifest.bodies_.push_back(body);
+  CHECK(manifest.Save(filename));
+
+  // One of two outputs recorded(e.g. the other failed to be written).
+  ConversionManifest loaded;
+  CHECK(loaded.Load(filename));
+  CHECK(loaded.inputHash_ == manifest.inputHash_);
+  CHECK(loaded.settingsHash_ == manifest.settingsHash_);
+  CHECK(loaded.numOutputs_ == 2);
+  CHECK(!loaded.IsUpToDate(manifest.inputHash_, manifest.settingsHash_));
+  CHECK(loaded.IsBodyUpToDate(0, 42, output));
+  CHECK(!loaded.IsBodyUpToDate(0, 43, output));
+  CHECK(!loaded.IsBodyUpToDate(1, 42, output));
+
+  body.index  = 1;
+  body.output = dir + "/plain.0002.dat";
+  manifest.bodies_.push_back(body);
+  CHECK(manifest.Save(filename));
+  CHECK(loaded.Load(filename));
+  CHECK(loaded.bodies_.size() == 2);
+  CHECK(loaded.FindBody(1) && (loaded.FindBody(1)->output == body.output));
+  CHECK(loaded.IsUpToDate(manifest.inputHash_, manifest.settingsHash_));
+  CHECK(!loaded.IsUpToDate(manifest.inputHash_ + 1, manifest.settingsHash_));
+  CHECK(!loaded.IsUpToDate(manifest.inputHash_, manifest.settingsHash_ + 1));
+
+  // A missing output makes the frame stale.
+  manifest.bodies_[1].output = dir + "/does_not_exist.dat";
+  CHECK(manifest.Save(filename));
+  CHECK(loaded.Load(filename));
+  CHECK(!loaded.IsUpToDate(manifest.inputHash_, manifest.settingsHash_));
+
+  CHECK(!loaded.Load(dir + "/no.manifest"));
+
+  // Hash helpers used by the manifest.
+  uint64_t hash = 0;
+  CHECK(StringToHash(hash, HashToString(0x00ff00ff12345678ULL)) && (hash == 0x00ff00ff12345678ULL));
+  CHECK(!StringToHash(hash, "xyz"));
+  uint64_t fileHash = 0;
+  CHECK(HashFile64(fileHash, filename));
+
+  printf("conversion manifest: ok\n");
+}
+
+//
+// Work queue
+//
+
+static void
+TestWorkQueue(
+  const std::string& dir)   // in
+{
+  const std::string workDir = dir + "/work";
+
+  std::vector<std::string> args;
+  args.push_back("--single-file");
+  args.push_back("--output-dir /some dir/with space");
+  std::vector<WorkItem> items(4);
+  for (int i = 0; i < 4; i++) {
+    items[i].input = "frame." + std::string(1, (char)('0' + i)) + ".emp";
+    items[i].body  = i - 1;
+  }
+
+  WorkQueue coordinator(workDir, 2, 2);
+  CHECK(coordinator.Create(args, items));
+  CHECK(!coordinator.Create(args, items));   // Existing manifest.
+
+  WorkQueue worker(workDir, 2, 2);
+  CHECK(worker.Load());
+  CHECK(worker.GetArguments() == args);
+  CHECK(worker.GetItems().size() == items.size());
+  for (size_t i = 0; i < items.size() && (i < worker.GetItems().size()); i++) {
+    CHECK(worker.GetItems()[i].input == items[i].input);
+    CHECK(worker.GetItems()[i].body == items[i].body);
+  }
+
+  WorkStats stats;
+  stats.numBodies    = 1;
+  stats.numParticles = 1000;
+  stats.numFiles     = 1;
+  stats.numBytes     = 4096;
+  stats.seconds      = 0.5;
+
+  // Item 0: done.
+  CHECK(worker.GetState(0) == WorkQueue::STATE_FREE);
+  CHECK(worker.Claim(0));
+  CHECK(worker.GetState(0) == WorkQueue::STATE_LEASED);
+  CHECK(!coordinator.Claim(0));   // Leased and alive.
+  CHECK(worker.Complete(0, stats));
+  CHECK(worker.GetState(0) == WorkQueue::STATE_DONE);
+  CHECK(!worker.Claim(0));
+
+  // Item 1: fails once, then done on the retry.
+  CHECK(worker.Claim(1));
+  worker.Fail(1);
+  CHECK(worker.GetState(1) == WorkQueue::STATE_FREE);
+  CHECK(worker.Claim(1));
+  CHECK(worker.Complete(1, stats));
+
+  // Item 2: fails `maxAttempts` times and is not retried.
+  CHECK(worker.Claim(2));
+  worker.Fail(2);
+  CHECK(worker.Claim(2));
+  worker.Fail(2);
+  CHECK(worker.GetState(2) == WorkQueue::STATE_FAILED);
+  CHECK(!worker.Claim(2));
+
+  // Item 3: a worker process dies holding the lease, which expires and is
+  // taken over.
+  pid_t pid = fork();
+  if (pid == 0) {
+    WorkQueue dead(workDir, 2, 2);
+    _exit((dead.Load() && dead.Claim(3)) ? 0 : 1);
+  }
+  int status = -1;
+  CHECK((pid > 0) && (waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+  CHECK(worker.GetState(3) == WorkQueue::STATE_LEASED);
+  CHECK(!worker.Claim(3));      // Not expired yet.
+
+  WorkStats total;
+  int numFailed = 0;
+  CHECK(!coordinator.Merge(total, numFailed));  // Still leased.
+
+  struct utimbuf old;
+  old.actime  = time(NULL) - 60;
+  old.modtime = old.actime;
+  CHECK(utime((workDir + "/lease/000003").c_str(), &old) == 0);
+  CHECK(worker.Claim(3));       // Counts the dead attempt as a failure.
+  CHECK(worker.Complete(3, stats));
+
+  CHECK(coordinator.Merge(total, numFailed));
+  CHECK(numFailed == 1);
+  CHECK(total.numBodies == 3);
+  CHECK(total.numParticles == 3000);
+  CHECK(total.numBytes == 3 * 4096);
+  CHECK(std::fabs(total.seconds - 1.5) < 1e-9);
+  struct stat st;
+  CHECK(stat((workDir + "/summary.txt").c_str(), &st) == 0);
+
+  printf("work queue: ok\n");
+}
+
+//
+// particle-diff
+//
+
+static bool
+WriteDiffFile(
+  const std::string& filename,          // in
+  const std::vector<float>& position,   // in  float3
+  int chunkSize,                        // in
+  uint32_t flags)                       // in  PARTICLE_CHANNEL_FLAG_*
+{
+  ParticleCodecOption option;
+  option.chunkSize = chunkSize;
+  ParticleWriter writer(option);
+  writer.BeginBody("body", position.size() / 3);
+  writer.AddChannel("position", PARTICLE_TYPE_FLOAT3, &position[0], position.size() / 3, flags);
+  return writer.Write(filename.c_str());
+}
+
+// Exit status of particle-diff, or -1 when it did not run. `output` gets stdout.
+static int
+RunDiff(
+  std::string& output,          // out
+  const std::string& command)   // in
+{
+  output.clear();
+  FILE* fp = popen((command + " 2>&1").c_str(), "r");
+  if (!fp) {
+    return -1;
+  }
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    output.append(buf, n);
+  }
+  int status = pclose(fp);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void
+TestDiff(
+  const std::string& dir,       // in
+  const std::string& diffPath)  // in
+{
+  const size_t n = 10000;
+  std::vector<float> position(3 * n);
+  for (size_t i = 0; i < 3 * n; i++) {
+    position[i] = 0.25f * (float)(i % 1000);
+  }
+  position[5]    = BitsToFloat(0x7fc00000u);
+  position[7777] = BitsToFloat(0xffc00042u);
+  position[100]  = std::numeric_limits<float>::infinity();
+
+  const std::string a         = dir + "/diff_a.dat";
+  const std::string same      = dir + "/diff_same.dat";     // Other chunks and layout.
+  const std::string changed   = dir + "/diff_changed.dat";  // One value changed.
+  const std::string nanNumber = dir + "/diff_nan.dat";      // NaN against a number.
+  CHECK(WriteDiffFile(a, position, 12 * 1000, 0));
+  CHECK(WriteDiffFile(same, position, 12 * 4096, PARTICLE_CHANNEL_FLAG_PLANAR));
+
+  std::vector<float> p = position;
+  p[6] += 0.5f;   // In the chunk holding the first NaN.
+  CHECK(WriteDiffFile(changed, p, 12 * 1000, 0));
+  p = position;
+  p[5] = 1.0f;
+  CHECK(WriteDiffFile(nanNumber, p, 12 * 1000, 0));
+
+  const std::string diff = "'" + diffPath + "' ";
+  std::string output;
+  CHECK(RunDiff(output, diff + a + " " + a) == 0);
+  CHECK(RunDiff(output, diff + a + " " + same) == 0);     // Whole channel path.
+  CHECK(RunDiff(output, diff + a + " " + changed) == 1);
+  CHECK(RunDiff(output, diff + "--epsilon 1 " + a + " " + changed) == 0);  // Chunk path.
+  CHECK(RunDiff(output, diff + "--epsilon 1 " + a + " " + nanNumber) == 1);
+  CHECK(RunDiff(output, diff + a + " " + dir + "/no_such.dat") == 2);
+
+  // Directories: the summary counts the files of both.
+  const std::string dirA = dir + "/diff_dir_a";
+  const std::string dirB = dir + "/diff_dir_b";
+  CHECK((mkdir(dirA.c_str(), 0755) == 0) && (mkdir(dirB.c_str(), 0755) == 0));
+  CHECK(WriteDiffFile(dirA + "/x.dat", position, 12 * 1000, 0));
+  CHECK(WriteDiffFile(dirB + "/x.dat", position, 12 * 4096, 0));
+  CHECK(WriteDiffFile(dirB + "/y.dat", position, 12 * 1000, 0));
+  CHECK(RunDiff(output, diff + dirA + " " + dirB) == 1);
+  CHECK(output.find("1 of 2 files differ") != std::string::npos);
+  CHECK(RunDiff(output, diff + dirB + " " + dirA) == 1);
+  CHECK(output.find("1 of 2 files differ") != std::string::npos);
+
+  printf("particle-diff: ok\n");
+}
+
+//
+// Prefetcher
+//
+
+static void
+TestPrefetcher(
+  const std::string& dir)   // in
+{
+  const std::string pattern = dir + "/seq.%04d.dat";
+  char buf[4096];
+
+  std::vector<float> position(3 * 1000);
+  for (size_t i = 0; i < position.size(); i++) {
+    position[i] = (float)i;
+  }
+
+  // Frames 1-3 exist, 4 and later are "still being written".
+  for (int f = 1; f <= 3; f++) {
+    position[0] = (float)f;
+    snprintf(buf, sizeof(buf), pattern.c_str(), f);
+    CHECK(WriteDiffFile(buf, position, 12 * 256, 0));
+  }
+
+  {
+    ParticlePrefetcher prefetcher(pattern, 1, 3, 4);
+    prefetcher.SetPosition(1, 1);
+    for (int f = 1; f <= 3; f++) {
+      const ParticleFrame* frame = prefetcher.Acquire(f);
+      const ParticleFrame::Channel* ch = frame ? frame->FindChannel("body", "position") : NULL;
+      CHECK(frame && (frame->frame == f) && ch && (ch->data.size() == 4 * position.size()) &&
+            (*reinterpret_cast<const float*>(&ch->data[0]) == (float)f));
+      prefetcher.Release(frame);
+      prefetcher.SetPosition(f + 1, 1);
+    }
+
+    // Missing when requested, or when prefetched.
+    CHECK(prefetcher.Acquire(4) == NULL);
+    usleep(200 * 1000);   // Let the worker fail frames 5 and 6 ahead.
+
+    for (int f = 4; f <= 6; f++) {
+      position[0] = (float)f;
+      snprintf(buf, sizeof(buf), pattern.c_str(), f);
+      CHECK(WriteDiffFile(buf, position, 12 * 256, 0));
+    }
+    for (int f = 4; f <= 6; f++) {
+      const ParticleFrame* frame = prefetcher.Acquire(f);
+      CHECK(frame && (frame->frame == f));
+      prefetcher.Release(frame);
+    }
+
+    // Backward, and a scrub far away.
+    prefetcher.SetPosition(6, -1);
+    const ParticleFrame* frame = prefetcher.Acquire(5);
+    CHECK(frame && (frame->frame == 5));
+    prefetcher.Release(frame);
+    prefetcher.SetPosition(100, 1);
+    CHECK(prefetcher.Acquire(100) == NULL);
+    frame = prefetcher.Acquire(2);
+    CHECK(frame && (frame->frame == 2));
+    prefetcher.Release(frame);
+  }
+
+  printf("prefetcher: ok\n");
+}
+
+static void
+RemoveTree(
+  const std::string& path)
+{
+  DIR* dir = opendir(path.c_str());
+  if (dir) {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      const std::string name = entry->d_name;
+      if ((name != ".") && (name != "..")) {
+        RemoveTree(path + "/" + name);
+      }
+    }
+    closedir(dir);
+    rmdir(path.c_str());
+  } else {
+    unlink(path.c_str());
+  }
+}
+
+int
+main(
+  int argc,
+  char** argv)
+{
+  char dirTemplate[] = "/tmp/particle-test.XXXXXX";
+  if (!mkdtemp(dirTemplate)) {
+    fprintf(stderr, "Failed to create a temporary directory.\n");
+    return EXIT_FAILURE;
+  }
+  const std::string dir = dirTemplate;
+
+  TestCodecs();
+  TestStats();
+  TestFilter();
+
+  std::vector<std::string> files;
+  TestWriterReader(files, dir, false);
+  TestWriterReader(files, dir, true);
+  TestIdIndex(dir);
+  TestDensity(dir);
+  TestBatch(files);
+  TestManifest(dir);
+  TestWorkQueue(dir);
+  TestPrefetcher(dir);
+  if (argc > 1) {
+    TestDiff(dir, argv[1]);
+  } else {
+    printf("particle-diff: skipped(not given)\n");
+  }
+
+  RemoveTree(dir);
+
+  printf("%d of %d checks failed.\n", gNumFailures, gNumChecks);
+  return (gNumFailures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,350 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Writer for the custom particle format.
+//
+// Each channel is split into chunks of at most `chunkSize` bytes and the
+// codec is chosen per chunk, so a noisy region of a channel does not
+// force the whole channel into an expensive codec.
+//
+
+// To handle 2GB+ file.
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "particle_writer.h"
+#include "particle_format.h"
+#include "particle_stats.h"
+#include "particle_arena.h"
+#include "particle_pack.h"
+#include "particle_hash.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+void
+ParticleWriter::BeginBody(
+  const std::string& name,
+  size_t numParticles,
+  uint32_t flags)
+{
+  assert(name.size() < PARTICLE_BODY_NAME_LEN);
+
+  Body body;
+  body.name         = name;
+  body.numParticles = numParticles;
+  body.flags        = flags;
+  bodies_.push_back(body);
+}
+
+void
+ParticleWriter::AddChannel(
+  const std::string& name,
+  int type,
+  const void* data,
+  size_t numElements,
+  uint32_t flags,
+  int codec)
+{
+  assert(!bodies_.empty());
+  assert(name.size() < PARTICLE_CHANNEL_NAME_LEN);
+  assert(GetParticleTypeSize(type) > 0);
+
+  Channel channel;
+  channel.name        = name;
+  channel.type        = type;
+  channel.data        = reinterpret_cast<const char*>(data);
+  channel.numElements = numElements;
+  channel.flags       = flags;
+  channel.codec       = codec;
+  channel.body        = (int)bodies_.size() - 1;
+  channels_.push_back(channel);
+}
+
+static uint64_t
+AlignUp(
+  uint64_t offset)
+{
+  return (offset + PARTICLE_FILE_ALIGNMENT - 1) & ~(uint64_t)(PARTICLE_FILE_ALIGNMENT - 1);
+}
+
+// Smallest multiple of both `elementSize` and PARTICLE_FILE_ALIGNMENT.
+static int
+GetChunkUnit(
+  int elementSize)
+{
+  int unit = elementSize;
+  while (unit % PARTICLE_FILE_ALIGNMENT) {
+    unit += elementSize;
+  }
+  return unit;
+}
+
+// AoS -> SoA.
+static void
+TransposeToPlanes(
+  char* dst,
+  const char* src,
+  size_t numElements,
+  int numComponents,
+  int wordSize)
+{
+  for (int c = 0; c < numComponents; c++) {
+    char* plane = dst + c * numElements * wordSize;
+    for (size_t i = 0; i < numElements; i++) {
+      memcpy(plane + i * wordSize, src + (i * numComponents + c) * wordSize, wordSize);
+    }
+  }
+}
+
+bool
+ParticleWriter::Write(
+  const char* filename)
+{
+  std::vector<ParticleBodyHeader>     bodyHeaders(bodies_.size());
+  std::vector<ParticleChannelHeader>  channelHeaders(channels_.size());
+  std::vector<ParticleChunkHeader>    chunkHeaders;
+  std::vector<const char*>            payloads;   // In `arena`.
+
+  ParticleArena  localArena(16 * 1024 * 1024);
+  ParticleArena& arena = arena_ ? *arena_ : localArena;
+
+  // Compression output, reused by all chunks.
+  std::vector<char> encoded;
+
+  //
+  // Encode all chunks first so that the offsets are known before writing
+  // the header.
+  //
+  for (size_t c = 0; c < channels_.size(); c++) {
+    const Channel& channel = channels_[c];
+    const int wordSize      = GetParticleTypeWordSize(channel.type);
+    const int numComponents = GetParticleTypeSize(channel.type) / wordSize;
+    const size_t totalSize  = channel.numElements * GetParticleTypeSize(channel.type);
+
+    const bool integer      = (channel.type != PARTICLE_TYPE_FLOAT) &&
+                              (channel.type != PARTICLE_TYPE_FLOAT3);
+    const int channelCodec  = (channel.codec != PARTICLE_CODEC_AUTO) ? channel.codec : option_.codec;
+
+    // Planar layout is meaningless for scalar channels.
+    const bool planar = (channel.flags & PARTICLE_CHANNEL_FLAG_PLANAR) && (numComponents > 1);
+
+    const char*       data = channel.data;
+    int               elementSize = GetParticleTypeSize(channel.type);
+    int               numPlanes   = 1;
+    if (planar) {
+      char* planes = reinterpret_cast<char*>(arena.Allocate(totalSize));
+      TransposeToPlanes(planes, channel.data, channel.numElements, numComponents, wordSize);
+      data        = planes;
+      elementSize = wordSize;
+      numPlanes   = numComponents;
+    }
+    const size_t planeSize = totalSize / numPlanes;
+
+    const int unit = GetChunkUnit(elementSize);
+    int chunkSize  = option_.chunkSize - (option_.chunkSize % unit);
+    if (chunkSize < unit) chunkSize = unit;
+
+    size_t storedTotal = 0;   // Newly stored, in this file or the pack.
+    int    codecCount[PARTICLE_CODEC_COUNT] = {0};
+    int    numReused   = 0;   // Chunks found in the pack.
+
+    ParticleChannelHeader& header = channelHeaders[c];
+    memset(&header, 0, sizeof(ParticleChannelHeader));
+    strncpy(header.name, channel.name.c_str(), PARTICLE_CHANNEL_NAME_LEN - 1);
+    header.type        = channel.type;
+    header.numElements = channel.numElements;
+    header.flags       = planar ? PARTICLE_CHANNEL_FLAG_PLANAR : 0;
+    InitStats(header.stats);
+
+    // A chunk never crosses a plane boundary.
+    for (size_t begin = 0; begin < totalSize; ) {
+      size_t planeEnd = (begin / planeSize + 1) * planeSize;
+      int size = (int)std::min(planeEnd - begin, (size_t)chunkSize);
+      const char* src = data + begin;
+      const int plane = planar ? (int)(begin / planeSize) : -1;
+
+      ParticleChunkHeader chunk;
+      memset(&chunk, 0, sizeof(ParticleChunkHeader));
+
+      // Stats pass also brings the chunk into cache for the compressor.
+      ComputeStats(chunk.stats, src, size, channel.type, plane);
+      MergeStats(header.stats, chunk.stats);
+      chunk.hash = HashBytes64(src, size, 0);
+
+      const ParticlePack::Entry* packed = NULL;
+      uint64_t key = 0;
+      if (pack_) {
+        key    = GetPackKey(src, size, elementSize, wordSize);
+        packed = pack_->Find(key);
+        if (packed && (packed->rawSize != (uint32_t)size)) {
+          packed = NULL;    // Hash collision. Stored in the file instead.
+          key    = 0;
+        } else if (packed) {
+          numReused++;
+        }
+      }
+
+      if (!packed) {
+        int codec = channelCodec;
+        if (codec == PARTICLE_CODEC_AUTO) {
+          codec = SelectCodec(src, size, elementSize, wordSize, integer, option_);
+        }
+        codec = EncodeChunk(encoded, codec, src, size, elementSize, wordSize);
+
+        if (key != 0) {
+          packed = pack_->Append(key, codec, size, encoded.empty() ? NULL : &encoded[0], encoded.size());
+        }
+
+        chunk.codec      = codec;
+        chunk.storedSize = encoded.size();
+        storedTotal     += chunk.storedSize;
+      }
+
+      chunk.rawSize = size;
+      if (packed) {
+        chunk.codec      = packed->codec;
+        chunk.storedSize = packed->storedSize;
+        chunk.flags      = PARTICLE_CHUNK_FLAG_PACKED;
+        chunk.offset     = key;
+        payloads.push_back(NULL);
+      } else {
+        char* payload = reinterpret_cast<char*>(arena.Allocate(encoded.size()));
+        if (!encoded.empty()) memcpy(payload, &encoded[0], encoded.size());
+        payloads.push_back(payload);
+      }
+      chunkHeaders.push_back(chunk);
+
+      header.numChunks++;
+      codecCount[chunk.codec]++;
+
+      begin += size;
+    }
+
+    // Histogram bins need the range of the whole channel.
+    for (int plane = 0; plane < numPlanes; plane++) {
+      AccumulateHistogram(header.histogram, header.stats, data + plane * planeSize, planeSize,
+                          channel.type, planar ? plane : -1);
+    }
+
+    printf("  Channel %s/%s: %lld bytes -> %lld bytes (",
+      bodies_[channel.body].name.c_str(), channel.name.c_str(),
+      (long long)totalSize, (long long)storedTotal);
+    for (int i = 0; i < PARTICLE_CODEC_COUNT; i++) {
+      printf("%s%s:%d", (i > 0) ? " " : "", GetCodecName(i), codecCount[i]);
+    }
+    if (pack_) {
+      printf(" reused:%d", numReused);
+    }
+    printf(")\n");
+  }
+
+  //
+  // Body table. Channels were added body by body, so each body owns a
+  // contiguous channel range.
+  //
+  uint64_t numParticles = 0;
+  uint32_t numChannels  = 0;
+  for (size_t b = 0; b < bodies_.size(); b++) {
+    ParticleBodyHeader& header = bodyHeaders[b];
+    memset(&header, 0, sizeof(ParticleBodyHeader));
+    strncpy(header.name, bodies_[b].name.c_str(), PARTICLE_BODY_NAME_LEN - 1);
+    header.firstParticle = numParticles;
+    header.numParticles  = bodies_[b].numParticles;
+    header.firstChannel  = numChannels;
+    header.flags         = bodies_[b].flags;
+    while ((numChannels < channels_.size()) && (channels_[numChannels].body == (int)b)) {
+      header.numChannels++;
+      numChannels++;
+    }
+    numParticles += bodies_[b].numParticles;
+  }
+
+  const uint64_t headerSize = sizeof(ParticleFileHeader)
+                            + sizeof(ParticleBodyHeader) * bodyHeaders.size()
+                            + sizeof(ParticleChannelHeader) * channelHeaders.size()
+                            + sizeof(ParticleChunkHeader) * chunkHeaders.size();
+
+  uint64_t offset = headerSize;
+  for (size_t i = 0; i < chunkHeaders.size(); i++) {
+    if (chunkHeaders[i].flags & PARTICLE_CHUNK_FLAG_PACKED) {
+      continue;   // `offset` holds the pack key.
+    }
+    offset = AlignUp(offset);
+    chunkHeaders[i].offset = offset;
+    offset += chunkHeaders[i].storedSize;
+  }
+
+  ParticleFileHeader fileHeader;
+  memset(&fileHeader, 0, sizeof(ParticleFileHeader));
+  memcpy(fileHeader.magic, PARTICLE_FILE_MAGIC, 4);
+  fileHeader.version      = PARTICLE_FILE_VERSION;
+  fileHeader.numParticles = numParticles;
+  fileHeader.numChannels  = channelHeaders.size();
+  fileHeader.numBodies    = bodyHeaders.size();
+  if (pack_) {
+    assert(packName_.size() < PARTICLE_PACK_NAME_LEN);
+    strncpy(fileHeader.packName, packName_.c_str(), PARTICLE_PACK_NAME_LEN - 1);
+  }
+
+  // Write to a temporary file and rename it, so that a reader(or a watch
+  // mode consumer) never sees a partially written file.
+  std::string tmpFilename = std::string(filename) + ".tmp";
+
+  FILE* fp = fopen(tmpFilename.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "Failed to open %s for writing.\n", tmpFilename.c_str());
+    return false;
+  }
+
+  // Every write is checked: a short write(e.g. disk full) must not be
+  // renamed into place.
+  bool ok = (fwrite(&fileHeader, sizeof(ParticleFileHeader), 1, fp) == 1);
+
+  if (ok && !bodyHeaders.empty()) {
+    ok = (fwrite(&bodyHeaders[0], sizeof(ParticleBodyHeader), bodyHeaders.size(), fp) == bodyHeaders.size());
+  }
+
+  if (ok && !channelHeaders.empty()) {
+    ok = (fwrite(&channelHeaders[0], sizeof(ParticleChannelHeader), channelHeaders.size(), fp) == channelHeaders.size());
+  }
+
+  if (ok && !chunkHeaders.empty()) {
+    ok = (fwrite(&chunkHeaders[0], sizeof(ParticleChunkHeader), chunkHeaders.size(), fp) == chunkHeaders.size());
+  }
+
+  uint64_t pos = headerSize;
+  const char padding[PARTICLE_FILE_ALIGNMENT] = {0};
+  for (size_t i = 0; ok && (i < payloads.size()); i++) {
+    if (!payloads[i]) {
+      continue;   // Packed.
+    }
+    size_t padSize = chunkHeaders[i].offset - pos;
+    if (padSize > 0) {
+      ok = (fwrite(padding, sizeof(char), padSize, fp) == padSize);
+    }
+    pos = chunkHeaders[i].offset;
+
+    if (!ok || (chunkHeaders[i].storedSize == 0)) continue;
+    ok = (fwrite(payloads[i], sizeof(char), chunkHeaders[i].storedSize, fp) == chunkHeaders[i].storedSize);
+    pos += chunkHeaders[i].storedSize;
+  }
+
+  if ((fclose(fp) != 0) || !ok) {
+    fprintf(stderr, "Failed to write %s.\n", tmpFilename.c_str());
+    remove(tmpFilename.c_str());
+    return false;
+  }
+
+  if (rename(tmpFilename.c_str(), filename) != 0) {
+    perror(filename);
+    remove(tmpFilename.c_str());
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,88 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Writer for the custom particle format(see particle_format.h).
+//
+#ifndef PARTICLE_WRITER_H_
+#define PARTICLE_WRITER_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "particle_codec.h"
+
+class ParticleArena;
+class ParticlePack;
+
+class ParticleWriter
+{
+ public:
+  ParticleWriter(const ParticleCodecOption& option) : option_(option), arena_(NULL), pack_(NULL) {}
+  ~ParticleWriter() {}
+
+  // Transpose and compressed buffers of Write() are taken from `arena`
+  // (not reset by the writer). Without it, Write() uses a temporary arena.
+  void SetArena(ParticleArena* arena) { arena_ = arena; }
+
+  //
+  // Store chunk payloads in `pack`(opened writable), recorded in the file
+  // as `packName`, which must be the pack's filename relative to the
+  // directory of the written file. Chunks already in the pack are
+  // neither compressed nor stored again.
+  //
+  void SetPack(ParticlePack* pack, const std::string& packName) {
+    pack_     = pack;
+    packName_ = packName;
+  }
+
+  // Start a new body. Following AddChannel() calls add to this body.
+  void BeginBody(
+    const std::string& name,  // in
+    size_t numParticles,      // in
+    uint32_t flags = 0);      // in  PARTICLE_BODY_FLAG_*
+
+  // `data` must stay alive until Write() returns. Always interleaved; the
+  // writer transposes it when PARTICLE_CHANNEL_FLAG_PLANAR is given.
+  // `codec` other than PARTICLE_CODEC_AUTO overrides the writer's codec for
+  // this channel(e.g. PARTICLE_CODEC_BITPACK for ids).
+  void AddChannel(
+    const std::string& name,  // in
+    int type,                 // in  ParticleValueType
+    const void* data,         // in
+    size_t numElements,       // in
+    uint32_t flags = 0,       // in  PARTICLE_CHANNEL_FLAG_*
+    int codec = PARTICLE_CODEC_AUTO); // in  ParticleCodec
+
+  bool Write(
+    const char* filename);    // in
+
+ private:
+  struct Body {
+    std::string name;
+    size_t      numParticles;
+    uint32_t    flags;
+  };
+
+  struct Channel {
+    std::string name;
+    int         type;
+    const char* data;
+    size_t      numElements;
+    uint32_t    flags;
+    int         codec;
+    int         body;
+  };
+
+  ParticleCodecOption  option_;
+  ParticleArena*       arena_;
+  ParticlePack*        pack_;
+  std::string          packName_;
+  std::vector<Body>    bodies_;
+  std::vector<Channel> channels_;
+};
+
+#endif  // PARTICLE_WRITER_H_
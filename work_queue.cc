@@ -0,0 +1,414 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+#include "work_queue.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static bool
+FileExists(
+  const std::string& filename)
+{
+  struct stat st;
+  return (stat(filename.c_str(), &st) == 0);
+}
+
+static bool
+MakeDirectory(
+  const std::string& dir)
+{
+  return (mkdir(dir.c_str(), 0755) == 0) || (errno == EEXIST);
+}
+
+// Create `filename` exclusively. Returns false when it exists already.
+static bool
+CreateExclusive(
+  const std::string& filename,
+  const std::string& content)
+{
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  ssize_t n = write(fd, content.data(), content.size());
+  (void)n;  // Content is informational only.
+  close(fd);
+  return true;
+}
+
+void
+WorkStats::Merge(
+  const WorkStats& rhs)
+{
+  numBodies    += rhs.numBodies;
+  numParticles += rhs.numParticles;
+  numFiles     += rhs.numFiles;
+  numBytes     += rhs.numBytes;
+  seconds      += rhs.seconds;
+}
+
+WorkQueue::WorkQueue(
+  const std::string& dir,
+  int leaseTimeout,
+  int maxAttempts)
+  : dir_(dir)
+  , leaseTimeout_(leaseTimeout)
+  , maxAttempts_(maxAttempts)
+  , heartbeatRunning_(false)
+  , stopHeartbeat_(false)
+{
+  char host[256] = "localhost";
+  gethostname(host, sizeof(host) - 1);
+  std::ostringstream ss;
+  ss << host << ":" << getpid();
+  workerId_ = ss.str();
+
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+}
+
+WorkQueue::~WorkQueue()
+{
+  StopHeartbeat();
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+std::string
+WorkQueue::GetPath(
+  const char* sub,
+  int item) const
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "/%06d", item);
+  return dir_ + "/" + sub + buf;
+}
+
+bool
+WorkQueue::Create(
+  const std::vector<std::string>& args,
+  const std::vector<WorkItem>& items)
+{
+  if (!MakeDirectory(dir_) || !MakeDirectory(dir_ + "/lease") ||
+      !MakeDirectory(dir_ + "/done") || !MakeDirectory(dir_ + "/fail")) {
+    fprintf(stderr, "Failed to create work directory %s.\n", dir_.c_str());
+    return false;
+  }
+
+  // Done/fail records of an old manifest would not match the new items.
+  const std::string filename = dir_ + "/work.manifest";
+  if (FileExists(filename)) {
+    fprintf(stderr, "%s already exists. Use a new work directory.\n", filename.c_str());
+    return false;
+  }
+
+  std::string tmpFilename = filename + ".tmp";
+  {
+    std::ofstream ofs(tmpFilename.c_str());
+    if (!ofs) {
+      return false;
+    }
+    for (size_t i = 0; i < args.size(); i++) {
+      ofs << "arg " << args[i] << "\n";
+    }
+    for (size_t i = 0; i < items.size(); i++) {
+      ofs << "item " << items[i].body << " " << items[i].input << "\n";
+    }
+    if (!ofs) {
+      return false;
+    }
+  }
+
+  if (rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    remove(tmpFilename.c_str());
+    return false;
+  }
+
+  args_  = args;
+  items_ = items;
+  return true;
+}
+
+bool
+WorkQueue::Load()
+{
+  std::ifstream ifs((dir_ + "/work.manifest").c_str());
+  if (!ifs) {
+    return false;
+  }
+
+  args_.clear();
+  items_.clear();
+
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream ss(line);
+    std::string tag;
+    ss >> tag;
+
+    if (tag == "arg") {
+      std::string arg;
+      std::getline(ss >> std::ws, arg);   // May contain spaces.
+      args_.push_back(arg);
+    } else if (tag == "item") {
+      WorkItem item;
+      ss >> item.body;
+      std::getline(ss >> std::ws, item.input);
+      if (!ss && item.input.empty()) {
+        return false;
+      }
+      items_.push_back(item);
+    }
+  }
+
+  return true;
+}
+
+int
+WorkQueue::GetNumFailures(
+  int item) const
+{
+  int k = 0;
+  for (;;) {
+    std::ostringstream ss;
+    ss << GetPath("fail", item) << "." << k;
+    if (!FileExists(ss.str())) {
+      return k;
+    }
+    k++;
+  }
+}
+
+WorkQueue::State
+WorkQueue::GetState(
+  int item) const
+{
+  if (FileExists(GetPath("done", item))) {
+    return STATE_DONE;
+  }
+  if (GetNumFailures(item) >= maxAttempts_) {
+    return STATE_FAILED;
+  }
+  if (FileExists(GetPath("lease", item))) {
+    return STATE_LEASED;
+  }
+  return STATE_FREE;
+}
+
+bool
+WorkQueue::Claim(
+  int item)
+{
+  const State state = GetState(item);
+  if ((state == STATE_DONE) || (state == STATE_FAILED)) {
+    return false;
+  }
+
+  const std::string path = GetPath("lease", item);
+  if (!CreateExclusive(path, workerId_ + "\n")) {
+    if (errno != EEXIST) {
+      return false;
+    }
+
+    struct stat st;
+    if ((stat(path.c_str(), &st) != 0) || (time(NULL) - st.st_mtime <= leaseTimeout_)) {
+      return false;   // Released meanwhile, or alive.
+    }
+
+    //
+    // Take over a dead worker's lease. Of the workers racing here only one
+    // can rename it. A lease found fresh after the rename belongs to a
+    // worker which took over just before, so it is put back.
+    //
+    const std::string stale = path + ".stale." + workerId_;
+    if (rename(path.c_str(), stale.c_str()) != 0) {
+      return false;
+    }
+    if ((stat(stale.c_str(), &st) == 0) && (time(NULL) - st.st_mtime <= leaseTimeout_)) {
+      if (link(stale.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "Failed to restore lease %s.\n", path.c_str());
+      }
+      unlink(stale.c_str());
+      return false;
+    }
+    unlink(stale.c_str());
+
+    fprintf(stderr, "Lease of item %d expired. Taking over.\n", item);
+    Fail(item);   // The dead worker's attempt.
+    if ((GetState(item) == STATE_FAILED) || !CreateExclusive(path, workerId_ + "\n")) {
+      return false;
+    }
+  }
+
+  // Finished by another worker between the state check and the lease.
+  if (FileExists(GetPath("done", item))) {
+    unlink(path.c_str());
+    return false;
+  }
+
+  StopHeartbeat();
+  leasePath_        = path;
+  stopHeartbeat_    = false;
+  heartbeatRunning_ = (pthread_create(&heartbeat_, NULL, HeartbeatEntry, this) == 0);
+
+  return true;
+}
+
+void*
+WorkQueue::HeartbeatEntry(
+  void* arg)
+{
+  WorkQueue* self = reinterpret_cast<WorkQueue*>(arg);
+  const int interval = (self->leaseTimeout_ >= 8) ? (self->leaseTimeout_ / 4) : 1;
+
+  pthread_mutex_lock(&self->mutex_);
+  while (!self->stopHeartbeat_) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec deadline;
+    deadline.tv_sec  = now.tv_sec + interval;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    pthread_cond_timedwait(&self->cond_, &self->mutex_, &deadline);
+
+    if (!self->stopHeartbeat_) {
+      utime(self->leasePath_.c_str(), NULL);
+    }
+  }
+  pthread_mutex_unlock(&self->mutex_);
+
+  return NULL;
+}
+
+void
+WorkQueue::StopHeartbeat()
+{
+  if (!heartbeatRunning_) {
+    return;
+  }
+
+  pthread_mutex_lock(&mutex_);
+  stopHeartbeat_ = true;
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&mutex_);
+
+  pthread_join(heartbeat_, NULL);
+  heartbeatRunning_ = false;
+}
+
+bool
+WorkQueue::Complete(
+  int item,
+  const WorkStats& stats)
+{
+  StopHeartbeat();
+
+  const std::string filename    = GetPath("done", item);
+  const std::string tmpFilename = filename + ".tmp." + workerId_;
+  {
+    std::ofstream ofs(tmpFilename.c_str());
+    ofs << "bodies "    << stats.numBodies    << "\n"
+        << "particles " << stats.numParticles << "\n"
+        << "files "     << stats.numFiles     << "\n"
+        << "bytes "     << stats.numBytes     << "\n"
+        << "seconds "   << stats.seconds      << "\n"
+        << "worker "    << workerId_          << "\n";
+    if (!ofs) {
+      remove(tmpFilename.c_str());
+      Fail(item);
+      return false;
+    }
+  }
+
+  bool ok = (rename(tmpFilename.c_str(), filename.c_str()) == 0);
+  if (!ok) {
+    remove(tmpFilename.c_str());
+  }
+  unlink(GetPath("lease", item).c_str());
+
+  return ok;
+}
+
+void
+WorkQueue::Fail(
+  int item)
+{
+  if (leasePath_ == GetPath("lease", item)) {
+    StopHeartbeat();
+  }
+
+  // Attempts are numbered by exclusive creation, so concurrent failures
+  // of the same item are all counted.
+  for (int k = GetNumFailures(item); ; k++) {
+    std::ostringstream ss;
+    ss << GetPath("fail", item) << "." << k;
+    if (CreateExclusive(ss.str(), workerId_ + "\n") || (errno != EEXIST)) {
+      break;
+    }
+  }
+
+  unlink(GetPath("lease", item).c_str());
+}
+
+bool
+WorkQueue::Merge(
+  WorkStats& total,
+  int& numFailed)
+{
+  total     = WorkStats();
+  numFailed = 0;
+
+  std::ostringstream failed;
+  for (int i = 0; i < (int)items_.size(); i++) {
+    State state = GetState(i);
+    if (state == STATE_FAILED) {
+      numFailed++;
+      failed << "failed " << items_[i].body << " " << items_[i].input << "\n";
+      continue;
+    }
+    if (state != STATE_DONE) {
+      return false;
+    }
+
+    std::ifstream ifs(GetPath("done", i).c_str());
+    WorkStats stats;
+    std::string tag;
+    while (ifs >> tag) {
+      if      (tag == "bodies")    ifs >> stats.numBodies;
+      else if (tag == "particles") ifs >> stats.numParticles;
+      else if (tag == "files")     ifs >> stats.numFiles;
+      else if (tag == "bytes")     ifs >> stats.numBytes;
+      else if (tag == "seconds")   ifs >> stats.seconds;
+      else                         ifs >> tag;
+    }
+    total.Merge(stats);
+  }
+
+  const std::string filename    = dir_ + "/summary.txt";
+  const std::string tmpFilename = filename + ".tmp." + workerId_;
+  {
+    std::ofstream ofs(tmpFilename.c_str());
+    ofs << "items "     << items_.size()       << "\n"
+        << "bodies "    << total.numBodies     << "\n"
+        << "particles " << total.numParticles  << "\n"
+        << "files "     << total.numFiles      << "\n"
+        << "bytes "     << total.numBytes      << "\n"
+        << "seconds "   << total.seconds       << "\n"
+        << failed.str();
+  }
+  if (rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    remove(tmpFilename.c_str());
+  }
+
+  return true;
+}
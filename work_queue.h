@@ -0,0 +1,123 @@
+//
+// Copyright Syoyo Fujita, Light Transport Entertainment Inc.
+//
+
+//
+// Work queue for sharded conversion over many processes/hosts.
+//
+// A coordinator writes a work manifest of (input, body) items into a
+// directory on shared storage. Workers claim items with lease files
+// created by O_CREAT | O_EXCL, keep them alive by touching them, and
+// record per item stats when done. A lease not touched for `leaseTimeout`
+// seconds is taken over(its worker is assumed dead). A failed item is
+// retried until it failed `maxAttempts` times. Items are idempotent(outputs
+// are written atomically), so the rare double claim after a takeover race
+// only costs time.
+//
+// Directory layout:
+//
+//   work.manifest         "arg <token>" x N, "item <body> <input>" x M
+//   lease/<item>          Held by a worker. Content is the worker id.
+//   done/<item>           Stats of a finished item.
+//   fail/<item>.<k>       k'th failed attempt.
+//   summary.txt           Merged stats, written when all items finished.
+//
+#ifndef WORK_QUEUE_H_
+#define WORK_QUEUE_H_
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+struct WorkItem
+{
+  std::string input;    // EMP filename.
+  int         body;     // Body index, or -1 for all bodies of the frame.
+};
+
+struct WorkStats
+{
+  uint64_t numBodies;
+  uint64_t numParticles;
+  uint64_t numFiles;
+  uint64_t numBytes;
+  double   seconds;
+
+  WorkStats() : numBodies(0), numParticles(0), numFiles(0), numBytes(0), seconds(0.0) {}
+
+  void Merge(const WorkStats& rhs);
+};
+
+class WorkQueue
+{
+ public:
+  enum State {
+    STATE_FREE,
+    STATE_LEASED,
+    STATE_DONE,
+    STATE_FAILED      // Failed `maxAttempts` times. Not retried.
+  };
+
+  WorkQueue(
+    const std::string& dir,
+    int leaseTimeout = 300,   // seconds
+    int maxAttempts  = 3);
+  ~WorkQueue();
+
+  // Coordinator. `args` are the conversion options every worker uses.
+  bool Create(
+    const std::vector<std::string>& args,     // in
+    const std::vector<WorkItem>& items);      // in
+
+  // Worker.
+  bool Load();
+
+  const std::vector<std::string>& GetArguments() const { return args_; }
+  const std::vector<WorkItem>&    GetItems() const { return items_; }
+
+  State GetState(int item) const;
+
+  //
+  // Try to lease `item`. On success the lease is touched by a background
+  // thread until Complete() or Fail().
+  //
+  bool Claim(int item);
+  bool Complete(int item, const WorkStats& stats);
+  void Fail(int item);
+
+  //
+  // Sum stats of all done items into `total` and write summary.txt.
+  // Returns false while some item is neither done nor failed.
+  //
+  bool Merge(WorkStats& total, int& numFailed);
+
+  const std::string& GetWorkerId() const { return workerId_; }
+
+ private:
+  WorkQueue(const WorkQueue&);
+  WorkQueue& operator=(const WorkQueue&);
+
+  std::string GetPath(const char* sub, int item) const;
+  int  GetNumFailures(int item) const;
+  void StopHeartbeat();
+
+  static void* HeartbeatEntry(void* arg);
+
+  std::string               dir_;
+  int                       leaseTimeout_;
+  int                       maxAttempts_;
+  std::string               workerId_;    // host:pid
+  std::vector<std::string>  args_;
+  std::vector<WorkItem>     items_;
+
+  // Heartbeat of the claimed item.
+  pthread_t                 heartbeat_;
+  pthread_mutex_t           mutex_;
+  pthread_cond_t            cond_;
+  bool                      heartbeatRunning_;
+  bool                      stopHeartbeat_;
+  std::string               leasePath_;
+};
+
+#endif  // WORK_QUEUE_H_